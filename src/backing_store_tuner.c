@@ -25,10 +25,14 @@
 #include "config.h"
 #endif
 
+#include <X11/Xatom.h>
+
 #include "xorgVersion.h"
 #include "xf86.h"
 #include "fb.h"
 #include "inputstr.h"
+#include "dixstruct.h"
+#include "property.h"
 
 #include "fbdev_priv.h"
 #include "backing_store_tuner.h"
@@ -46,8 +50,9 @@
  * But the disadvantage of backing store is the same as for ShadowFB. That's a
  * loss of precious RAM, extra buffer copy when somebody tries to update window
  * content, potentially skip of some frames on fast animation (they just do
- * not reach screen). Also hardware accelerated scrolling does not currently
- * work for the windows with backing store enabled.
+ * not reach screen). Also hardware accelerated scrolling does not work for
+ * the windows with backing store enabled, unless their backing pixmaps can
+ * be placed in the offscreen part of the framebuffer (see below).
  *
  * We try to make the best use of backing store by enabling backing store for
  * all the windows that are direct children of root, except the one which has
@@ -59,6 +64,384 @@
  *     any intermediate buffer copy overhead.
  */
 
+/*
+ * The decisions are made incrementally. Instead of checking all the
+ * children of root on each PostValidateTree call, we only handle the
+ * windows, which need attention: the new and the old focus windows
+ * on keyboard focus change and the top level windows, which have been
+ * just mapped or reparented to root (these are queued by the
+ * RealizeWindow and ReparentWindow hooks).
+ *
+ * Backing pixmaps may consume a lot of memory if there are many large
+ * windows. If the memory budget is configured, we keep track of the
+ * total size of backing pixmaps and disable backing store for the least
+ * recently used windows (the ones, which have not been visible or had
+ * keyboard focus for the longest time) when the budget gets exceeded.
+ * Such evicted windows only get backing store back when they have been
+ * used again or when there is enough free space in the budget.
+ */
+
+/*
+ * Focus changes can come in bursts (alt-tab, focus follows mouse), and
+ * each switch normally frees one full window backing pixmap and allocates
+ * another one. To avoid thrashing, the new focus window only loses backing
+ * store after it has kept focus for a while, and the few most recently
+ * focused windows keep their state after losing focus (so switching back
+ * and forth between them costs nothing). A window gets backing store back
+ * when it drops out of the recently focused list.
+ */
+
+/*
+ * Backing store is also pointless for some windows. Redrawing tiny
+ * windows (tray icons, ...) is cheaper than keeping a copy, the huge
+ * and very elongated windows (panels, ...) may be not worth the memory,
+ * and the windows, which are redrawn every frame anyway (video, OpenGL
+ * ES via DRI2, animations) only get extra copy overhead. The update rate
+ * is measured with Damage, counting the bursts of drawing requests, and
+ * XV/DRI2 code also gives explicit hints. The policy is rechecked once
+ * per second.
+ */
+
+/* The drawing requests, which are closer in time, belong to one update */
+#define UPDATE_BURST_INTERVAL           8
+/* How long the hints from XV and DRI2 stay valid */
+#define FREQUENT_UPDATES_HINT_TIMEOUT   3000
+#define POLICY_CHECK_INTERVAL           1000
+
+#define BACKING_STORE_USAGE_PROPERTY "_FBTURBO_BACKING_STORE_USAGE"
+
+static void
+WindowDamageReport(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+    BackingStoreWindowPtr rec = closure;
+    CARD32 now = GetTimeInMillis();
+
+    if (now - rec->LastUpdateTime >= UPDATE_BURST_INTERVAL) {
+        rec->UpdatesCount++;
+        rec->LastUpdateTime = now;
+    }
+}
+
+static void
+WindowDamageDestroy(DamagePtr pDamage, void *closure)
+{
+    BackingStoreWindowPtr rec = closure;
+    rec->pDamage = NULL;
+}
+
+static BackingStoreWindowPtr
+LookupWindowRec(BackingStoreTuner *private, WindowPtr pWin, Bool create)
+{
+    BackingStoreWindowPtr rec;
+    HASH_FIND_PTR(private->HashWindows, &pWin, rec);
+    if (!rec && create) {
+        rec = calloc(1, sizeof(BackingStoreWindowRec));
+        if (!rec)
+            return NULL;
+        rec->pWin = pWin;
+        rec->LastUsedTime = GetTimeInMillis();
+        HASH_ADD_PTR(private->HashWindows, pWin, rec);
+
+        /* Track the window updates if the policy needs this */
+        if (private->MaxUpdateRate && !private->ForceBackingStore) {
+            rec->pDamage = DamageCreate(WindowDamageReport, WindowDamageDestroy,
+                                        DamageReportRawRegion, TRUE,
+                                        pWin->drawable.pScreen, rec);
+            if (rec->pDamage)
+                DamageRegister(&pWin->drawable, rec->pDamage);
+        }
+    }
+    return rec;
+}
+
+static void
+QueueWindowRec(BackingStoreTuner *private, BackingStoreWindowPtr rec)
+{
+    if (rec->Pending)
+        return;
+    rec->Pending = TRUE;
+    rec->NextPending = private->PendingWindows;
+    private->PendingWindows = rec;
+}
+
+static void
+ForgetWindowRec(BackingStoreTuner *private, BackingStoreWindowPtr rec)
+{
+    int i;
+
+    if (rec->Pending) {
+        BackingStoreWindowPtr *link = &private->PendingWindows;
+        while (*link != rec)
+            link = &(*link)->NextPending;
+        *link = rec->NextPending;
+    }
+    if (rec->BackingPixmapSize) {
+        private->MemoryUsage -= rec->BackingPixmapSize;
+        private->BackedWindowsCount--;
+    }
+    if (rec->CompressedData) {
+        private->MemoryUsage -= rec->CompressedSize;
+        private->CompressedWindowsCount--;
+        free(rec->CompressedData);
+    }
+    if (rec->pDamage) {
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 14, 99, 2, 0)
+        DamageUnregister(rec->pDamage);
+#else
+        DamageUnregister(&rec->pWin->drawable, rec->pDamage);
+#endif
+        DamageDestroy(rec->pDamage);
+    }
+    if (private->FocusWin == rec->pWin)
+        private->FocusWin = NULL;
+    for (i = 0; i < private->RecentFocusSize; i++) {
+        if (private->RecentFocus[i] == rec->pWin)
+            private->RecentFocus[i] = NULL;
+    }
+    HASH_DEL(private->HashWindows, rec);
+    free(rec);
+}
+
+static Bool
+IsRecentlyFocused(BackingStoreTuner *private, WindowPtr pWin)
+{
+    int i;
+    for (i = 0; i < private->RecentFocusSize; i++) {
+        if (private->RecentFocus[i] == pWin)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Move the window to the head of the recently focused list and return
+ * the window, which has dropped out of the list (or NULL)
+ */
+static WindowPtr
+PushRecentFocus(BackingStoreTuner *private, WindowPtr pWin)
+{
+    WindowPtr dropped;
+    int i;
+
+    if (private->RecentFocusSize <= 0)
+        return NULL;
+
+    for (i = 0; i < private->RecentFocusSize - 1; i++) {
+        if (private->RecentFocus[i] == pWin)
+            break;
+    }
+    dropped = private->RecentFocus[i] == pWin ? NULL : private->RecentFocus[i];
+    for (; i > 0; i--)
+        private->RecentFocus[i] = private->RecentFocus[i - 1];
+    private->RecentFocus[0] = pWin;
+    return dropped;
+}
+
+/* The size of the backing pixmap (it also covers the window border) */
+static size_t
+WindowBackingPixmapSize(WindowPtr pWin)
+{
+    size_t w = pWin->drawable.width + 2 * pWin->borderWidth;
+    size_t h = pWin->drawable.height + 2 * pWin->borderWidth;
+    return w * h * (BitsPerPixel(pWin->drawable.depth) / 8);
+}
+
+static void
+SetWindowBackingStore(ScreenPtr pScreen, WindowPtr pWin, int backingStore)
+{
+    pScreen->backingStoreSupport = Always;
+    pWin->backingStore = backingStore;
+    (*pScreen->ChangeWindowAttributes) (pWin, CWBackingStore);
+}
+
+static void
+EnableBackingStore(ScreenPtr pScreen, BackingStoreTuner *private,
+                   BackingStoreWindowPtr rec)
+{
+    DebugMsg("Enable backing store for window 0x%x\n",
+             (unsigned int)rec->pWin->drawable.id);
+    if (!rec->BackingPixmapSize) {
+        rec->BackingPixmapSize = WindowBackingPixmapSize(rec->pWin);
+        private->MemoryUsage += rec->BackingPixmapSize;
+        private->BackedWindowsCount++;
+    }
+    private->TransitionsCount++;
+    private->TransitionsRateCount++;
+    SetWindowBackingStore(pScreen, rec->pWin, WhenMapped);
+}
+
+static void
+DisableBackingStore(ScreenPtr pScreen, BackingStoreTuner *private,
+                    BackingStoreWindowPtr rec)
+{
+    if (rec->BackingPixmapSize) {
+        private->MemoryUsage -= rec->BackingPixmapSize;
+        private->BackedWindowsCount--;
+        rec->BackingPixmapSize = 0;
+    }
+    private->TransitionsCount++;
+    private->TransitionsRateCount++;
+    SetWindowBackingStore(pScreen, rec->pWin, NotUseful);
+}
+
+/* Check whether the window is worth having backing store */
+static Bool
+PolicyAllowsBackingStore(ScreenPtr pScreen, BackingStoreTuner *private,
+                         BackingStoreWindowPtr rec, CARD32 now)
+{
+    WindowPtr pWin = rec->pWin;
+    unsigned int w = pWin->drawable.width, h = pWin->drawable.height;
+    unsigned int max_update_rate = private->MaxUpdateRate;
+
+    if (private->ForceBackingStore)
+        return TRUE;
+
+    if (private->MinArea && w * h < private->MinArea)
+        return FALSE;
+    if (private->MaxAreaPercent && (CARD64)w * h * 100 >
+            (CARD64)pScreen->width * pScreen->height * private->MaxAreaPercent)
+        return FALSE;
+    if (private->MaxAspect && (w > h * private->MaxAspect ||
+                               h > w * private->MaxAspect))
+        return FALSE;
+
+    if (rec->HasFrequentUpdatesHint &&
+        now - rec->FrequentUpdatesHintTime < FREQUENT_UPDATES_HINT_TIMEOUT)
+        return FALSE;
+
+    /* Some hysteresis, the rejected windows need to calm down first */
+    if (rec->PolicyRejected)
+        max_update_rate /= 2;
+    if (rec->pDamage && rec->UpdateRate > max_update_rate)
+        return FALSE;
+
+    return TRUE;
+}
+
+/* Make the current memory usage available for the clients and in the log */
+static void
+PublishMemoryUsage(ScreenPtr pScreen, BackingStoreTuner *private)
+{
+    CARD32 usage[5];
+    CARD32 now = GetTimeInMillis();
+    Atom atom;
+
+    /* Update the backing store transitions rate once per second */
+    if (now - private->TransitionsRateStart >= 1000) {
+        private->TransitionsPerSecond = (CARD64)private->TransitionsRateCount *
+                                   1000 / (now - private->TransitionsRateStart);
+        private->TransitionsRateCount = 0;
+        private->TransitionsRateStart = now;
+    }
+
+    usage[0] = private->MemoryUsage / 1024;
+    usage[1] = private->MemoryBudget / 1024;
+    usage[2] = private->BackedWindowsCount;
+    usage[3] = private->EvictionsCount;
+    usage[4] = private->TransitionsPerSecond;
+
+    if (memcmp(usage, private->PublishedUsage, sizeof(usage)) == 0)
+        return;
+
+    if (usage[3] != private->PublishedUsage[3]) {
+        xf86DrvMsgVerb(pScreen->myNum, X_INFO, 3,
+                       "backing store uses %u KiB (budget %u KiB) for %u "
+                       "windows, %u evictions so far\n",
+                       (unsigned int)usage[0], (unsigned int)usage[1],
+                       (unsigned int)usage[2], (unsigned int)usage[3]);
+    }
+    if (usage[4] != private->PublishedUsage[4] && usage[4] > 0) {
+        xf86DrvMsgVerb(pScreen->myNum, X_INFO, 3,
+                       "%u backing store transitions per second "
+                       "(%u in total)\n", (unsigned int)usage[4],
+                       private->TransitionsCount);
+    }
+
+    memcpy(private->PublishedUsage, usage, sizeof(usage));
+
+    atom = MakeAtom(BACKING_STORE_USAGE_PROPERTY,
+                    strlen(BACKING_STORE_USAGE_PROPERTY), TRUE);
+    if (atom != BAD_RESOURCE && pScreen->root) {
+        dixChangeWindowProperty(serverClient, pScreen->root, atom,
+                                XA_CARDINAL, 32, PropModeReplace,
+                                5, usage, FALSE);
+    }
+}
+
+/* Disable backing store for the focus window after the dwell time */
+static void
+DemoteFocusWindow(ScreenPtr pScreen, BackingStoreTuner *private)
+{
+    BackingStoreWindowPtr rec;
+
+    if (private->ForceBackingStore || !private->FocusWin ||
+        !private->FocusWin->backStorage)
+        return;
+
+    rec = LookupWindowRec(private, private->FocusWin, FALSE);
+    if (!rec)
+        return;
+
+    DebugMsg("Disable backing store for the focus window 0x%x\n",
+             (unsigned int)rec->pWin->drawable.id);
+    DisableBackingStore(pScreen, private, rec);
+}
+
+static CARD32
+FocusTimerCallback(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    ScreenPtr pScreen = arg;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+
+    DemoteFocusWindow(pScreen, private);
+    PublishMemoryUsage(pScreen, private);
+    return 0;
+}
+
+/* Update the window update rates and apply the policy */
+static CARD32
+PolicyTimerCallback(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    ScreenPtr pScreen = arg;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec, tmp;
+    CARD32 elapsed = now - private->PolicyTime;
+
+    if (elapsed == 0)
+        return POLICY_CHECK_INTERVAL;
+    private->PolicyTime = now;
+
+    HASH_ITER(hh, private->HashWindows, rec, tmp) {
+        Bool allowed;
+
+        if (rec->pDamage) {
+            rec->UpdateRate = (CARD64)rec->UpdatesCount * 1000 / elapsed;
+            rec->UpdatesCount = 0;
+        }
+
+        allowed = PolicyAllowsBackingStore(pScreen, private, rec, now);
+        if (!allowed && rec->BackingPixmapSize) {
+            DebugMsg("Policy disables backing store for window 0x%x "
+                     "(%dx%d, %u updates per second)\n",
+                     (unsigned int)rec->pWin->drawable.id,
+                     rec->pWin->drawable.width, rec->pWin->drawable.height,
+                     rec->UpdateRate);
+            rec->PolicyRejected = TRUE;
+            DisableBackingStore(pScreen, private, rec);
+        }
+        else if (allowed && rec->PolicyRejected) {
+            rec->PolicyRejected = FALSE;
+            QueueWindowRec(private, rec);
+        }
+    }
+
+    PublishMemoryUsage(pScreen, private);
+
+    return POLICY_CHECK_INTERVAL;
+}
+
 static void
 xPostValidateTree(WindowPtr pWin, WindowPtr pLayerWin, VTKind kind)
 {
@@ -66,7 +449,9 @@ xPostValidateTree(WindowPtr pWin, WindowPtr pLayerWin, VTKind kind)
                                pLayerWin->drawable.pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
-    WindowPtr curWin, focusWin = NULL;
+    WindowPtr focusWin = NULL;
+    BackingStoreWindowPtr rec, tmp, victim;
+    CARD32 now = GetTimeInMillis();
     /*
      * Increment and backup the current counter. Because ChangeWindowAttributes
      * may trigger nested PostValidateTree calls, we want to detect this
@@ -108,38 +493,115 @@ xPostValidateTree(WindowPtr pWin, WindowPtr pLayerWin, VTKind kind)
 
     private->PostValidateTreeNestingLevel++;
 
-    /* Disable backing store for the focus window */
-    if (!private->ForceBackingStore && focusWin->backStorage) {
-        DebugMsg("Disable backing store for the focus window 0x%x\n",
-                 (unsigned int)focusWin->drawable.id);
-        pScreen->backingStoreSupport = Always;
-        focusWin->backingStore = NotUseful;
-        (*pScreen->ChangeWindowAttributes) (focusWin, CWBackingStore);
-        if (CurrentCount != private->PostValidateTreeCount) {
-            DebugMsg("Nested PostValidateTree in ChangeWindowAttributes\n");
-            private->PostValidateTreeNestingLevel--;
-            return;
+    if (focusWin != private->FocusWin) {
+        WindowPtr dropped = PushRecentFocus(private, focusWin);
+
+        /*
+         * The old focus window needs backing store again, unless it is
+         * still in the recently focused list
+         */
+        if (private->FocusWin &&
+            (rec = LookupWindowRec(private, private->FocusWin, FALSE))) {
+            rec->LastUsedTime = now;
+            if (!IsRecentlyFocused(private, private->FocusWin))
+                QueueWindowRec(private, rec);
         }
-    }
+        if (dropped && dropped != private->FocusWin &&
+            (rec = LookupWindowRec(private, dropped, FALSE))) {
+            QueueWindowRec(private, rec);
+        }
+        private->FocusWin = focusWin;
 
-    /* And enable backing store for all the other children of root */
-    curWin = pScreen->root->firstChild;
-    while (curWin) {
-        if (!curWin->backStorage && (private->ForceBackingStore ||
-                                     curWin != focusWin)) {
-            DebugMsg("Enable backing store for window 0x%x\n",
-                     (unsigned int)curWin->drawable.id);
-            pScreen->backingStoreSupport = Always;
-            curWin->backingStore = WhenMapped;
-            (*pScreen->ChangeWindowAttributes) (curWin, CWBackingStore);
+        rec = LookupWindowRec(private, focusWin, TRUE);
+        if (rec) {
+            rec->LastUsedTime = now;
+            rec->Evicted = FALSE;
+        }
+
+        /* Disable backing store for the focus window (maybe a bit later) */
+        if (private->FocusDwellTime > 0 && focusWin->backStorage &&
+            !private->ForceBackingStore) {
+            private->FocusTimer = TimerSet(private->FocusTimer, 0,
+                                           private->FocusDwellTime,
+                                           FocusTimerCallback, pScreen);
+        }
+        else if (rec && !private->ForceBackingStore && focusWin->backStorage) {
+            DemoteFocusWindow(pScreen, private);
             if (CurrentCount != private->PostValidateTreeCount) {
                 DebugMsg("Nested PostValidateTree in ChangeWindowAttributes\n");
                 private->PostValidateTreeNestingLevel--;
                 return;
             }
         }
-        curWin = curWin->nextSib;
     }
+
+    /* And enable backing store for the queued windows */
+    while ((rec = private->PendingWindows)) {
+        private->PendingWindows = rec->NextPending;
+        rec->NextPending = NULL;
+        rec->Pending = FALSE;
+
+        if (rec->pWin->backStorage || rec->pWin->parent != pScreen->root)
+            continue;
+        if (!private->ForceBackingStore && rec->pWin == focusWin)
+            continue;
+        /* the recently focused windows keep their state */
+        if (!private->ForceBackingStore &&
+            IsRecentlyFocused(private, rec->pWin))
+            continue;
+        /* the compressed windows stay compressed until exposed */
+        if (rec->CompressedData && !rec->Visible)
+            continue;
+        if (!PolicyAllowsBackingStore(pScreen, private, rec, now)) {
+            rec->PolicyRejected = TRUE;
+            continue;
+        }
+        /* the evicted windows only come back if there is free space */
+        if (rec->Evicted && !private->ForceBackingStore &&
+            private->MemoryBudget && private->MemoryUsage +
+                WindowBackingPixmapSize(rec->pWin) > private->MemoryBudget)
+            continue;
+
+        rec->Evicted = FALSE;
+        EnableBackingStore(pScreen, private, rec);
+        if (CurrentCount != private->PostValidateTreeCount) {
+            DebugMsg("Nested PostValidateTree in ChangeWindowAttributes\n");
+            private->PostValidateTreeNestingLevel--;
+            return;
+        }
+    }
+
+    /* Evict the least recently used windows if the budget is exceeded */
+    while (!private->ForceBackingStore && private->MemoryBudget &&
+           private->MemoryUsage > private->MemoryBudget) {
+        victim = NULL;
+        HASH_ITER(hh, private->HashWindows, rec, tmp) {
+            if (rec->pWin == focusWin || !rec->BackingPixmapSize)
+                continue;
+            /* the visible windows are being used right now */
+            if (rec->Visible)
+                rec->LastUsedTime = now;
+            if (!victim || (INT32)(rec->LastUsedTime - victim->LastUsedTime) < 0)
+                victim = rec;
+        }
+        if (!victim)
+            break;
+
+        DebugMsg("Evict backing store for window 0x%x (%d KiB)\n",
+                 (unsigned int)victim->pWin->drawable.id,
+                 (int)(victim->BackingPixmapSize / 1024));
+        victim->Evicted = TRUE;
+        private->EvictionsCount++;
+        DisableBackingStore(pScreen, private, victim);
+        if (CurrentCount != private->PostValidateTreeCount) {
+            DebugMsg("Nested PostValidateTree in ChangeWindowAttributes\n");
+            private->PostValidateTreeNestingLevel--;
+            return;
+        }
+    }
+
+    PublishMemoryUsage(pScreen, private);
+
     private->PostValidateTreeNestingLevel--;
 }
 
@@ -149,6 +611,7 @@ xReparentWindow(WindowPtr pWin, WindowPtr pPriorParent)
     ScreenPtr pScreen = pWin->drawable.pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec;
 
     if (private->ReparentWindow) {
         pScreen->ReparentWindow = private->ReparentWindow;
@@ -158,13 +621,526 @@ xReparentWindow(WindowPtr pWin, WindowPtr pPriorParent)
     }
 
     /* We only want backing store set for direct children of root */
-    if (pPriorParent == pScreen->root && pWin->backStorage) {
-        DebugMsg("Reparent window 0x%x from root, disabling backing store\n",
+    if (pPriorParent == pScreen->root) {
+        if ((rec = LookupWindowRec(private, pWin, FALSE)))
+            ForgetWindowRec(private, rec);
+        if (pWin->backStorage) {
+            DebugMsg("Reparent window 0x%x from root, disabling backing store\n",
+                     (unsigned int)pWin->drawable.id);
+            SetWindowBackingStore(pScreen, pWin, NotUseful);
+        }
+    }
+    else if (pWin->parent == pScreen->root) {
+        if ((rec = LookupWindowRec(private, pWin, TRUE)))
+            QueueWindowRec(private, rec);
+    }
+}
+
+static Bool
+xRealizeWindow(WindowPtr pWin)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec;
+    Bool ret;
+
+    pScreen->RealizeWindow = private->RealizeWindow;
+    ret = (*pScreen->RealizeWindow) (pWin);
+    private->RealizeWindow = pScreen->RealizeWindow;
+    pScreen->RealizeWindow = xRealizeWindow;
+
+    /* A newly mapped top level window needs a decision */
+    if (pWin->parent == pScreen->root &&
+        (rec = LookupWindowRec(private, pWin, TRUE))) {
+        QueueWindowRec(private, rec);
+    }
+
+    return ret;
+}
+
+/* Track the visibility and the size changes of the top level windows */
+static void
+xClipNotify(WindowPtr pWin, int dx, int dy)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec;
+
+    if (private->ClipNotify) {
+        pScreen->ClipNotify = private->ClipNotify;
+        (*pScreen->ClipNotify) (pWin, dx, dy);
+        private->ClipNotify = pScreen->ClipNotify;
+        pScreen->ClipNotify = xClipNotify;
+    }
+
+    if (pWin->parent != pScreen->root ||
+        !(rec = LookupWindowRec(private, pWin, FALSE)))
+        return;
+
+    if (rec->Visible)
+        rec->LastUsedTime = GetTimeInMillis();
+    rec->Visible = pWin->viewable &&
+                   pWin->visibility != VisibilityFullyObscured;
+    /* give the compression another chance, the contents may change */
+    if (rec->Visible)
+        rec->CompressFailed = FALSE;
+
+    if (rec->BackingPixmapSize) {
+        size_t size = WindowBackingPixmapSize(pWin);
+        private->MemoryUsage = private->MemoryUsage - rec->BackingPixmapSize
+                                                    + size;
+        rec->BackingPixmapSize = size;
+    }
+}
+
+static Bool
+xDestroyWindow(WindowPtr pWin)
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec = LookupWindowRec(private, pWin, FALSE);
+    Bool ret;
+
+    if (rec)
+        ForgetWindowRec(private, rec);
+
+    pScreen->DestroyWindow = private->DestroyWindow;
+    ret = (*pScreen->DestroyWindow) (pWin);
+    private->DestroyWindow = pScreen->DestroyWindow;
+    pScreen->DestroyWindow = xDestroyWindow;
+
+    return ret;
+}
+
+/*
+ * The windows, which have been fully obscured for a long time, don't
+ * really need a full uncompressed backing pixmap. A timer periodically
+ * finds such windows, compresses the contents of their backing pixmaps
+ * and disables backing store for them. When such window gets exposed
+ * again, the contents are decompressed and painted into the exposed
+ * area right after the background (the client still gets Expose events
+ * and may redraw anything that became stale in the meantime). Then the
+ * window is queued to get backing store enabled again.
+ *
+ * Desktop content typically has long runs of identical pixels, so a
+ * simple RLE codec working with 32-bit words is good enough. The
+ * compressed data consists of chunks starting with a header word. If
+ * the highest bit of the header is set, then the next word is repeated
+ * (header & 0x7FFFFFFF) times, otherwise (header) literal words follow.
+ */
+
+#define RLE_RUN_FLAG        0x80000000
+/* Don't bother with the compression ratios below this */
+#define RLE_MIN_RATIO       4
+
+/* Returns the number of compressed words or 0 if 'dst_size' is too small */
+static size_t
+rle32_compress(uint32_t *dst, size_t dst_size, const uint32_t *src, size_t n)
+{
+    size_t i = 0, out = 0, literal_start = 0;
+
+    while (i < n) {
+        uint32_t value = src[i];
+        size_t run = 1;
+        while (i + run < n && src[i + run] == value)
+            run++;
+        /* short runs are cheaper to store as literals */
+        if (run < 3 && i + run < n) {
+            i += run;
+            continue;
+        }
+        if (run < 3)
+            i += run;
+        /* flush the pending literals */
+        if (literal_start < i) {
+            size_t count = i - literal_start;
+            if (out + 1 + count > dst_size)
+                return 0;
+            dst[out++] = count;
+            memcpy(dst + out, src + literal_start, count * 4);
+            out += count;
+        }
+        if (run >= 3) {
+            if (out + 2 > dst_size)
+                return 0;
+            dst[out++] = RLE_RUN_FLAG | run;
+            dst[out++] = value;
+            i += run;
+        }
+        literal_start = i;
+    }
+    return out;
+}
+
+/* Returns FALSE if the compressed data does not match the expected size */
+static Bool
+rle32_decompress(uint32_t *dst, size_t n, const uint32_t *src, size_t size)
+{
+    size_t i = 0, out = 0;
+
+    while (i < size) {
+        uint32_t header = src[i++];
+        size_t count = header & ~RLE_RUN_FLAG;
+        if (out + count > n)
+            return FALSE;
+        if (header & RLE_RUN_FLAG) {
+            uint32_t value;
+            if (i >= size)
+                return FALSE;
+            value = src[i++];
+            while (count--)
+                dst[out++] = value;
+        }
+        else {
+            if (i + count > size)
+                return FALSE;
+            memcpy(dst + out, src + i, count * 4);
+            out += count;
+            i += count;
+        }
+    }
+    return out == n;
+}
+
+static void
+CompressWindow(ScreenPtr pScreen, BackingStoreTuner *private,
+               BackingStoreWindowPtr rec)
+{
+    WindowPtr pWin = rec->pWin;
+    int w = pWin->drawable.width, h = pWin->drawable.height;
+    size_t words = (size_t)PixmapBytePad(w, pWin->drawable.depth) * h / 4;
+    uint32_t *image, *compressed;
+    size_t size;
+
+    image = malloc(words * 4);
+    compressed = malloc(words * 4 / RLE_MIN_RATIO);
+    if (!image || !compressed) {
+        free(image);
+        free(compressed);
+        return;
+    }
+
+    /* This reads the contents of the backing pixmap */
+    (*pScreen->GetImage) (&pWin->drawable, 0, 0, w, h, ZPixmap, ~0,
+                          (char *)image);
+    size = rle32_compress(compressed, words / RLE_MIN_RATIO, image, words);
+    free(image);
+
+    if (size == 0) {
+        DebugMsg("Window 0x%x contents don't compress well\n",
+                 (unsigned int)pWin->drawable.id);
+        rec->CompressFailed = TRUE;
+        free(compressed);
+        return;
+    }
+
+    rec->CompressedData = realloc(compressed, size * 4);
+    if (!rec->CompressedData)
+        rec->CompressedData = compressed;
+    rec->CompressedSize = size * 4;
+    rec->CompressedWidth = w;
+    rec->CompressedHeight = h;
+    private->MemoryUsage += rec->CompressedSize;
+    private->CompressedWindowsCount++;
+
+    DebugMsg("Compressed window 0x%x contents %d KiB -> %d KiB\n",
+             (unsigned int)pWin->drawable.id, (int)(words * 4 / 1024),
+             (int)(rec->CompressedSize / 1024));
+
+    DisableBackingStore(pScreen, private, rec);
+}
+
+static void
+DropCompressedData(BackingStoreTuner *private, BackingStoreWindowPtr rec)
+{
+    private->MemoryUsage -= rec->CompressedSize;
+    private->CompressedWindowsCount--;
+    free(rec->CompressedData);
+    rec->CompressedData = NULL;
+    rec->CompressedSize = 0;
+}
+
+/* Paint the decompressed window contents into the exposed region */
+static void
+RestoreWindow(ScreenPtr pScreen, BackingStoreWindowPtr rec, RegionPtr exposed)
+{
+    WindowPtr pWin = rec->pWin;
+    int depth = pWin->drawable.depth;
+    int w = rec->CompressedWidth, h = rec->CompressedHeight;
+    int stride = PixmapBytePad(w, depth);
+    uint32_t *image;
+    PixmapPtr pSrc;
+    GCPtr pGC;
+    RegionPtr clip;
+
+    if (w != pWin->drawable.width || h != pWin->drawable.height)
+        return;
+
+    image = malloc((size_t)stride * h);
+    if (!image)
+        return;
+    if (!rle32_decompress(image, (size_t)stride * h / 4,
+                          rec->CompressedData, rec->CompressedSize / 4)) {
+        free(image);
+        return;
+    }
+
+    pSrc = GetScratchPixmapHeader(pScreen, w, h, depth, BitsPerPixel(depth),
+                                  stride, image);
+    pGC = GetScratchGC(depth, pScreen);
+    clip = RegionCreate(NULL, 0);
+    if (pSrc && pGC && clip) {
+        /* The exposed region is in screen coordinates */
+        RegionCopy(clip, exposed);
+        RegionTranslate(clip, -pWin->drawable.x, -pWin->drawable.y);
+        (*pGC->funcs->ChangeClip) (pGC, CT_REGION, clip, 0);
+        clip = NULL;
+        ValidateGC(&pWin->drawable, pGC);
+        (*pGC->ops->CopyArea) (&pSrc->drawable, &pWin->drawable, pGC,
+                               0, 0, w, h, 0, 0);
+    }
+    if (clip)
+        RegionDestroy(clip);
+    if (pGC)
+        FreeScratchGC(pGC);
+    if (pSrc)
+        FreeScratchPixmapHeader(pSrc);
+    free(image);
+}
+
+static CARD32
+CompressTimerCallback(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    ScreenPtr pScreen = arg;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec, tmp;
+
+    HASH_ITER(hh, private->HashWindows, rec, tmp) {
+        if (rec->Visible || rec->CompressFailed || !rec->BackingPixmapSize ||
+            rec->pWin == private->FocusWin || !rec->pWin->redirectDraw)
+            continue;
+        if ((INT32)(now - rec->LastUsedTime) < (INT32)private->CompressDelay)
+            continue;
+        CompressWindow(pScreen, private, rec);
+    }
+
+    PublishMemoryUsage(pScreen, private);
+
+    return private->CompressDelay / 4 > 1000 ? private->CompressDelay / 4 : 1000;
+}
+
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 17, 0, 0, 0)
+static void
+xWindowExposures(WindowPtr pWin, RegionPtr prgn)
+#else
+static void
+xWindowExposures(WindowPtr pWin, RegionPtr prgn, RegionPtr other_exposed)
+#endif
+{
+    ScreenPtr pScreen = pWin->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec = NULL;
+    RegionRec exposed;
+
+    if (pWin->parent == pScreen->root && prgn && RegionNotEmpty(prgn))
+        rec = LookupWindowRec(private, pWin, FALSE);
+    if (rec && !rec->CompressedData)
+        rec = NULL;
+
+    /* The original function paints the background and empties 'prgn' */
+    if (rec) {
+        RegionNull(&exposed);
+        RegionCopy(&exposed, prgn);
+    }
+
+    pScreen->WindowExposures = private->WindowExposures;
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 17, 0, 0, 0)
+    (*pScreen->WindowExposures) (pWin, prgn);
+#else
+    (*pScreen->WindowExposures) (pWin, prgn, other_exposed);
+#endif
+    private->WindowExposures = pScreen->WindowExposures;
+    pScreen->WindowExposures = xWindowExposures;
+
+    if (rec) {
+        DebugMsg("Restore compressed contents of window 0x%x\n",
                  (unsigned int)pWin->drawable.id);
-        pScreen->backingStoreSupport = Always;
-        pWin->backingStore = NotUseful;
-        (*pScreen->ChangeWindowAttributes) (pWin, CWBackingStore);
+        RestoreWindow(pScreen, rec, &exposed);
+        RegionUninit(&exposed);
+        DropCompressedData(private, rec);
+        QueueWindowRec(private, rec);
+    }
+}
+
+/*
+ * The backing pixmaps are created by the composite extension with the
+ * CREATE_PIXMAP_USAGE_BACKING_PIXMAP hint. If there is enough space in
+ * the offscreen part of the framebuffer, we place them there (a 0x0
+ * pixmap is created and then pointed to the framebuffer memory). This
+ * allows G2D to accelerate scrolling inside such windows and restoring
+ * the exposed areas from backing store.
+ *
+ * When the offscreen memory runs out, the pixmaps of the least recently
+ * used windows are moved to system RAM in order to make room for the new
+ * pixmap (which always belongs to the most recently used window, because
+ * the window has just lost keyboard focus or has been mapped). If this
+ * does not help, then the new pixmap is just allocated in system RAM.
+ */
+
+static BackingStorePixmapPtr
+LookupPixmapRec(BackingStoreTuner *private, PixmapPtr pPixmap)
+{
+    BackingStorePixmapPtr rec;
+    for (rec = private->OffscreenPixmaps; rec; rec = rec->next) {
+        if (rec->pPixmap == pPixmap)
+            return rec;
+    }
+    return NULL;
+}
+
+static Bool
+MovePixmapToRam(ScreenPtr pScreen, BackingStoreTuner *private,
+                BackingStorePixmapPtr rec)
+{
+    PixmapPtr pPixmap = rec->pPixmap;
+    size_t size = (size_t)pPixmap->devKind * pPixmap->drawable.height;
+    void *ram = malloc(size);
+    if (!ram)
+        return FALSE;
+
+    memcpy(ram, private->OffscreenDisp->framebuffer_addr + rec->Offset, size);
+    (*pScreen->ModifyPixmapHeader) (pPixmap, 0, 0, 0, 0, 0, ram);
+
+    sunxi_offscreen_free(private->OffscreenDisp, rec->Offset);
+    private->OffscreenUsage -= size;
+    rec->Offset = 0;
+    rec->RamCopy = ram;
+    return TRUE;
+}
+
+/* Move the offscreen pixmap of the least recently used window to RAM */
+static Bool
+MoveLeastRecentlyUsedPixmapToRam(ScreenPtr pScreen, BackingStoreTuner *private)
+{
+    BackingStoreWindowPtr win, tmp;
+    BackingStorePixmapPtr rec, victim = NULL;
+    CARD32 victim_time = 0, now = GetTimeInMillis();
+
+    HASH_ITER(hh, private->HashWindows, win, tmp) {
+        CARD32 last_used_time = win->Visible ? now : win->LastUsedTime;
+        if (!win->pWin->redirectDraw)
+            continue;
+        rec = LookupPixmapRec(private,
+                              (*pScreen->GetWindowPixmap) (win->pWin));
+        if (!rec || !rec->Offset)
+            continue;
+        if (!victim || (INT32)(last_used_time - victim_time) < 0) {
+            victim = rec;
+            victim_time = last_used_time;
+        }
+    }
+
+    if (!victim)
+        return FALSE;
+
+    DebugMsg("Move backing pixmap %p from offscreen memory to RAM\n",
+             victim->pPixmap);
+    return MovePixmapToRam(pScreen, private, victim);
+}
+
+static PixmapPtr
+xCreatePixmap(ScreenPtr pScreen, int width, int height, int depth,
+              unsigned usage_hint)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    sunxi_disp_t *disp = private->OffscreenDisp;
+    BackingStorePixmapPtr rec = NULL;
+    PixmapPtr pPixmap;
+    uint32_t offset = 0;
+    int stride = 0;
+
+    if (usage_hint == CREATE_PIXMAP_USAGE_BACKING_PIXMAP &&
+        width > 0 && height > 0 &&
+        BitsPerPixel(depth) == disp->bits_per_pixel) {
+        stride = PixmapBytePad(width, depth);
+        rec = calloc(1, sizeof(BackingStorePixmapRec));
+        while (rec && !(offset = sunxi_offscreen_alloc(disp, stride * height))) {
+            if (!MoveLeastRecentlyUsedPixmapToRam(pScreen, private))
+                break;
+        }
+    }
+
+    pScreen->CreatePixmap = private->CreatePixmap;
+    if (offset)
+        pPixmap = (*pScreen->CreatePixmap) (pScreen, 0, 0, depth, usage_hint);
+    else
+        pPixmap = (*pScreen->CreatePixmap) (pScreen, width, height, depth,
+                                            usage_hint);
+    private->CreatePixmap = pScreen->CreatePixmap;
+    pScreen->CreatePixmap = xCreatePixmap;
+
+    if (offset && pPixmap) {
+        (*pScreen->ModifyPixmapHeader) (pPixmap, width, height, depth,
+                                        BitsPerPixel(depth), stride,
+                                        disp->framebuffer_addr + offset);
+        rec->pPixmap = pPixmap;
+        rec->Offset = offset;
+        rec->next = private->OffscreenPixmaps;
+        private->OffscreenPixmaps = rec;
+        private->OffscreenUsage += (size_t)stride * height;
+        DebugMsg("Allocated %dx%d backing pixmap at offset 0x%x\n",
+                 width, height, (unsigned int)offset);
+        return pPixmap;
     }
+
+    if (offset)
+        sunxi_offscreen_free(disp, offset);
+    free(rec);
+    return pPixmap;
+}
+
+static Bool
+xDestroyPixmap(PixmapPtr pPixmap)
+{
+    ScreenPtr pScreen = pPixmap->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStorePixmapPtr rec = NULL, *link;
+    size_t size = 0;
+    Bool ret;
+
+    if (pPixmap->refcnt == 1) {
+        for (link = &private->OffscreenPixmaps; *link; link = &(*link)->next) {
+            if ((*link)->pPixmap == pPixmap) {
+                rec = *link;
+                *link = rec->next;
+                size = (size_t)pPixmap->devKind * pPixmap->drawable.height;
+                break;
+            }
+        }
+    }
+
+    pScreen->DestroyPixmap = private->DestroyPixmap;
+    ret = (*pScreen->DestroyPixmap) (pPixmap);
+    private->DestroyPixmap = pScreen->DestroyPixmap;
+    pScreen->DestroyPixmap = xDestroyPixmap;
+
+    if (rec) {
+        if (rec->Offset) {
+            sunxi_offscreen_free(private->OffscreenDisp, rec->Offset);
+            private->OffscreenUsage -= size;
+        }
+        free(rec->RamCopy);
+        free(rec);
+    }
+
+    return ret;
 }
 
 /*****************************************************************************/
@@ -195,6 +1171,18 @@ BackingStoreTuner *BackingStoreTuner_Init(ScreenPtr pScreen, Bool force)
     private->ReparentWindow = pScreen->ReparentWindow;
     pScreen->ReparentWindow = xReparentWindow;
 
+    /* Wrap the current DestroyWindow function */
+    private->DestroyWindow = pScreen->DestroyWindow;
+    pScreen->DestroyWindow = xDestroyWindow;
+
+    /* Wrap the current RealizeWindow function */
+    private->RealizeWindow = pScreen->RealizeWindow;
+    pScreen->RealizeWindow = xRealizeWindow;
+
+    /* Wrap the current ClipNotify function */
+    private->ClipNotify = pScreen->ClipNotify;
+    pScreen->ClipNotify = xClipNotify;
+
     return private;
 }
 
@@ -202,7 +1190,143 @@ void BackingStoreTuner_Close(ScreenPtr pScreen)
 {
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec, tmp;
 
     pScreen->PostValidateTree = private->PostValidateTree;
     pScreen->ReparentWindow   = private->ReparentWindow;
+    pScreen->DestroyWindow    = private->DestroyWindow;
+    pScreen->RealizeWindow    = private->RealizeWindow;
+    pScreen->ClipNotify       = private->ClipNotify;
+
+    if (private->OffscreenDisp) {
+        pScreen->CreatePixmap  = private->CreatePixmap;
+        pScreen->DestroyPixmap = private->DestroyPixmap;
+    }
+
+    if (private->FocusTimer)
+        TimerFree(private->FocusTimer);
+    if (private->PolicyTimer)
+        TimerFree(private->PolicyTimer);
+
+    if (private->CompressTimer) {
+        TimerFree(private->CompressTimer);
+        pScreen->WindowExposures = private->WindowExposures;
+    }
+
+    HASH_ITER(hh, private->HashWindows, rec, tmp) {
+        HASH_DEL(private->HashWindows, rec);
+        if (rec->pDamage)
+            DamageDestroy(rec->pDamage);
+        free(rec->CompressedData);
+        free(rec);
+    }
+
+    while (private->OffscreenPixmaps) {
+        BackingStorePixmapPtr pixmap_rec = private->OffscreenPixmaps;
+        private->OffscreenPixmaps = pixmap_rec->next;
+        free(pixmap_rec->RamCopy);
+        free(pixmap_rec);
+    }
+}
+
+Bool BackingStoreTuner_EnableOffscreen(ScreenPtr pScreen, sunxi_disp_t *disp)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+
+    if (!private || !disp || private->OffscreenDisp)
+        return FALSE;
+
+    private->OffscreenDisp = disp;
+
+    /* Wrap the current CreatePixmap function */
+    private->CreatePixmap = pScreen->CreatePixmap;
+    pScreen->CreatePixmap = xCreatePixmap;
+
+    /* Wrap the current DestroyPixmap function */
+    private->DestroyPixmap = pScreen->DestroyPixmap;
+    pScreen->DestroyPixmap = xDestroyPixmap;
+
+    return TRUE;
+}
+
+Bool BackingStoreTuner_EnableCompression(ScreenPtr pScreen, CARD32 delay)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+
+    if (!private || private->ForceBackingStore || private->CompressTimer ||
+        delay == 0)
+        return FALSE;
+
+    private->CompressDelay = delay;
+    private->CompressTimer = TimerSet(NULL, 0, delay, CompressTimerCallback,
+                                      pScreen);
+    if (!private->CompressTimer)
+        return FALSE;
+
+    /* Wrap the current WindowExposures function */
+    private->WindowExposures = pScreen->WindowExposures;
+    pScreen->WindowExposures = xWindowExposures;
+
+    return TRUE;
+}
+
+void BackingStoreTuner_SetFocusHysteresis(ScreenPtr pScreen, CARD32 dwell_time,
+                                          int recent_windows)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+
+    if (recent_windows < 0)
+        recent_windows = 0;
+    if (recent_windows > BACKING_STORE_MAX_RECENT_FOCUS)
+        recent_windows = BACKING_STORE_MAX_RECENT_FOCUS;
+
+    private->FocusDwellTime = dwell_time;
+    private->RecentFocusSize = recent_windows;
+}
+
+void BackingStoreTuner_SetPolicy(ScreenPtr pScreen, unsigned int min_area,
+                                 unsigned int max_area_percent,
+                                 unsigned int max_aspect,
+                                 unsigned int max_update_rate)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+
+    private->MinArea = min_area;
+    private->MaxAreaPercent = max_area_percent;
+    private->MaxAspect = max_aspect;
+    private->MaxUpdateRate = max_update_rate;
+
+    if (!private->ForceBackingStore && !private->PolicyTimer) {
+        private->PolicyTime = GetTimeInMillis();
+        private->PolicyTimer = TimerSet(NULL, 0, POLICY_CHECK_INTERVAL,
+                                        PolicyTimerCallback, pScreen);
+    }
+}
+
+void BackingStoreTuner_HintFrequentUpdates(DrawablePtr pDraw)
+{
+    ScreenPtr pScreen = pDraw->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    BackingStoreTuner *private = BACKING_STORE_TUNER(pScrn);
+    BackingStoreWindowPtr rec;
+    WindowPtr pWin;
+
+    if (!private || pDraw->type != DRAWABLE_WINDOW)
+        return;
+
+    /* Descend down to the window, which has the root window as a parent */
+    pWin = (WindowPtr)pDraw;
+    while (pWin->parent && pWin->parent != pScreen->root)
+        pWin = pWin->parent;
+
+    if (pWin->parent != pScreen->root ||
+        !(rec = LookupWindowRec(private, pWin, FALSE)))
+        return;
+
+    rec->HasFrequentUpdatesHint = TRUE;
+    rec->FrequentUpdatesHintTime = GetTimeInMillis();
 }
@@ -24,20 +24,172 @@
 #ifndef BACKING_STORE_TUNER_H
 #define BACKING_STORE_TUNER_H
 
+#include "damage.h"
+
 #include "interfaces.h"
+#include "uthash.h"
+#include "sunxi_disp.h"
+
+#define BACKING_STORE_MAX_RECENT_FOCUS 8
+
+/* The information about a top level window (a direct child of root) */
+typedef struct BackingStoreWindowRec {
+    UT_hash_handle          hh;
+    WindowPtr               pWin;
+    /* The last time when the window was visible or had keyboard focus */
+    CARD32                  LastUsedTime;
+    /* The window is not fully obscured (updated on ClipNotify) */
+    Bool                    Visible;
+    /* The size of the backing pixmap, accounted in the memory usage */
+    size_t                  BackingPixmapSize;
+    /* Backing store was disabled in order to stay within the budget */
+    Bool                    Evicted;
+    /* The window is queued for a backing store decision */
+    Bool                    Pending;
+    struct BackingStoreWindowRec *NextPending;
+    /* RLE compressed window contents (replaces the backing pixmap) */
+    void                   *CompressedData;
+    size_t                  CompressedSize;
+    int                     CompressedWidth, CompressedHeight;
+    /* The window contents did not compress well, don't try again */
+    Bool                    CompressFailed;
+    /* Damage based measurement of the window update rate */
+    DamagePtr               pDamage;
+    unsigned int            UpdatesCount;
+    unsigned int            UpdateRate;
+    CARD32                  LastUpdateTime;
+    /* The last time when XV or DRI2 reported frequent updates */
+    Bool                    HasFrequentUpdatesHint;
+    CARD32                  FrequentUpdatesHintTime;
+    /* Backing store is not allowed by the size/update rate policy */
+    Bool                    PolicyRejected;
+} BackingStoreWindowRec, *BackingStoreWindowPtr;
+
+/* A backing pixmap, which has been placed in offscreen framebuffer memory */
+typedef struct BackingStorePixmapRec {
+    struct BackingStorePixmapRec *next;
+    PixmapPtr               pPixmap;
+    /* The offset in the framebuffer (0 if moved to system RAM) */
+    uint32_t                Offset;
+    /* The system RAM copy of the pixmap data after being moved out */
+    void                   *RamCopy;
+} BackingStorePixmapRec, *BackingStorePixmapPtr;
 
 typedef struct {
     /* Just enable backing store for all windows */
     Bool                    ForceBackingStore;
 
+    /*
+     * The maximal total size of backing pixmaps in bytes (0 means no
+     * limit). The least recently used windows lose backing store if
+     * the budget is exceeded.
+     */
+    size_t                  MemoryBudget;
+    size_t                  MemoryUsage;
+    unsigned int            BackedWindowsCount;
+    unsigned int            EvictionsCount;
+    /* The values, which were last published in the root window property */
+    CARD32                  PublishedUsage[5];
+
+    /* The number of backing store enable/disable transitions */
+    unsigned int            TransitionsCount;
+    unsigned int            TransitionsPerSecond;
+    unsigned int            TransitionsRateCount;
+    CARD32                  TransitionsRateStart;
+
     unsigned int            PostValidateTreeCount;
     unsigned int            PostValidateTreeNestingLevel;
 
+    /* The top level window, which had keyboard focus on the last check */
+    WindowPtr               FocusWin;
+    /*
+     * Hysteresis for keyboard focus changes. The focus window only loses
+     * backing store after keeping focus for 'FocusDwellTime' milliseconds
+     * and the recently focused windows keep their state until they drop
+     * out of the 'RecentFocus' list (most recently focused first).
+     */
+    CARD32                  FocusDwellTime;
+    OsTimerPtr              FocusTimer;
+    int                     RecentFocusSize;
+    WindowPtr               RecentFocus[BACKING_STORE_MAX_RECENT_FOCUS];
+    /* The windows waiting for a backing store decision */
+    BackingStoreWindowPtr   PendingWindows;
+
+    BackingStoreWindowPtr   HashWindows;
+
     PostValidateTreeProcPtr PostValidateTree;
     ReparentWindowProcPtr   ReparentWindow;
+    DestroyWindowProcPtr    DestroyWindow;
+    RealizeWindowProcPtr    RealizeWindow;
+    ClipNotifyProcPtr       ClipNotify;
+
+    /*
+     * The policy for the heuristics mode. The windows, which are smaller
+     * than 'MinArea' pixels, larger than 'MaxAreaPercent' of the screen,
+     * have the ratio of the sides larger than 'MaxAspect' or get more
+     * than 'MaxUpdateRate' updates per second don't get backing store
+     * (0 disables the corresponding check).
+     */
+    unsigned int            MinArea;
+    unsigned int            MaxAreaPercent;
+    unsigned int            MaxAspect;
+    unsigned int            MaxUpdateRate;
+    OsTimerPtr              PolicyTimer;
+    CARD32                  PolicyTime;
+
+    /*
+     * The backing pixmaps of the windows, which have been obscured for
+     * longer than 'CompressDelay' milliseconds, get compressed.
+     */
+    CARD32                  CompressDelay;
+    OsTimerPtr              CompressTimer;
+    unsigned int            CompressedWindowsCount;
+    WindowExposuresProcPtr  WindowExposures;
+
+    /* Placement of backing pixmaps in offscreen framebuffer memory */
+    sunxi_disp_t           *OffscreenDisp;
+    BackingStorePixmapPtr   OffscreenPixmaps;
+    size_t                  OffscreenUsage;
+
+    CreatePixmapProcPtr     CreatePixmap;
+    DestroyPixmapProcPtr    DestroyPixmap;
 } BackingStoreTuner;
 
 BackingStoreTuner *BackingStoreTuner_Init(ScreenPtr pScreen, Bool force);
 void BackingStoreTuner_Close(ScreenPtr pScreen);
 
+/*
+ * Allocate the backing pixmaps in the offscreen part of the framebuffer
+ * (above 'disp->offscreen_limit') when possible, so that they can be
+ * accessed by G2D. System RAM is used when the offscreen memory runs out.
+ * The reserved size may still be changed until the first allocation.
+ */
+Bool BackingStoreTuner_EnableOffscreen(ScreenPtr pScreen, sunxi_disp_t *disp);
+
+/*
+ * Compress the contents of the windows, which have been fully obscured
+ * for more than 'delay' milliseconds, and free their backing pixmaps.
+ * The contents are restored on the next expose.
+ */
+Bool BackingStoreTuner_EnableCompression(ScreenPtr pScreen, CARD32 delay);
+
+/*
+ * Configure the focus change hysteresis: the dwell time in milliseconds
+ * and the number of recently focused windows, which keep their state.
+ */
+void BackingStoreTuner_SetFocusHysteresis(ScreenPtr pScreen, CARD32 dwell_time,
+                                          int recent_windows);
+
+/* Configure the window size and update rate policy (see above) */
+void BackingStoreTuner_SetPolicy(ScreenPtr pScreen, unsigned int min_area,
+                                 unsigned int max_area_percent,
+                                 unsigned int max_aspect,
+                                 unsigned int max_update_rate);
+
+/*
+ * Let the tuner know that the drawable is updated every frame (used by
+ * XV and DRI2), so that its top level window does not get backing store.
+ */
+void BackingStoreTuner_HintFrequentUpdates(DrawablePtr pDraw);
+
 #endif
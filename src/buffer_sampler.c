@@ -0,0 +1,122 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "buffer_sampler.h"
+
+/*
+ * The chunks are processed with the GCC vector extensions, which become
+ * NEON instructions on ARM (and SSE2 on x86) or plain scalar code if the
+ * target has no SIMD. Each step is a bijection of the accumulator, so
+ * a change in a single sampled chunk always changes the accumulator (and
+ * the final folded hash with a very high probability).
+ */
+typedef uint32_t vec4_u32 __attribute__((vector_size(16)));
+
+#define HASH_MUL 0x9E3779B1
+
+static inline vec4_u32
+hash_chunk(vec4_u32 acc, const uint8_t *chunk)
+{
+    const vec4_u32 mul = { HASH_MUL, HASH_MUL, HASH_MUL, HASH_MUL };
+    vec4_u32 lo, hi;
+    memcpy(&lo, chunk, sizeof(lo));
+    memcpy(&hi, chunk + sizeof(lo), sizeof(hi));
+    acc = (acc ^ lo) * mul;
+    acc = (acc ^ hi) * mul;
+    return acc;
+}
+
+/* The chunks at the right edge may be incomplete, pad them with zeros */
+static inline vec4_u32
+hash_partial_chunk(vec4_u32 acc, const uint8_t *chunk, size_t size)
+{
+    uint8_t tmp[BUFFER_SAMPLER_CHUNK_SIZE];
+    if (size >= BUFFER_SAMPLER_CHUNK_SIZE)
+        return hash_chunk(acc, chunk);
+    memset(tmp, 0, sizeof(tmp));
+    memcpy(tmp, chunk, size);
+    return hash_chunk(acc, tmp);
+}
+
+size_t buffer_sampler_budget(size_t size)
+{
+    size_t chunks = size / BUFFER_SAMPLER_BYTES_PER_CHUNK;
+    if (chunks < BUFFER_SAMPLER_MIN_CHUNKS)
+        return BUFFER_SAMPLER_MIN_CHUNKS;
+    if (chunks > BUFFER_SAMPLER_MAX_CHUNKS)
+        return BUFFER_SAMPLER_MAX_CHUNKS;
+    return chunks;
+}
+
+uint32_t buffer_sampler_hash(const uint8_t *buf,
+                             size_t         width,
+                             size_t         stride,
+                             size_t         height,
+                             uint32_t       seed,
+                             size_t         max_chunks)
+{
+    size_t columns = (width + BUFFER_SAMPLER_CHUNK_SIZE - 1) /
+                     BUFFER_SAMPLER_CHUNK_SIZE;
+    size_t n = buffer_sampler_budget(stride * height);
+    vec4_u32 acc = { seed, seed + HASH_MUL, seed + 2 * HASH_MUL, seed + 3 * HASH_MUL };
+    uint32_t result;
+    size_t i, x, y;
+
+    if (max_chunks == 0)
+        max_chunks = 1;
+    if (n > max_chunks)
+        n = max_chunks;
+
+    if (columns == 0 || height == 0)
+        return seed;
+
+    if (n >= columns * height) {
+        /* Small buffer, hash everything */
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x += BUFFER_SAMPLER_CHUNK_SIZE)
+                acc = hash_partial_chunk(acc, buf + y * stride + x, width - x);
+        }
+    }
+    else {
+        /* One pseudorandom chunk from each band of rows */
+        for (i = 0; i < n; i++) {
+            size_t y0 = i * height / n;
+            size_t y1 = (i + 1) * height / n;
+            /* LCG pseudorandom number generation */
+            seed = seed * 1103515245 + 12345;
+            y = y0 + (y1 > y0 ? (seed >> 8) % (y1 - y0) : 0);
+            seed = seed * 1103515245 + 12345;
+            x = ((seed >> 8) % columns) * BUFFER_SAMPLER_CHUNK_SIZE;
+            acc = hash_partial_chunk(acc, buf + y * stride + x, width - x);
+        }
+    }
+
+    /* Fold the lanes */
+    result = acc[0];
+    result = (result ^ acc[1]) * HASH_MUL;
+    result = (result ^ acc[2]) * HASH_MUL;
+    result = (result ^ acc[3]) * HASH_MUL;
+    return result ^ (result >> 16);
+}
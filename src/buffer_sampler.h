@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BUFFER_SAMPLER_H
+#define BUFFER_SAMPLER_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * A cheap way to tell whether somebody has modified a big buffer (for
+ * example, whether the Mali blob has rendered a new frame to it). Instead
+ * of reading the whole buffer, a set of cache line sized chunks is hashed.
+ * The rows are split into equal horizontal bands (one per sampled chunk),
+ * and a pseudorandom chunk is picked from each band, so that every part
+ * of the buffer gets sampled. The number of chunks grows with the buffer
+ * size, and the small buffers are just hashed completely.
+ *
+ * The same seed selects the same chunks, so the hash calculated again
+ * with the same seed only differs if the sampled data has changed.
+ */
+
+/* The size of a sampled chunk in bytes */
+#define BUFFER_SAMPLER_CHUNK_SIZE      32
+/* One chunk is sampled for each this many bytes of the buffer */
+#define BUFFER_SAMPLER_BYTES_PER_CHUNK 16384
+/* The limits for the number of sampled chunks */
+#define BUFFER_SAMPLER_MIN_CHUNKS      64
+#define BUFFER_SAMPLER_MAX_CHUNKS      1024
+
+/* The number of chunks sampled from a buffer of this size */
+size_t buffer_sampler_budget(size_t size);
+
+/*
+ * Hash the sampled chunks of a buffer with 'height' rows, 'width' bytes
+ * of data in each row and 'stride' bytes between the rows. No more than
+ * 'max_chunks' chunks are read, which is useful for the buffers in the
+ * uncached memory (reading it is very slow).
+ */
+uint32_t buffer_sampler_hash(const uint8_t *buf,
+                             size_t         width,
+                             size_t         stride,
+                             size_t         height,
+                             uint32_t       seed,
+                             size_t         max_chunks);
+
+#endif
@@ -47,6 +47,17 @@ writeback_scratch_to_mem_arm(int size, void *dst, const void *src)
     memcpy_armv5te(dst, src, size);
 }
 
+/*
+ * The NEON writeback function stores data in 16 byte aligned chunks, which
+ * is the most efficient way to fill write-combining buffers. The source is
+ * expected to be in cached memory.
+ */
+static void
+memcpy_to_wc_neon(void *dst, const void *src, size_t size)
+{
+    writeback_scratch_to_mem_neon(size, dst, src);
+}
+
 #define SCRATCHSIZE 2048
 
 /*
@@ -289,6 +300,13 @@ overlapped_blt_noop(void     *self,
     return 0;
 }
 
+/* The portable implementation of memcpy_to_wc */
+static void
+memcpy_to_wc_generic(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
 cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer,
                                 size_t   uncached_buffer_size)
 {
@@ -301,6 +319,7 @@ cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer,
 
     ctx->blt2d.self = ctx;
     ctx->blt2d.overlapped_blt = overlapped_blt_noop;
+    ctx->memcpy_to_wc = memcpy_to_wc_generic;
 
     ctx->cpuinfo = cpuinfo_init();
 
@@ -320,6 +339,9 @@ cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer,
         /* VFP works better on Cortex-A9, Cortex-A15 and maybe everything else */
         ctx->blt2d.overlapped_blt = overlapped_blt_vfp;
     }
+
+    if (ctx->cpuinfo->has_arm_neon)
+        ctx->memcpy_to_wc = memcpy_to_wc_neon;
 #endif
 
     return ctx;
@@ -42,6 +42,8 @@ typedef struct {
     uint8_t   *uncached_area_end;
     /* An accelerated implementation of blt2d_i interface */
     blt2d_i    blt2d;
+    /* Memory copy, tuned for write-combined destination (framebuffer) */
+    void     (*memcpy_to_wc)(void *dst, const void *src, size_t size);
 } cpu_backend_t;
 
 cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer, size_t uncached_buffer_size);
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -102,10 +103,17 @@ fb_copyarea_t *fb_copyarea_init(const char *device, void *xserver_fbmem)
     ctx->bits_per_pixel = fb_var.bits_per_pixel;
     ctx->framebuffer_paddr = fb_fix.smem_start;
     ctx->framebuffer_size = fb_fix.smem_len;
-    ctx->framebuffer_height = ctx->framebuffer_size /
-                              (ctx->xres * ctx->bits_per_pixel / 8);
+    ctx->framebuffer_height = ctx->framebuffer_size / fb_fix.line_length;
+    /*
+     * The kernel clips the copyarea requests against the virtual screen
+     * resolution, so the memory beyond 'yres_virtual' is not usable
+     */
+    if (ctx->framebuffer_height > fb_var.yres_virtual)
+        ctx->framebuffer_height = fb_var.yres_virtual;
+    ctx->xres_virtual = fb_var.xres_virtual;
     ctx->gfx_layer_size = ctx->xres * ctx->yres * fb_var.bits_per_pixel / 8;
     ctx->framebuffer_stride = fb_fix.line_length / 4;
+    ctx->framebuffer_line_length = fb_fix.line_length;
 
     if (ctx->framebuffer_size < ctx->gfx_layer_size) {
         close(ctx->fd);
@@ -137,10 +145,173 @@ fb_copyarea_t *fb_copyarea_init(const char *device, void *xserver_fbmem)
 
 void fb_copyarea_close(fb_copyarea_t *ctx)
 {
+    if (ctx->async_enabled) {
+        /* finish the queue (redoing the failed requests), then stop */
+        fb_copyarea_sync(ctx);
+        pthread_mutex_lock(&ctx->async_lock);
+        ctx->async_quit = 1;
+        pthread_cond_signal(&ctx->async_queued_cond);
+        pthread_mutex_unlock(&ctx->async_lock);
+        pthread_join(ctx->async_thread, NULL);
+
+        pthread_cond_destroy(&ctx->async_completed_cond);
+        pthread_cond_destroy(&ctx->async_queued_cond);
+        pthread_mutex_destroy(&ctx->async_lock);
+    }
     close(ctx->fd);
     free(ctx);
 }
 
+/*****************************************************************************/
+
+static void *fb_copyarea_worker(void *arg)
+{
+    fb_copyarea_t *ctx = (fb_copyarea_t *)arg;
+    struct fb_copyarea copyarea;
+    int failed;
+
+    pthread_mutex_lock(&ctx->async_lock);
+    while (1) {
+        while ((ctx->async_completed == ctx->async_submitted ||
+                ctx->async_stalled) && !ctx->async_quit) {
+            pthread_cond_wait(&ctx->async_queued_cond, &ctx->async_lock);
+        }
+        if (ctx->async_completed == ctx->async_submitted || ctx->async_stalled)
+            break;
+        /*
+         * The slot can't be reused by the X server until the completed
+         * counter is incremented, so it is safe to read it without lock
+         */
+        copyarea = ctx->async_queue[ctx->async_completed %
+                                    FB_COPYAREA_QUEUE_SIZE];
+        pthread_mutex_unlock(&ctx->async_lock);
+
+        failed = ioctl(ctx->fd, FBIOCOPYAREA, &copyarea) != 0;
+
+        pthread_mutex_lock(&ctx->async_lock);
+        if (failed) {
+            /* leave this request and the rest of the queue to the X server */
+            ctx->async_errors++;
+            ctx->async_stalled = 1;
+        }
+        else {
+            ctx->async_completed++;
+        }
+        pthread_cond_signal(&ctx->async_completed_cond);
+    }
+    pthread_mutex_unlock(&ctx->async_lock);
+
+    return NULL;
+}
+
+int fb_copyarea_enable_async(fb_copyarea_t *ctx)
+{
+    if (ctx->async_enabled)
+        return 1;
+    /* the failed requests can't be redone without a fallback */
+    if (!ctx->fallback_blt2d)
+        return 0;
+
+    ctx->async_quit = 0;
+    ctx->async_stalled = 0;
+    ctx->async_submitted = 0;
+    ctx->async_completed = 0;
+    ctx->async_errors = 0;
+
+    if (pthread_mutex_init(&ctx->async_lock, NULL) != 0)
+        return 0;
+    if (pthread_cond_init(&ctx->async_queued_cond, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->async_lock);
+        return 0;
+    }
+    if (pthread_cond_init(&ctx->async_completed_cond, NULL) != 0) {
+        pthread_cond_destroy(&ctx->async_queued_cond);
+        pthread_mutex_destroy(&ctx->async_lock);
+        return 0;
+    }
+    if (pthread_create(&ctx->async_thread, NULL, fb_copyarea_worker, ctx)) {
+        pthread_cond_destroy(&ctx->async_completed_cond);
+        pthread_cond_destroy(&ctx->async_queued_cond);
+        pthread_mutex_destroy(&ctx->async_lock);
+        return 0;
+    }
+
+    ctx->async_enabled = 1;
+    ctx->blt2d.sync = fb_copyarea_sync;
+    return 1;
+}
+
+/*
+ * Called by the X server with the lock held when the worker thread has
+ * stalled on a failed ioctl. The requests queued after the failed one may
+ * depend on its result, so all of them are redone with the CPU in the
+ * original order (the stalled worker does not touch the framebuffer).
+ * The ioctl is retried if the fallback can't handle a request.
+ */
+static void fb_copyarea_recover(fb_copyarea_t *ctx)
+{
+    struct fb_copyarea copyarea;
+    uint32_t *bits = (uint32_t *)ctx->framebuffer_addr;
+
+    while (ctx->async_completed != ctx->async_submitted) {
+        copyarea = ctx->async_queue[ctx->async_completed %
+                                    FB_COPYAREA_QUEUE_SIZE];
+        pthread_mutex_unlock(&ctx->async_lock);
+        if (!ctx->fallback_blt2d->overlapped_blt(ctx->fallback_blt2d->self,
+                                                 bits, bits,
+                                                 ctx->framebuffer_stride,
+                                                 ctx->framebuffer_stride,
+                                                 ctx->bits_per_pixel,
+                                                 ctx->bits_per_pixel,
+                                                 copyarea.sx, copyarea.sy,
+                                                 copyarea.dx, copyarea.dy,
+                                                 copyarea.width,
+                                                 copyarea.height))
+            ioctl(ctx->fd, FBIOCOPYAREA, &copyarea);
+        pthread_mutex_lock(&ctx->async_lock);
+        ctx->async_completed++;
+    }
+    ctx->async_stalled = 0;
+    pthread_cond_signal(&ctx->async_queued_cond);
+}
+
+void fb_copyarea_sync(void *self)
+{
+    fb_copyarea_t *ctx = (fb_copyarea_t *)self;
+
+    if (!ctx || !ctx->async_enabled)
+        return;
+
+    pthread_mutex_lock(&ctx->async_lock);
+    while (ctx->async_completed != ctx->async_submitted) {
+        if (ctx->async_stalled)
+            fb_copyarea_recover(ctx);
+        else
+            pthread_cond_wait(&ctx->async_completed_cond, &ctx->async_lock);
+    }
+    pthread_mutex_unlock(&ctx->async_lock);
+}
+
+/* Add a request to the queue, waiting for a free slot if necessary */
+static void fb_copyarea_queue(fb_copyarea_t *ctx, struct fb_copyarea *copyarea)
+{
+    pthread_mutex_lock(&ctx->async_lock);
+    while (ctx->async_submitted - ctx->async_completed >=
+                                                    FB_COPYAREA_QUEUE_SIZE) {
+        if (ctx->async_stalled)
+            fb_copyarea_recover(ctx);
+        else
+            pthread_cond_wait(&ctx->async_completed_cond, &ctx->async_lock);
+    }
+    ctx->async_queue[ctx->async_submitted % FB_COPYAREA_QUEUE_SIZE] =
+                                                                *copyarea;
+    ctx->async_submitted++;
+    pthread_cond_signal(&ctx->async_queued_cond);
+    pthread_mutex_unlock(&ctx->async_lock);
+}
+
+/*****************************************************************************/
+
 static inline int try_fallback_blt(void               *self,
                                    uint32_t           *src_bits,
                                    uint32_t           *dst_bits,
@@ -156,6 +327,8 @@ static inline int try_fallback_blt(void               *self,
                                    int                 h)
 {
     fb_copyarea_t *ctx = (fb_copyarea_t *)self;
+    /* the CPU is going to access the framebuffer, so the queue must be empty */
+    fb_copyarea_sync(ctx);
     if (ctx->fallback_blt2d)
         return ctx->fallback_blt2d->overlapped_blt(ctx->fallback_blt2d->self,
                                                    src_bits, dst_bits,
@@ -166,6 +339,36 @@ static inline int try_fallback_blt(void               *self,
     return 0;
 }
 
+/*
+ * Convert the pointer to the first pixel of some image, residing in the
+ * framebuffer memory and having the same stride, into the coordinates of
+ * this pixel in the virtual framebuffer. Then translate (x, y) using them.
+ * Returns 0 if the pointer is not suitable for FBIOCOPYAREA.
+ */
+static inline int translate_to_fb_coords(fb_copyarea_t *ctx,
+                                         uint32_t      *bits,
+                                         int           *x,
+                                         int           *y)
+{
+    int bytes_per_pixel = ctx->bits_per_pixel / 8;
+    uintptr_t offset;
+    int x_in_line;
+
+    if ((uint8_t *)bits < ctx->framebuffer_addr)
+        return 0;
+    offset = (uint8_t *)bits - ctx->framebuffer_addr;
+    if (offset >= ctx->framebuffer_size)
+        return 0;
+
+    x_in_line = offset % ctx->framebuffer_line_length;
+    if (bytes_per_pixel <= 0 || x_in_line % bytes_per_pixel)
+        return 0;
+
+    *x += x_in_line / bytes_per_pixel;
+    *y += offset / ctx->framebuffer_line_length;
+    return 1;
+}
+
 #define FALLBACK_BLT() try_fallback_blt(self, src_bits,        \
                                         dst_bits, src_stride,  \
                                         dst_stride, src_bpp,   \
@@ -188,26 +391,47 @@ int fb_copyarea_blt(void               *self,
 {
     fb_copyarea_t *ctx = (fb_copyarea_t *)self;
     struct fb_copyarea copyarea;
-    uint32_t *framebuffer_addr = (uint32_t *)ctx->framebuffer_addr;
+    int sx = src_x, sy = src_y, dx = dst_x, dy = dst_y;
 
     /* Zero size blit, nothing to do */
     if (w <= 0 || h <= 0)
         return 1;
 
     if (src_bpp != dst_bpp || src_bpp != ctx->bits_per_pixel ||
-        src_stride != dst_stride || src_stride != ctx->framebuffer_stride ||
-        src_bits != dst_bits || src_bits != framebuffer_addr) {
+        src_stride != dst_stride || src_stride != ctx->framebuffer_stride) {
         return FALLBACK_BLT();
     }
 
     if (w * h < COPYAREA_BLT_SIZE_THRESHOLD)
         return FALLBACK_BLT();
 
-    copyarea.sx = src_x;
-    copyarea.sy = src_y;
-    copyarea.dx = dst_x;
-    copyarea.dy = dst_y;
+    /*
+     * Both source and destination may be anywhere in the framebuffer
+     * memory (offscreen areas, panned virtual screen, ...), as long as
+     * the rectangles fit into the virtual framebuffer
+     */
+    if (!translate_to_fb_coords(ctx, src_bits, &sx, &sy) ||
+        !translate_to_fb_coords(ctx, dst_bits, &dx, &dy)) {
+        return FALLBACK_BLT();
+    }
+
+    if (sx < 0 || sy < 0 || dx < 0 || dy < 0 ||
+        sx + w > ctx->xres_virtual || dx + w > ctx->xres_virtual ||
+        sy + h > ctx->framebuffer_height || dy + h > ctx->framebuffer_height) {
+        return FALLBACK_BLT();
+    }
+
+    copyarea.sx = sx;
+    copyarea.sy = sy;
+    copyarea.dx = dx;
+    copyarea.dy = dy;
     copyarea.width = w;
     copyarea.height = h;
+
+    if (ctx->async_enabled) {
+        fb_copyarea_queue(ctx, &copyarea);
+        return 1;
+    }
+
     return ioctl(ctx->fd, FBIOCOPYAREA, &copyarea) == 0;
 }
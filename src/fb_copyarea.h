@@ -24,18 +24,26 @@
 #ifndef FB_COPYAREA_H
 #define FB_COPYAREA_H
 
+#include <pthread.h>
+#include <linux/fb.h>
+
 #include "interfaces.h"
 
+/* The maximal number of requests queued for the worker thread */
+#define FB_COPYAREA_QUEUE_SIZE 64
+
 typedef struct {
     /* framebuffer descriptor */
     int fd;
 
     int                 xres, yres, bits_per_pixel;
+    int                 xres_virtual;      /* the width of the virtual screen */
     uint8_t            *framebuffer_addr;  /* mmapped address */
     uintptr_t           framebuffer_paddr; /* physical address */
     uint32_t            framebuffer_size;  /* total size of the framebuffer */
     int                 framebuffer_height;/* virtual vertical resolution */
     int                 framebuffer_stride;
+    int                 framebuffer_line_length; /* stride in bytes */
     uint32_t            gfx_layer_size;    /* the size of the primary layer */
 
     uint8_t            *xserver_fbmem; /* framebuffer mapping done by xserver */
@@ -44,11 +52,46 @@ typedef struct {
     blt2d_i             blt2d;
     /* Optional fallback interface to handle unsupported operations */
     blt2d_i            *fallback_blt2d;
+
+    /*
+     * Asynchronous mode. When enabled, the FBIOCOPYAREA ioctls are executed
+     * by a separate worker thread in the same order as they were queued.
+     * The requests are stored in a ring buffer and the two counters below
+     * are only ever incremented (the ring buffer index is obtained by
+     * taking them modulo FB_COPYAREA_QUEUE_SIZE). A failed ioctl stalls
+     * the worker thread until the X server redoes the failed request and
+     * the ones queued after it with the CPU (see fb_copyarea_recover).
+     */
+    int                 async_enabled;
+    int                 async_quit;
+    pthread_t           async_thread;
+    pthread_mutex_t     async_lock;
+    pthread_cond_t      async_queued_cond;    /* signalled by the X server */
+    pthread_cond_t      async_completed_cond; /* signalled by the worker */
+    unsigned int        async_submitted;      /* number of queued requests */
+    unsigned int        async_completed;      /* number of finished requests */
+    int                 async_stalled;        /* an ioctl has failed */
+    unsigned int        async_errors;         /* number of failed ioctls */
+    struct fb_copyarea  async_queue[FB_COPYAREA_QUEUE_SIZE];
 } fb_copyarea_t;
 
 fb_copyarea_t *fb_copyarea_init(const char *fb_device, void *xserver_fbmem);
 void fb_copyarea_close(fb_copyarea_t *fb_copyarea);
 
+/*
+ * Start the worker thread and switch to the asynchronous mode. Needs
+ * 'fallback_blt2d' to be set first (for redoing the failed requests).
+ * Returns 1 on success. The "blt2d.sync" function pointer gets set in this case and
+ * needs to be called before accessing the framebuffer by the CPU.
+ */
+int fb_copyarea_enable_async(fb_copyarea_t *fb_copyarea);
+
+/*
+ * Wait until all the queued copyarea requests are finished (the failed
+ * ones are redone with the fallback)
+ */
+void fb_copyarea_sync(void *self);
+
 int fb_copyarea_blt(void               *self,
                     uint32_t           *src_bits,
                     uint32_t           *dst_bits,
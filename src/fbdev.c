@@ -34,6 +34,7 @@
 #endif
 
 #include <string.h>
+#include <unistd.h>
 
 /* all driver need this */
 #include "xf86.h"
@@ -171,10 +172,24 @@ typedef enum {
 	OPTION_DRI2,
 	OPTION_DRI2_OVERLAY,
 	OPTION_SWAPBUFFERS_WAIT,
+	OPTION_DRI2_SWAP_STATS,
+	OPTION_DRI2_FRAME_PACING,
 	OPTION_ACCELMETHOD,
 	OPTION_USE_BS,
 	OPTION_FORCE_BS,
+	OPTION_BS_BUDGET,
+	OPTION_BS_OFFSCREEN,
+	OPTION_BS_COMPRESS_DELAY,
+	OPTION_BS_FOCUS_DWELL,
+	OPTION_BS_RECENT_WINDOWS,
+	OPTION_BS_MIN_AREA,
+	OPTION_BS_MAX_AREA,
+	OPTION_BS_MAX_ASPECT,
+	OPTION_BS_MAX_UPDATE_RATE,
 	OPTION_XV_OVERLAY,
+	OPTION_XV_BUFFERS,
+	OPTION_XV_UPLOAD_THREAD,
+	OPTION_ASYNC_COPYAREA,
 } FBDevOpts;
 
 static const OptionInfoRec FBDevOptions[] = {
@@ -187,10 +202,24 @@ static const OptionInfoRec FBDevOptions[] = {
 	{ OPTION_DRI2,		"DRI2",		OPTV_BOOLEAN,	{0},	FALSE },
 	{ OPTION_DRI2_OVERLAY,	"DRI2HWOverlay",OPTV_BOOLEAN,	{0},	FALSE },
 	{ OPTION_SWAPBUFFERS_WAIT,"SwapbuffersWait",OPTV_BOOLEAN,{0},	FALSE },
+	{ OPTION_DRI2_SWAP_STATS,"DRI2SwapStats",OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_DRI2_FRAME_PACING,"DRI2FramePacing",OPTV_INTEGER,{0},	FALSE },
 	{ OPTION_ACCELMETHOD,	"AccelMethod",	OPTV_STRING,	{0},	FALSE },
 	{ OPTION_USE_BS,	"UseBackingStore",OPTV_BOOLEAN,	{0},	FALSE },
 	{ OPTION_FORCE_BS,	"ForceBackingStore",OPTV_BOOLEAN,{0},	FALSE },
+	{ OPTION_BS_BUDGET,	"BackingStoreBudget",OPTV_INTEGER,{0},	FALSE },
+	{ OPTION_BS_OFFSCREEN,	"BackingStoreOffscreen",OPTV_BOOLEAN,{0},	FALSE },
+	{ OPTION_BS_COMPRESS_DELAY,"BackingStoreCompressDelay",OPTV_INTEGER,{0},FALSE },
+	{ OPTION_BS_FOCUS_DWELL,"BackingStoreFocusDwell",OPTV_INTEGER,{0},	FALSE },
+	{ OPTION_BS_RECENT_WINDOWS,"BackingStoreRecentWindows",OPTV_INTEGER,{0},FALSE },
+	{ OPTION_BS_MIN_AREA,	"BackingStoreMinArea",OPTV_INTEGER,{0},	FALSE },
+	{ OPTION_BS_MAX_AREA,	"BackingStoreMaxArea",OPTV_INTEGER,{0},	FALSE },
+	{ OPTION_BS_MAX_ASPECT,	"BackingStoreMaxAspect",OPTV_INTEGER,{0},	FALSE },
+	{ OPTION_BS_MAX_UPDATE_RATE,"BackingStoreMaxUpdateRate",OPTV_INTEGER,{0},FALSE },
 	{ OPTION_XV_OVERLAY,	"XVHWOverlay",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_XV_BUFFERS,	"XVBuffers",	OPTV_INTEGER,	{0},	FALSE },
+	{ OPTION_XV_UPLOAD_THREAD,"XVUploadThread",OPTV_BOOLEAN,{0},	FALSE },
+	{ OPTION_ASYNC_COPYAREA,"AsyncCopyArea",OPTV_BOOLEAN,	{0},	FALSE },
 	{ -1,			NULL,		OPTV_NONE,	{0},	FALSE }
 };
 
@@ -714,6 +743,7 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	char *accelmethod;
 	cpu_backend_t *cpu_backend;
 	Bool useBackingStore = FALSE, forceBackingStore = FALSE;
+	Bool offscreenBackingStore = FALSE;
 
 	TRACE_ENTER("FBDevScreenInit");
 
@@ -899,8 +929,46 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	                                         forceBackingStore);
 
 	if (useBackingStore || forceBackingStore) {
-		fPtr->backing_store_tuner_private =
+		BackingStoreTuner *tuner;
+		int budget = 0, delay = 0;
+		fPtr->backing_store_tuner_private = tuner =
 			BackingStoreTuner_Init(pScreen, forceBackingStore);
+		if (tuner && !forceBackingStore &&
+		    xf86GetOptValInteger(fPtr->Options, OPTION_BS_BUDGET, &budget) &&
+		    budget > 0) {
+			tuner->MemoryBudget = (size_t)budget * 1024 * 1024;
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			           "backing store memory budget is %d MiB\n", budget);
+		}
+		if (tuner && !forceBackingStore) {
+			int dwell = 300, recent = 2;
+			xf86GetOptValInteger(fPtr->Options, OPTION_BS_FOCUS_DWELL, &dwell);
+			xf86GetOptValInteger(fPtr->Options, OPTION_BS_RECENT_WINDOWS, &recent);
+			BackingStoreTuner_SetFocusHysteresis(pScreen,
+			                                     dwell > 0 ? dwell : 0, recent);
+		}
+		if (tuner && !forceBackingStore) {
+			int min_area = 64 * 64, max_area = 0, max_aspect = 16;
+			int max_update_rate = 20;
+			xf86GetOptValInteger(fPtr->Options, OPTION_BS_MIN_AREA, &min_area);
+			xf86GetOptValInteger(fPtr->Options, OPTION_BS_MAX_AREA, &max_area);
+			xf86GetOptValInteger(fPtr->Options, OPTION_BS_MAX_ASPECT, &max_aspect);
+			xf86GetOptValInteger(fPtr->Options, OPTION_BS_MAX_UPDATE_RATE,
+			                     &max_update_rate);
+			BackingStoreTuner_SetPolicy(pScreen,
+			                            min_area > 0 ? min_area : 0,
+			                            max_area > 0 ? max_area : 0,
+			                            max_aspect > 0 ? max_aspect : 0,
+			                            max_update_rate > 0 ? max_update_rate : 0);
+		}
+		if (tuner &&
+		    xf86GetOptValInteger(fPtr->Options, OPTION_BS_COMPRESS_DELAY, &delay) &&
+		    delay > 0 &&
+		    BackingStoreTuner_EnableCompression(pScreen, (CARD32)delay * 1000)) {
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			           "compress backing store of the windows obscured for %d s\n",
+			           delay);
+		}
 	}
 
 	/* initialize the 'CPU' backend */
@@ -947,8 +1015,17 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 		if (!(accelmethod = xf86GetOptValString(fPtr->Options, OPTION_ACCELMETHOD)) ||
 						strcasecmp(accelmethod, "copyarea") == 0) {
 			fb_copyarea_t *fb = fPtr->fb_copyarea_private;
+			/* the asynchronous mode needs it to redo the failed requests */
+			fb->fallback_blt2d = &cpu_backend->blt2d;
+			if (xf86ReturnOptValBool(fPtr->Options, OPTION_ASYNC_COPYAREA, FALSE)) {
+				if (fb_copyarea_enable_async(fb))
+					xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+					           "fbdev copyarea requests are executed asynchronously\n");
+				else
+					xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+					           "failed to start the fbdev copyarea worker thread\n");
+			}
 			if ((fPtr->SunxiG2D_private = SunxiG2D_Init(pScreen, &fb->blt2d))) {
-				fb->fallback_blt2d = &cpu_backend->blt2d;
 				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 				           "enabled fbdev copyarea acceleration\n");
 			}
@@ -969,6 +1046,19 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 		}
 	}
 
+	/*
+	 * Place backing pixmaps in the offscreen part of the framebuffer if
+	 * G2D is used. The size of this pool is only known after XV and DRI2
+	 * have been set up (see the end of this function).
+	 */
+	if (fPtr->backing_store_tuner_private && fPtr->SunxiG2D_private &&
+	    fPtr->sunxi_disp_private &&
+	    ((SunxiG2D *)fPtr->SunxiG2D_private)->blt2d_self == fPtr->sunxi_disp_private &&
+	    xf86ReturnOptValBool(fPtr->Options, OPTION_BS_OFFSCREEN, TRUE)) {
+		offscreenBackingStore = BackingStoreTuner_EnableOffscreen(pScreen,
+		                                        fPtr->sunxi_disp_private);
+	}
+
 	if (fPtr->shadowFB && !FBDevShadowInit(pScreen)) {
 	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 		       "shadow framebuffer initialization failed\n");
@@ -1043,10 +1133,27 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	fPtr->SunxiVideo_private = NULL;
 	if (xf86ReturnOptValBool(fPtr->Options, OPTION_XV_OVERLAY, TRUE) &&
 	fPtr->sunxi_disp_private) {
-	    fPtr->SunxiVideo_private = SunxiVideo_Init(pScreen);
-	    if (fPtr->SunxiVideo_private)
+	    SunxiVideo *video;
+	    int buffers;
+	    fPtr->SunxiVideo_private = video = SunxiVideo_Init(pScreen);
+	    if (video) {
+		if (xf86GetOptValInteger(fPtr->Options, OPTION_XV_BUFFERS, &buffers))
+		    video->num_buffers = buffers < 1 ? 1 :
+		                         buffers > XV_MAX_BUFFERS ? XV_MAX_BUFFERS : buffers;
+		/* Only useful if there is another CPU core */
+		if (xf86ReturnOptValBool(fPtr->Options, OPTION_XV_UPLOAD_THREAD,
+		                         sysconf(_SC_NPROCESSORS_ONLN) > 1)) {
+		    if (SunxiVideo_EnableUploadThread(video))
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "XV frames are uploaded with a helper thread\n");
+		    else
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			           "failed to start the XV upload thread\n");
+		}
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-		           "using sunxi disp layers for X video extension\n");
+		           "using %d sunxi disp layers for X video extension\n",
+		           video->num_ports);
+	    }
 	}
 	else {
 	    XF86VideoAdaptorPtr *ptr;
@@ -1090,12 +1197,25 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 		xf86ReturnOptValBool(fPtr->Options, OPTION_SWAPBUFFERS_WAIT, TRUE));
 
 	    if (fPtr->SunxiMaliDRI2_private) {
+		int pacing = 0;
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 		           "using DRI2 integration for Mali GPU (UMP buffers)\n");
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 		           "Mali binary drivers can only accelerate EGL/GLES\n");
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 		           "so AIGLX/GLX is expected to fail or fallback to software\n");
+		if (xf86ReturnOptValBool(fPtr->Options, OPTION_DRI2_SWAP_STATS, FALSE))
+		    SunxiMaliDRI2_EnableSwapStats(pScreen);
+		if (xf86GetOptValInteger(fPtr->Options, OPTION_DRI2_FRAME_PACING, &pacing) &&
+		    pacing > 0) {
+		    if (SunxiMaliDRI2_SetFramePacing(pScreen, pacing))
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			           "DRI2 frames are shown at least %d vblanks apart\n",
+			           pacing);
+		    else
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "DRI2 frame pacing needs vblank tracking, disabled\n");
+		}
 	    }
 	    else {
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
@@ -1113,6 +1233,41 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	           "if this is wrong and needs to be fixed, please check ./configure log\n");
 #endif
 
+	/*
+	 * The backing store pool only gets the offscreen memory, which is not
+	 * needed for the overlays: the buffer rings of the XV ports ('XVBuffers'
+	 * screen sized frames in the packed YUV formats, which are the largest)
+	 * and a double buffered fullscreen window for DRI2. XV and DRI2 share
+	 * the reserved area and allocate from it when needed. If the overlays
+	 * need more memory than there is, nothing is left for backing store.
+	 */
+	if (fPtr->sunxi_disp_private && offscreenBackingStore) {
+		sunxi_disp_t *disp = fPtr->sunxi_disp_private;
+		uint64_t size = 0;
+#if XV
+		if (fPtr->SunxiVideo_private) {
+			SunxiVideo *video = fPtr->SunxiVideo_private;
+			size += (uint64_t)video->num_ports * video->num_buffers *
+			        disp->xres * disp->yres * 2;
+		}
+#endif
+#ifdef HAVE_LIBUMP
+		if (fPtr->SunxiMaliDRI2_private &&
+		    xf86ReturnOptValBool(fPtr->Options, OPTION_DRI2_OVERLAY, TRUE))
+			size += (uint64_t)disp->gfx_layer_size * 2;
+#endif
+		if (size > disp->framebuffer_size - disp->gfx_layer_size)
+			size = disp->framebuffer_size - disp->gfx_layer_size;
+		sunxi_offscreen_set_reserved_size(disp, size);
+		if (disp->offscreen_limit < disp->framebuffer_size)
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "using %d KiB of offscreen framebuffer memory for backing store\n",
+			           (int)((disp->framebuffer_size - disp->offscreen_limit) / 1024));
+		else
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "no offscreen framebuffer memory left for backing store\n");
+	}
+
 	TRACE_EXIT("FBDevScreenInit");
 
 	return TRUE;
@@ -1146,6 +1301,16 @@ FBDevCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	}
 #endif
 
+	/* Finish the queued copyarea requests while the framebuffer is mapped */
+	if (fPtr->fb_copyarea_private) {
+	    fb_copyarea_t *fb = fPtr->fb_copyarea_private;
+	    fb_copyarea_sync(fb);
+	    if (fb->async_errors)
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		           "%u fbdev copyarea requests failed and were redone by the CPU\n",
+		           fb->async_errors);
+	}
+
 	fbdevHWRestore(pScrn);
 	fbdevHWUnmapVidmem(pScrn);
 	if (fPtr->shadow) {
@@ -45,6 +45,15 @@ typedef struct {
                           int       dst_y,
                           int       w,
                           int       h);
+    /*
+     * Optional (may be NULL). Implementations which complete operations
+     * asynchronously provide this function to wait until all the queued
+     * operations are finished, so that the CPU can safely access the
+     * framebuffer again. Such implementations must also wait for the
+     * pending operations on their own before returning 0 from
+     * "overlapped_blt" (the caller falls back to the CPU in this case).
+     */
+    void (*sync)(void *self);
 } blt2d_i;
 
 #endif
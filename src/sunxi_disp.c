@@ -34,6 +34,17 @@
 #include "sunxi_disp_ioctl.h"
 #include "g2d_driver.h"
 
+#define OFFSCREEN_ALIGNMENT 64
+
+#define IS_YUV_FORMAT(f) ((f) >= DISP_FORMAT_YUV444 && (f) <= DISP_FORMAT_YUV411)
+
+/* An allocated block of the offscreen framebuffer memory */
+struct sunxi_offscreen_block {
+    struct sunxi_offscreen_block *next;
+    uint32_t                      offset;
+    uint32_t                      size;
+};
+
 /*****************************************************************************/
 
 sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
@@ -114,6 +125,9 @@ sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
         return NULL;
     }
 
+    /* all the offscreen memory belongs to the overlays by default */
+    ctx->offscreen_limit = ctx->framebuffer_size;
+
     if (ctx->xserver_fbmem) {
         /* use already existing mapping */
         ctx->framebuffer_addr = ctx->xserver_fbmem;
@@ -146,16 +160,15 @@ sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
         return NULL;
     }
 
-    if (sunxi_layer_reserve(ctx) < 0)
-    {
-        close(ctx->fd_fb);
-        close(ctx->fd_disp);
-        free(ctx);
-        return NULL;
-    }
+    /* The layers are reserved by their users when needed */
+    for (tmp = 0; tmp < SUNXI_DISP_MAX_LAYERS; tmp++)
+        ctx->layers[tmp].id = -1;
 
     ctx->fd_g2d = open("/dev/g2d", O_RDWR);
 
+    /* Can be NULL, the users need to check this */
+    ctx->vblank = vblank_tracker_init(ctx->fd_fb);
+
     ctx->blt2d.self = ctx;
     ctx->blt2d.overlapped_blt = sunxi_g2d_blt;
 
@@ -164,12 +177,28 @@ sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
 
 int sunxi_disp_close(sunxi_disp_t *ctx)
 {
+    int i;
+
     if (ctx->fd_disp >= 0) {
+        /* free the offscreen allocator bookkeeping */
+        while (ctx->offscreen_blocks) {
+            struct sunxi_offscreen_block *block = ctx->offscreen_blocks;
+            ctx->offscreen_blocks = block->next;
+            free(block);
+        }
+        while (ctx->overlay_blocks) {
+            struct sunxi_offscreen_block *block = ctx->overlay_blocks;
+            ctx->overlay_blocks = block->next;
+            free(block);
+        }
         if (ctx->fd_g2d >= 0) {
             close(ctx->fd_g2d);
         }
-        /* release layer */
-        sunxi_layer_release(ctx);
+        /* stop the vblank tracking thread */
+        vblank_tracker_close(ctx->vblank);
+        /* release layers */
+        for (i = 0; i < SUNXI_DISP_MAX_LAYERS; i++)
+            sunxi_layer_release(ctx, i);
         /* disable cursor */
         if (ctx->cursor_enabled)
             sunxi_hw_cursor_hide(ctx);
@@ -184,6 +213,103 @@ int sunxi_disp_close(sunxi_disp_t *ctx)
     return 0;
 }
 
+/*****************************************************************************
+ * Offscreen framebuffer memory allocator                                    *
+ *****************************************************************************/
+
+/*
+ * The number of allocations is small (it is just a handful of backing
+ * pixmaps and overlay buffers), so the allocated blocks are kept in linked
+ * lists sorted by offset and the first fit strategy is used.
+ */
+
+static uint32_t block_list_alloc(struct sunxi_offscreen_block **link,
+                                 uint32_t start, uint32_t end, uint32_t size)
+{
+    struct sunxi_offscreen_block *block;
+    uint32_t offset = (start + OFFSCREEN_ALIGNMENT - 1) &
+                      ~(OFFSCREEN_ALIGNMENT - 1);
+
+    if (size == 0)
+        return 0;
+    size = (size + OFFSCREEN_ALIGNMENT - 1) & ~(OFFSCREEN_ALIGNMENT - 1);
+
+    /* find the first hole, which is large enough */
+    while (*link && (*link)->offset - offset < size) {
+        offset = (*link)->offset + (*link)->size;
+        link = &(*link)->next;
+    }
+    if (offset > end || end - offset < size)
+        return 0;
+
+    block = malloc(sizeof(*block));
+    if (!block)
+        return 0;
+    block->offset = offset;
+    block->size = size;
+    block->next = *link;
+    *link = block;
+    return offset;
+}
+
+static void block_list_free(struct sunxi_offscreen_block **link,
+                            uint32_t offset)
+{
+    while (*link) {
+        if ((*link)->offset == offset) {
+            struct sunxi_offscreen_block *block = *link;
+            *link = block->next;
+            free(block);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+int sunxi_offscreen_set_reserved_size(sunxi_disp_t *ctx, uint32_t size)
+{
+    if (ctx->offscreen_blocks || ctx->overlay_blocks)
+        return -1;
+    if (size > ctx->framebuffer_size - ctx->gfx_layer_size)
+        size = ctx->framebuffer_size - ctx->gfx_layer_size;
+    ctx->offscreen_limit = ctx->gfx_layer_size + size;
+    return 0;
+}
+
+uint32_t sunxi_offscreen_alloc(sunxi_disp_t *ctx, uint32_t size)
+{
+    return block_list_alloc(&ctx->offscreen_blocks, ctx->offscreen_limit,
+                            ctx->framebuffer_size, size);
+}
+
+void sunxi_offscreen_free(sunxi_disp_t *ctx, uint32_t offset)
+{
+    block_list_free(&ctx->offscreen_blocks, offset);
+}
+
+uint32_t sunxi_overlay_area_alloc(sunxi_disp_t *ctx, uint32_t size, int *count)
+{
+    uint32_t offset;
+    int n;
+
+    for (n = *count; n > 0; n--) {
+        if ((uint64_t)size * n > ctx->offscreen_limit)
+            continue;
+        offset = block_list_alloc(&ctx->overlay_blocks, ctx->gfx_layer_size,
+                                  ctx->offscreen_limit, size * n);
+        if (offset) {
+            *count = n;
+            return offset;
+        }
+    }
+    return 0;
+}
+
+void sunxi_overlay_area_free(sunxi_disp_t *ctx, uint32_t offset)
+{
+    block_list_free(&ctx->overlay_blocks, offset);
+}
+
 /*****************************************************************************
  * Support for hardware cursor, which has 64x64 size, 2 bits per pixel,      *
  * four 32-bit ARGB entries in the palette.                                  *
@@ -266,16 +392,25 @@ int sunxi_hw_cursor_hide(sunxi_disp_t *ctx)
  * Support for scaled layers                                                 *
  *****************************************************************************/
 
-static int sunxi_layer_change_work_mode(sunxi_disp_t *ctx, int new_mode)
+/* Returns the pool entry for a reserved layer or NULL */
+static sunxi_layer_t *sunxi_layer_get(sunxi_disp_t *ctx, int layer)
+{
+    if (layer < 0 || layer >= SUNXI_DISP_MAX_LAYERS)
+        return NULL;
+    if (ctx->layers[layer].id < 0)
+        return NULL;
+    return &ctx->layers[layer];
+}
+
+static int sunxi_layer_change_work_mode(sunxi_disp_t  *ctx,
+                                        sunxi_layer_t *l,
+                                        int            new_mode)
 {
     __disp_layer_info_t layer_info;
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
-        return -1;
-
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_GET_PARA, tmp) < 0)
         return -1;
@@ -283,7 +418,7 @@ static int sunxi_layer_change_work_mode(sunxi_disp_t *ctx, int new_mode)
     layer_info.mode = new_mode;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_PARA, tmp);
 }
@@ -292,22 +427,37 @@ int sunxi_layer_reserve(sunxi_disp_t *ctx)
 {
     __disp_layer_info_t layer_info;
     uint32_t tmp[4];
+    sunxi_layer_t *l = NULL;
+    int i;
+
+    for (i = 0; i < SUNXI_DISP_MAX_LAYERS; i++) {
+        if (ctx->layers[i].id < 0) {
+            l = &ctx->layers[i];
+            break;
+        }
+    }
+    if (!l)
+        return -1;
 
     /* try to allocate a layer */
 
     tmp[0] = ctx->fb_id;
     tmp[1] = DISP_LAYER_WORK_MODE_NORMAL;
-    ctx->layer_id = ioctl(ctx->fd_disp, DISP_CMD_LAYER_REQUEST, &tmp);
-    if (ctx->layer_id < 0)
+    l->id = ioctl(ctx->fd_disp, DISP_CMD_LAYER_REQUEST, &tmp);
+    if (l->id < 0) {
+        l->id = -1;
         return -1;
+    }
 
     /* Initially set the layer configuration to something reasonable */
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_GET_PARA, tmp) < 0)
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_GET_PARA, tmp) < 0) {
+        sunxi_layer_release(ctx, i);
         return -1;
+    }
 
     /* the screen and overlay layers need to be in different pipes */
     layer_info.pipe      = 1;
@@ -322,59 +472,94 @@ int sunxi_layer_reserve(sunxi_disp_t *ctx)
     layer_info.fb.mode = DISP_MOD_INTERLEAVED;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_PARA, tmp) < 0)
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_PARA, tmp) < 0) {
+        sunxi_layer_release(ctx, i);
         return -1;
+    }
 
-    /* Now probe the scaler mode to see if there is a free scaler available */
-    if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_SCALER) == 0)
-        ctx->layer_has_scaler = 1;
-
-    /* Revert back to normal mode */
-    sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_NORMAL);
-    ctx->layer_scaler_is_enabled = 0;
-    ctx->layer_format = DISP_FORMAT_ARGB8888;
+    l->scaler_is_enabled = 0;
+    l->format = DISP_FORMAT_ARGB8888;
 
-    return ctx->layer_id;
+    return i;
 }
 
 
-int sunxi_layer_release(sunxi_disp_t *ctx)
+int sunxi_layer_release(sunxi_disp_t *ctx, int layer)
 {
-    int result;
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     ioctl(ctx->fd_disp, DISP_CMD_LAYER_RELEASE, &tmp);
 
-    ctx->layer_id = -1;
-    ctx->layer_has_scaler = 0;
+    memset(l, 0, sizeof(*l));
+    l->id = -1;
     return 0;
 }
 
+/*
+ * The scalers are a scarce resource (there are fewer scalers than layers)
+ * and get assigned to the layers only when switching to the scaler mode.
+ * So the free layers are reserved and switched to the scaler mode together
+ * in order to find out how many of them can get a scaler at the same time.
+ * The layers, which are already in use, are not touched.
+ */
+int sunxi_layer_count_scalers(sunxi_disp_t *ctx)
+{
+    int layers[SUNXI_DISP_MAX_LAYERS];
+    int i, n = 0, count = 0;
+
+    while (n < SUNXI_DISP_MAX_LAYERS && (layers[n] = sunxi_layer_reserve(ctx)) >= 0)
+        n++;
+
+    while (count < n && sunxi_layer_change_work_mode(ctx,
+                                &ctx->layers[layers[count]],
+                                DISP_LAYER_WORK_MODE_SCALER) == 0)
+        count++;
+
+    /* Releasing the layers also frees their scalers */
+    for (i = 0; i < n; i++)
+        sunxi_layer_release(ctx, layers[i]);
+
+    return count;
+}
+
+int sunxi_layer_reserve_or_reclaim(sunxi_disp_t *ctx)
+{
+    int layer = sunxi_layer_reserve(ctx);
+    if (layer < 0 && ctx->reclaim_layer) {
+        ctx->reclaim_layer(ctx->reclaim_layer_data);
+        layer = sunxi_layer_reserve(ctx);
+    }
+    return layer;
+}
+
 int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t *ctx,
+                                     int           layer,
                                      int           bpp,
                                      uint32_t      offset_in_framebuffer,
                                      int           width,
                                      int           height,
                                      int           stride)
 {
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
     __disp_fb_t fb;
     __disp_rect_t rect = { 0, 0, width, height };
     uint32_t tmp[4];
     memset(&fb, 0, sizeof(fb));
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
-    if (ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_NORMAL) == 0)
-            ctx->layer_scaler_is_enabled = 0;
+    if (l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_NORMAL) == 0)
+            l->scaler_is_enabled = 0;
         else
             return -1;
     }
@@ -396,24 +581,62 @@ int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t *ctx,
     }
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&fb;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_FB, &tmp) < 0)
         return -1;
 
-    ctx->layer_buf_x = rect.x;
-    ctx->layer_buf_y = rect.y;
-    ctx->layer_buf_w = rect.width;
-    ctx->layer_buf_h = rect.height;
-    ctx->layer_format = fb.format;
+    l->buf_x = rect.x;
+    l->buf_y = rect.y;
+    l->buf_w = rect.width;
+    l->buf_h = rect.height;
+    l->format = fb.format;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&rect;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp);
 }
 
+/* Set up the layer for one of the YUV formats, which need the scaler */
+static int sunxi_layer_set_yuv_fb(sunxi_disp_t  *ctx,
+                                  int            layer,
+                                  __disp_fb_t   *fb,
+                                  __disp_rect_t *rect)
+{
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
+    uint32_t tmp[4];
+
+    if (!l)
+        return -1;
+
+    if (!l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_SCALER) == 0)
+            l->scaler_is_enabled = 1;
+        else
+            return -1;
+    }
+
+    tmp[0] = ctx->fb_id;
+    tmp[1] = l->id;
+    tmp[2] = (uintptr_t)fb;
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_FB, &tmp) < 0)
+        return -1;
+
+    l->buf_x = rect->x;
+    l->buf_y = rect->y;
+    l->buf_w = rect->width;
+    l->buf_h = rect->height;
+    l->format = fb->format;
+
+    tmp[0] = ctx->fb_id;
+    tmp[1] = l->id;
+    tmp[2] = (uintptr_t)rect;
+    return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp);
+}
+
 int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
+                                        int           layer,
                                         uint32_t      y_offset_in_framebuffer,
                                         uint32_t      u_offset_in_framebuffer,
                                         uint32_t      v_offset_in_framebuffer,
@@ -425,19 +648,8 @@ int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
 {
     __disp_fb_t fb;
     __disp_rect_t rect = { x_pixel_offset, y_pixel_offset, width, height };
-    uint32_t tmp[4];
     memset(&fb, 0, sizeof(fb));
 
-    if (ctx->layer_id < 0)
-        return -1;
-
-    if (!ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_SCALER) == 0)
-            ctx->layer_scaler_is_enabled = 1;
-        else
-            return -1;
-    }
-
     fb.addr[0] = ctx->framebuffer_paddr + y_offset_in_framebuffer;
     fb.addr[1] = ctx->framebuffer_paddr + u_offset_in_framebuffer;
     fb.addr[2] = ctx->framebuffer_paddr + v_offset_in_framebuffer;
@@ -447,37 +659,75 @@ int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
     fb.seq = DISP_SEQ_P3210;
     fb.mode = DISP_MOD_NON_MB_PLANAR;
 
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    tmp[2] = (uintptr_t)&fb;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_FB, &tmp) < 0)
-        return -1;
+    return sunxi_layer_set_yuv_fb(ctx, layer, &fb, &rect);
+}
 
-    ctx->layer_buf_x = rect.x;
-    ctx->layer_buf_y = rect.y;
-    ctx->layer_buf_w = rect.width;
-    ctx->layer_buf_h = rect.height;
-    ctx->layer_format = fb.format;
+int sunxi_layer_set_nv12_input_buffer(sunxi_disp_t *ctx,
+                                      int           layer,
+                                      uint32_t      y_offset_in_framebuffer,
+                                      uint32_t      uv_offset_in_framebuffer,
+                                      int           width,
+                                      int           height,
+                                      int           stride,
+                                      int           x_pixel_offset,
+                                      int           y_pixel_offset)
+{
+    __disp_fb_t fb;
+    __disp_rect_t rect = { x_pixel_offset, y_pixel_offset, width, height };
+    memset(&fb, 0, sizeof(fb));
 
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    tmp[2] = (uintptr_t)&rect;
-    return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp);
+    fb.addr[0] = ctx->framebuffer_paddr + y_offset_in_framebuffer;
+    fb.addr[1] = ctx->framebuffer_paddr + uv_offset_in_framebuffer;
+    fb.size.width = stride;
+    fb.size.height = height;
+    fb.format = DISP_FORMAT_YUV420;
+    fb.seq = DISP_SEQ_UVUV;
+    fb.mode = DISP_MOD_NON_MB_UV_COMBINED;
+
+    return sunxi_layer_set_yuv_fb(ctx, layer, &fb, &rect);
+}
+
+int sunxi_layer_set_yuv422_input_buffer(sunxi_disp_t *ctx,
+                                        int           layer,
+                                        uint32_t      offset_in_framebuffer,
+                                        int           uyvy,
+                                        int           width,
+                                        int           height,
+                                        int           stride,
+                                        int           x_pixel_offset,
+                                        int           y_pixel_offset)
+{
+    __disp_fb_t fb;
+    __disp_rect_t rect = { x_pixel_offset, y_pixel_offset, width, height };
+    memset(&fb, 0, sizeof(fb));
+
+    fb.addr[0] = ctx->framebuffer_paddr + offset_in_framebuffer;
+    fb.size.width = stride;
+    fb.size.height = height;
+    fb.format = DISP_FORMAT_YUV422;
+    fb.seq = uyvy ? DISP_SEQ_UYVY : DISP_SEQ_YUYV;
+    fb.mode = DISP_MOD_INTERLEAVED;
+
+    return sunxi_layer_set_yuv_fb(ctx, layer, &fb, &rect);
 }
 
-int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h)
+int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int layer,
+                                  int x, int y, int w, int h)
 {
-    __disp_rect_t buf_rect = {
-        ctx->layer_buf_x, ctx->layer_buf_y,
-        ctx->layer_buf_w, ctx->layer_buf_h
-    };
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
+    __disp_rect_t buf_rect;
     __disp_rect_t win_rect = { x, y, w, h };
     uint32_t tmp[4];
     int err;
 
-    if (ctx->layer_id < 0 || w <= 0 || h <= 0)
+    if (!l || w <= 0 || h <= 0)
         return -1;
 
+    buf_rect.x = l->buf_x;
+    buf_rect.y = l->buf_y;
+    buf_rect.width = l->buf_w;
+    buf_rect.height = l->buf_h;
+
     /*
      * Handle negative window Y coordinates (workaround a bug).
      * The Allwinner A10/A13 display controller hardware is expected to
@@ -490,8 +740,7 @@ int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h)
      * We fix this by just recalculating which part of the buffer in memory
      * corresponds to Y=0 on screen and adjust the input buffer settings.
      */
-    if (ctx->layer_format == DISP_FORMAT_YUV420 &&
-                                  (y < 0 || ctx->layer_win_y < 0)) {
+    if (IS_YUV_FORMAT(l->format) && (y < 0 || l->win_y < 0)) {
         if (win_rect.y < 0) {
             int y_shift = -(double)y * buf_rect.height / win_rect.height;
             buf_rect.y      += y_shift;
@@ -510,70 +759,75 @@ int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h)
             win_rect.width = 1;
             win_rect.height = 1;
             tmp[0] = ctx->fb_id;
-            tmp[1] = ctx->layer_id;
+            tmp[1] = l->id;
             tmp[2] = (uintptr_t)&win_rect;
             return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SCN_WINDOW, &tmp);
         }
 
         tmp[0] = ctx->fb_id;
-        tmp[1] = ctx->layer_id;
+        tmp[1] = l->id;
         tmp[2] = (uintptr_t)&buf_rect;
         if ((err = ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp)))
             return err;
     }
     /* Save the new non-adjusted window position */
-    ctx->layer_win_x = x;
-    ctx->layer_win_y = y;
+    l->win_x = x;
+    l->win_y = y;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&win_rect;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SCN_WINDOW, &tmp);
 }
 
-int sunxi_layer_show(sunxi_disp_t *ctx)
+int sunxi_layer_show(sunxi_disp_t *ctx, int layer)
 {
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
     /* YUV formats need to use a scaler */
-    if (ctx->layer_format == DISP_FORMAT_YUV420 && !ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_SCALER) == 0)
-            ctx->layer_scaler_is_enabled = 1;
+    if (IS_YUV_FORMAT(l->format) && !l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_SCALER) == 0)
+            l->scaler_is_enabled = 1;
     }
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_OPEN, &tmp);
 }
 
-int sunxi_layer_hide(sunxi_disp_t *ctx)
+int sunxi_layer_hide(sunxi_disp_t *ctx, int layer)
 {
-    int result;
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
     /* If the layer is hidden, there is no need to keep the scaler occupied */
-    if (ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_NORMAL) == 0)
-            ctx->layer_scaler_is_enabled = 0;
+    if (l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_NORMAL) == 0)
+            l->scaler_is_enabled = 0;
     }
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_CLOSE, &tmp);
 }
 
-int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color)
+int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, int layer, uint32_t color)
 {
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
     uint32_t tmp[4];
     __disp_colorkey_t colorkey;
     __disp_color_t disp_color;
 
+    if (!l)
+        return -1;
+
     disp_color.alpha = (color >> 24) & 0xFF;
     disp_color.red   = (color >> 16) & 0xFF;
     disp_color.green = (color >> 8)  & 0xFF;
@@ -590,20 +844,18 @@ int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color)
     if (ioctl(ctx->fd_disp, DISP_CMD_SET_COLORKEY, &tmp))
         return -1;
 
-    /* Set the overlay layer below the screen layer */
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->gfx_layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
-        return -1;
-
+    /*
+     * Set the overlay layer below the screen layer. The other overlay
+     * layers, which may be also using the color key, stay below it too.
+     */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
         return -1;
 
     /* Enable color key for the overlay layer */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_CK_ON, &tmp) < 0)
         return -1;
 
@@ -621,25 +873,24 @@ int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color)
     return 0;
 }
 
-int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx)
+int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx, int layer)
 {
+    sunxi_layer_t *l = sunxi_layer_get(ctx, layer);
     uint32_t tmp[4];
 
-    /* Disable color key for the overlay layer */
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_CK_OFF, &tmp) < 0)
+    if (!l)
         return -1;
 
-    /* Set the overlay layer above the screen layer */
+    /* Disable color key for the overlay layer */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
+    tmp[1] = l->id;
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_CK_OFF, &tmp) < 0)
         return -1;
 
+    /* Set the overlay layer above the screen layer (and the other ones) */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->gfx_layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
+    tmp[1] = l->id;
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_TOP, &tmp) < 0)
         return -1;
 
     return 0;
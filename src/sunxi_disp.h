@@ -27,6 +27,24 @@
 #include <inttypes.h>
 
 #include "interfaces.h"
+#include "vblank_tracker.h"
+
+/*
+ * The overlay layers (the screen layer is not counted). The display
+ * controller has 4 layers per screen, but only two scalers, which are
+ * needed for YUV formats.
+ */
+#define SUNXI_DISP_MAX_LAYERS     3
+
+/* The state of an overlay layer in the pool */
+typedef struct {
+    int                 id;                /* disp layer handle, -1 if free */
+
+    int                 buf_x, buf_y, buf_w, buf_h;
+    int                 win_x, win_y;
+    int                 scaler_is_enabled;
+    int                 format;
+} sunxi_layer_t;
 
 /*
  * Support for Allwinner A10 display controller features such as layers
@@ -45,6 +63,16 @@ typedef struct {
     int                 framebuffer_height;/* virtual vertical resolution */
     uint32_t            gfx_layer_size;    /* the size of the primary layer */
 
+    /*
+     * The offscreen area between 'gfx_layer_size' and 'offscreen_limit'
+     * is reserved for the overlay buffers of XV and DRI2, which allocate
+     * from it when needed. Everything above 'offscreen_limit' is handed
+     * out by the offscreen memory allocator.
+     */
+    uint32_t            offscreen_limit;
+    struct sunxi_offscreen_block *offscreen_blocks;
+    struct sunxi_offscreen_block *overlay_blocks;
+
     uint8_t            *xserver_fbmem; /* framebuffer mapping done by xserver */
 
     /* Hardware cursor support */
@@ -53,13 +81,13 @@ typedef struct {
 
     /* Layers support */
     int                 gfx_layer_id;
-    int                 layer_id;
-    int                 layer_has_scaler;
+    sunxi_layer_t       layers[SUNXI_DISP_MAX_LAYERS];
+    /* Called to free a layer for XV when the pool is empty (may be NULL) */
+    void              (*reclaim_layer)(void *data);
+    void               *reclaim_layer_data;
 
-    int                 layer_buf_x, layer_buf_y, layer_buf_w, layer_buf_h;
-    int                 layer_win_x, layer_win_y;
-    int                 layer_scaler_is_enabled;
-    int                 layer_format;
+    /* Vertical blanking tracking for the layers users (XV, DRI2) */
+    vblank_tracker_t   *vblank;
 
     /* G2D accelerated implementation of blt2d_i interface */
     blt2d_i             blt2d;
@@ -70,6 +98,24 @@ typedef struct {
 sunxi_disp_t *sunxi_disp_init(const char *fb_device, void *xserver_fbmem);
 int sunxi_disp_close(sunxi_disp_t *ctx);
 
+/*
+ * A simple allocator for the offscreen part of framebuffer. The offsets
+ * are relative to the start of the framebuffer, 0 means a failure. The
+ * reserved size is kept for the overlays right after the primary layer
+ * and can be only changed when nothing is allocated.
+ */
+int sunxi_offscreen_set_reserved_size(sunxi_disp_t *ctx, uint32_t size);
+uint32_t sunxi_offscreen_alloc(sunxi_disp_t *ctx, uint32_t size);
+void sunxi_offscreen_free(sunxi_disp_t *ctx, uint32_t offset);
+
+/*
+ * Allocate up to '*count' overlay buffers of 'size' bytes each in one
+ * block of the reserved area. Fewer buffers are allocated if that is all
+ * what fits, '*count' is updated then.
+ */
+uint32_t sunxi_overlay_area_alloc(sunxi_disp_t *ctx, uint32_t size, int *count);
+void sunxi_overlay_area_free(sunxi_disp_t *ctx, uint32_t offset);
+
 /*
  * Support for hardware cursor, which has 64x64 size, 2 bits per pixel,
  * four 32-bit ARGB entries in the palette.
@@ -82,16 +128,23 @@ int sunxi_hw_cursor_show(sunxi_disp_t *ctx);
 int sunxi_hw_cursor_hide(sunxi_disp_t *ctx);
 
 /*
- * Support for one sunxi disp layer (even though there are more than
- * one available) in the offscreen part of framebuffer, which may be
- * useful for DRI2 vsync aware frame flipping and implementing XV
- * extension (video overlay).
+ * A pool of sunxi disp layers in the offscreen part of framebuffer, which
+ * may be useful for DRI2 vsync aware frame flipping and implementing XV
+ * extension (video overlay). The layers are identified by their index in
+ * the pool. Reserving returns the index or -1 if there are no more layers.
  */
 
 int sunxi_layer_reserve(sunxi_disp_t *ctx);
-int sunxi_layer_release(sunxi_disp_t *ctx);
+int sunxi_layer_release(sunxi_disp_t *ctx, int layer);
+
+/* Also try to get a layer back via 'reclaim_layer' if the pool is empty */
+int sunxi_layer_reserve_or_reclaim(sunxi_disp_t *ctx);
+
+/* The number of free layers, which can get a scaler at the same time */
+int sunxi_layer_count_scalers(sunxi_disp_t *ctx);
 
 int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t  *ctx,
+                                     int            layer,
                                      int            bpp,
                                      uint32_t       offset_in_framebuffer,
                                      int            width,
@@ -99,6 +152,7 @@ int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t  *ctx,
                                      int            stride);
 
 int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
+                                        int           layer,
                                         uint32_t      y_offset_in_framebuffer,
                                         uint32_t      u_offset_in_framebuffer,
                                         uint32_t      v_offset_in_framebuffer,
@@ -108,13 +162,40 @@ int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
                                         int           x_pixel_offset,
                                         int           y_pixel_offset);
 
-int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h);
+/* Semi-planar YUV 4:2:0 (NV12) with the interleaved U and V samples */
+int sunxi_layer_set_nv12_input_buffer(sunxi_disp_t *ctx,
+                                      int           layer,
+                                      uint32_t      y_offset_in_framebuffer,
+                                      uint32_t      uv_offset_in_framebuffer,
+                                      int           width,
+                                      int           height,
+                                      int           stride,
+                                      int           x_pixel_offset,
+                                      int           y_pixel_offset);
+
+/* Packed YUV 4:2:2, either YUY2 or UYVY. The stride is in pixels */
+int sunxi_layer_set_yuv422_input_buffer(sunxi_disp_t *ctx,
+                                        int           layer,
+                                        uint32_t      offset_in_framebuffer,
+                                        int           uyvy,
+                                        int           width,
+                                        int           height,
+                                        int           stride,
+                                        int           x_pixel_offset,
+                                        int           y_pixel_offset);
+
+int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int layer,
+                                  int x, int y, int w, int h);
 
-int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color);
-int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx);
+/*
+ * There is only one color key per screen, shared by all the layers
+ * which have it enabled.
+ */
+int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, int layer, uint32_t color);
+int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx, int layer);
 
-int sunxi_layer_show(sunxi_disp_t *ctx);
-int sunxi_layer_hide(sunxi_disp_t *ctx);
+int sunxi_layer_show(sunxi_disp_t *ctx, int layer);
+int sunxi_layer_hide(sunxi_disp_t *ctx, int layer);
 
 /*
  * Wait for vsync
@@ -33,90 +33,67 @@
 #include <ump/ump_ref_drv.h>
 
 #include <sys/ioctl.h>
+#include <time.h>
+#include <X11/Xatom.h>
 
 #include "xorgVersion.h"
 #include "xf86_OSproc.h"
 #include "xf86.h"
 #include "xf86drm.h"
+#include "dixstruct.h"
+#include "property.h"
 #include "dri2.h"
 #include "damage.h"
 #include "fb.h"
 
 #include "fbdev_priv.h"
+#include "cpu_backend.h"
+#include "fb_copyarea.h"
 #include "sunxi_disp.h"
 #include "sunxi_disp_hwcursor.h"
 #include "sunxi_disp_ioctl.h"
 #include "sunxi_mali_ump_dri2.h"
+#include "backing_store_tuner.h"
+#include "buffer_sampler.h"
 
-static const uint32_t crc32_table[256] = {
-    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
-    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
-    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
-    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
-    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
-    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
-    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
-    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
-    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
-    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
-    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
-    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
-    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
-    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
-    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
-    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
-    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
-    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
-    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
-    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
-    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
-    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
-    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
-    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
-    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
-    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
-    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
-    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
-    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
-    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
-    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-};
+/*
+ * The DRI2 bookkeeping of the windows and the UMP buffers of the migrated
+ * pixmaps are attached to them as devPrivates, so that the hooks (and
+ * especially DestroyPixmap, which is called all the time) don't need
+ * to search for them. The windows are also kept in HashWindowState,
+ * but only for enumerating them.
+ */
+static DevPrivateKeyRec WindowStateKeyRec;
+static DevPrivateKeyRec PixmapUMPKeyRec;
+
+static inline DRI2WindowStatePtr GetWindowState(DrawablePtr pDraw)
+{
+    if (pDraw->type != DRAWABLE_WINDOW)
+        return NULL;
+    return dixLookupPrivate(&((WindowPtr)pDraw)->devPrivates, &WindowStateKeyRec);
+}
 
-static inline uint32_t
-crc32_byte(uint32_t crc32, uint8_t data)
+static inline UMPBufferInfoPtr GetPixmapUMP(PixmapPtr pPixmap)
 {
-    crc32 ^= 0xFFFFFFFF;
-    crc32 = (crc32 >> 8) ^ crc32_table[(crc32 ^ data) & 0xFF];
-    return crc32 ^ 0xFFFFFFFF;
+    return dixLookupPrivate(&pPixmap->devPrivates, &PixmapUMPKeyRec);
 }
 
+/*
+ * The overlay buffers (without their own UMP handle) are in the uncached
+ * caps the reads at 8 KiB per swap instead of up to 128 KiB.
+ * caps the reads at 8 KiB per swap instead of 128 KiB.
+ */
+#define FB_CHECKSUM_MAX_CHUNKS 64
+
+/* Checksum of the sampled parts of the buffer (see buffer_sampler.h) */
 static uint32_t calc_ump_checksum(UMPBufferInfoPtr umpbuf, uint32_t seed)
 {
-    int i;
-    uint8_t *buf = umpbuf->addr + umpbuf->offs;
-    uint32_t result = 0;
-    uint32_t hi, lo;
-    for (i = 0; i < RANDOM_SAMPLES_COUNT; i++) {
-        /* LCG pseudorandom number generation */
-        seed = seed * 1103515245 + 12345;
-        hi = seed & 0xFFFF0000;
-        seed = seed * 1103515245 + 12345;
-        lo = seed >> 16;
-        result = crc32_byte(result, buf[(hi | lo) % umpbuf->size]);
-    }
-    return result;
+    return buffer_sampler_hash(umpbuf->addr + umpbuf->offs,
+                               umpbuf->width * umpbuf->cpp, umpbuf->pitch,
+                               umpbuf->height, seed,
+                               umpbuf->handle == UMP_INVALID_MEMORY_HANDLE ?
+                               FB_CHECKSUM_MAX_CHUNKS :
+                               BUFFER_SAMPLER_MAX_CHUNKS);
 }
 
 static void save_ump_checksum(UMPBufferInfoPtr umpbuf, uint32_t seed)
@@ -157,56 +134,223 @@ WindowExtents(WindowPtr pWin, BoxPtr pBox)
     return pBox;
 }
 
-static int
-FancyTraverseTree(WindowPtr pWin, VisitWindowProcPtr func, pointer data)
+static Bool
+IsVisibleAndOverlapping(WindowPtr pWin, BoxPtr pBox)
 {
-    int result;
-    WindowPtr pChild;
+    BoxRec box;
+    if (!pWin->mapped || !pWin->realized || pWin->drawable.class == InputOnly)
+        return FALSE;
+    return BOXES_OVERLAP(WindowExtents(pWin, &box), pBox);
+}
 
-    if (!(pChild = pWin))
-        return WT_NOMATCH;
-    while (1) {
-        result = (*func) (pChild, data);
-        if (result == WT_STOPWALKING)
-            return WT_STOPWALKING;
-        if ((result == WT_WALKCHILDREN) && pChild->lastChild) {
-            pChild = pChild->lastChild;
-            continue;
+/*
+ * Check whether the window is obscured by the windows stacked above it.
+ * These are only its own children and the siblings above the window and
+ * above each of its ancestors. The subtrees of the siblings don't need to
+ * be checked, because the children are clipped by their parents.
+ */
+static Bool
+IsWindowObscured(WindowPtr pWin)
+{
+    BoxRec box;
+    WindowPtr pSib;
+
+    WindowExtents(pWin, &box);
+
+    for (pSib = pWin->firstChild; pSib; pSib = pSib->nextSib) {
+        if (IsVisibleAndOverlapping(pSib, &box))
+            goto obscured;
+    }
+
+    for (; pWin->parent; pWin = pWin->parent) {
+        for (pSib = pWin->prevSib; pSib; pSib = pSib->prevSib) {
+            if (IsVisibleAndOverlapping(pSib, &box))
+                goto obscured;
         }
-        while (!pChild->prevSib && (pChild != pWin))
-            pChild = pChild->parent;
-        if (pChild == pWin)
-            break;
-        pChild = pChild->prevSib;
     }
-    return WT_NOMATCH;
+
+    return FALSE;
+
+obscured:
+    DebugMsg("overlapped by %p, x=%d, y=%d, w=%d, h=%d\n", pSib,
+             pSib->drawable.x, pSib->drawable.y,
+             pSib->drawable.width, pSib->drawable.height);
+    return TRUE;
+}
+
+/*
+ * Allocating physically contiguous UMP memory is slow and fragments it,
+ * while the windows get resized and the pixmaps get migrated all the time.
+ * So the released UMP buffers are kept mapped in a pool for a while and
+ * recycled for the allocations of the same size class and the same owner.
+ * The buffer contents never pass to another client this way: the back
+ * buffers are only recycled for the window, which has used them, and the
+ * buffers of the migrated pixmaps are cleared before they are reused.
+ */
+
+/* Round up to a page, and then to one of the 4 steps per power of two */
+static size_t ump_pool_size_class(size_t size)
+{
+    size_t step;
+    size = (size + 4095) & ~(size_t)4095;
+    for (step = 4096; step * 8 <= size; step *= 2) {}
+    return (size + step - 1) & ~(step - 1);
+}
+
+static void ump_pool_switch_to_mali(ump_handle handle, Bool cached)
+{
+#ifdef HAVE_LIBUMP_CACHE_CONTROL
+    if (cached) {
+        /* Make sure that no dirty CPU cache lines remain */
+        ump_cache_operations_control(UMP_CACHE_OP_START);
+        ump_switch_hw_usage_secure_id(ump_secure_id_get(handle),
+                                      UMP_USED_BY_MALI);
+        ump_cache_operations_control(UMP_CACHE_OP_FINISH);
+    }
+#endif
 }
 
-static int
-WindowWalker(WindowPtr pWin, pointer value)
+static void ump_pool_drop_entry(UMPPool *pool, int i)
 {
-    SunxiMaliDRI2 *mali = (SunxiMaliDRI2 *)value;
+    ump_mapped_pointer_release(pool->entries[i].handle);
+    ump_reference_release(pool->entries[i].handle);
+    pool->idle_size -= pool->entries[i].size;
+    pool->entries[i] = pool->entries[--pool->count];
+}
 
-    if (mali->bWalkingAboveOverlayWin) {
-        if (pWin->mapped && pWin->realized && pWin->drawable.class != InputOnly) {
-            BoxRec sboxrec1;
-            BoxPtr sbox1 = WindowExtents(pWin, &sboxrec1);
-            BoxRec sboxrec2;
-            BoxPtr sbox2 = WindowExtents(mali->pOverlayWin, &sboxrec2);
-            if (BOXES_OVERLAP(sbox1, sbox2)) {
-                mali->bOverlayWinOverlapped = TRUE;
-                DebugMsg("overlapped by %p, x=%d, y=%d, w=%d, h=%d\n", pWin,
-                         pWin->drawable.x, pWin->drawable.y,
-                         pWin->drawable.width, pWin->drawable.height);
-                return WT_STOPWALKING;
-            }
+/* Release the buffers, which have been idle for at least 'max_age' ms */
+static void ump_pool_trim(UMPPool *pool, CARD32 max_age)
+{
+    CARD32 now = GetTimeInMillis();
+    int i = 0;
+    while (i < pool->count) {
+        if (now - pool->entries[i].released_time >= max_age)
+            ump_pool_drop_entry(pool, i);
+        else
+            i++;
+    }
+}
+
+static CARD32 ump_pool_trim_timer_callback(OsTimerPtr timer, CARD32 now,
+                                           pointer arg)
+{
+    UMPPool *pool = arg;
+    ump_pool_trim(pool, UMP_POOL_TRIM_DELAY_MS);
+    return pool->count ? UMP_POOL_TRIM_DELAY_MS : 0;
+}
+
+/* Release the idle buffers of a window, which is going away */
+static void ump_pool_drop_owner(UMPPool *pool, CARD32 owner)
+{
+    int i = 0;
+    while (i < pool->count) {
+        if (pool->entries[i].owner == owner)
+            ump_pool_drop_entry(pool, i);
+        else
+            i++;
+    }
+}
+
+/* A new owner id for a window */
+static CARD32 ump_pool_new_owner(UMPPool *pool)
+{
+    if (++pool->last_owner == UMP_POOL_OWNER_PIXMAP)
+        ++pool->last_owner;
+    return pool->last_owner;
+}
+
+/* Get a mapped UMP buffer for 'umpbuf->size' bytes */
+static Bool ump_pool_alloc(UMPPool *pool, UMPBufferInfoPtr umpbuf, Bool cached,
+                           CARD32 owner)
+{
+    size_t size = ump_pool_size_class(umpbuf->size);
+    CARD32 now = GetTimeInMillis();
+    ump_alloc_constraints constraints = UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR;
+    ump_handle handle;
+    int i;
+
+#ifdef HAVE_LIBUMP_CACHE_CONTROL
+    if (cached)
+        constraints |= UMP_REF_DRV_CONSTRAINT_USE_CACHE;
+#else
+    cached = FALSE;
+#endif
+
+    for (i = 0; i < pool->count; i++) {
+        UMPPoolEntry *entry = &pool->entries[i];
+        if (entry->size == size && entry->cached == cached &&
+                    entry->owner == owner &&
+                    now - entry->released_time >= UMP_POOL_QUARANTINE_MS) {
+            umpbuf->handle      = entry->handle;
+            umpbuf->addr        = entry->addr;
+            umpbuf->pool        = pool;
+            umpbuf->pool_size   = size;
+            umpbuf->pool_cached = cached;
+            umpbuf->pool_owner  = owner;
+            pool->idle_size -= entry->size;
+            pool->entries[i] = pool->entries[--pool->count];
+            if (owner == UMP_POOL_OWNER_PIXMAP)
+                memset(umpbuf->addr, 0, size);
+            ump_pool_switch_to_mali(umpbuf->handle, cached);
+            DebugMsg("ump_pool_alloc: reused UMP buffer (size=%d)\n", (int)size);
+            return TRUE;
         }
     }
-    else if (pWin == mali->pOverlayWin) {
-        mali->bWalkingAboveOverlayWin = TRUE;
+
+    handle = ump_ref_drv_allocate(size, constraints);
+    if (handle == UMP_INVALID_MEMORY_HANDLE && pool->count) {
+        /* The idle buffers may be in the way of a contiguous allocation */
+        ump_pool_trim(pool, 0);
+        handle = ump_ref_drv_allocate(size, constraints);
     }
+    if (handle == UMP_INVALID_MEMORY_HANDLE)
+        return FALSE;
+
+    ump_pool_switch_to_mali(handle, cached);
+    umpbuf->handle      = handle;
+    umpbuf->addr        = ump_mapped_pointer_get(handle);
+    umpbuf->pool        = pool;
+    umpbuf->pool_size   = size;
+    umpbuf->pool_cached = cached;
+    umpbuf->pool_owner  = owner;
+    return TRUE;
+}
 
-    return WT_WALKCHILDREN;
+/* Return the UMP buffer of 'umpbuf' to the pool */
+static void ump_pool_free(UMPBufferInfoPtr umpbuf)
+{
+    UMPPool *pool = umpbuf->pool;
+    UMPPoolEntry *entry;
+
+    if (umpbuf->pool_size > pool->max_idle_size) {
+        ump_mapped_pointer_release(umpbuf->handle);
+        ump_reference_release(umpbuf->handle);
+        return;
+    }
+
+    /* Make room by dropping the buffers, which have been idle the longest */
+    while (pool->count == UMP_POOL_MAX_ENTRIES ||
+           pool->idle_size + umpbuf->pool_size > pool->max_idle_size) {
+        int i, oldest = 0;
+        for (i = 1; i < pool->count; i++) {
+            if ((INT32)(pool->entries[i].released_time -
+                        pool->entries[oldest].released_time) < 0)
+                oldest = i;
+        }
+        ump_pool_drop_entry(pool, oldest);
+    }
+
+    entry = &pool->entries[pool->count++];
+    entry->handle        = umpbuf->handle;
+    entry->addr          = umpbuf->addr;
+    entry->size          = umpbuf->pool_size;
+    entry->cached        = umpbuf->pool_cached;
+    entry->owner         = umpbuf->pool_owner;
+    entry->released_time = GetTimeInMillis();
+    pool->idle_size += entry->size;
+
+    pool->trim_timer = TimerSet(pool->trim_timer, 0, UMP_POOL_TRIM_DELAY_MS,
+                                ump_pool_trim_timer_callback, pool);
 }
 
 /* Migrate pixmap to UMP buffer */
@@ -216,12 +360,10 @@ MigratePixmapToUMP(PixmapPtr pPixmap)
     ScreenPtr pScreen = pPixmap->drawable.pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
-    UMPBufferInfoPtr umpbuf;
+    UMPBufferInfoPtr umpbuf = GetPixmapUMP(pPixmap);
     size_t pitch = ((pPixmap->devKind + 7) / 8) * 8;
     size_t size = pitch * pPixmap->drawable.height;
 
-    HASH_FIND_PTR(mali->HashPixmapToUMP, &pPixmap, umpbuf);
-
     if (umpbuf) {
         DebugMsg("MigratePixmapToUMP %p, already exists = %p\n", pPixmap, umpbuf);
         return umpbuf;
@@ -235,14 +377,13 @@ MigratePixmapToUMP(PixmapPtr pPixmap)
     }
     umpbuf->refcount = 1;
     umpbuf->pPixmap = pPixmap;
-    umpbuf->handle = ump_ref_drv_allocate(size, UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR);
-    if (umpbuf->handle == UMP_INVALID_MEMORY_HANDLE) {
+    umpbuf->size = size;
+    if (!ump_pool_alloc(&mali->ump_pool, umpbuf, FALSE,
+                        UMP_POOL_OWNER_PIXMAP)) {
         ErrorF("MigratePixmapToUMP: ump_ref_drv_allocate failed\n");
         free(umpbuf);
         return NULL;
     }
-    umpbuf->size = size;
-    umpbuf->addr = ump_mapped_pointer_get(umpbuf->handle);
     umpbuf->depth = pPixmap->drawable.depth;
     umpbuf->width = pPixmap->drawable.width;
     umpbuf->height = pPixmap->drawable.height;
@@ -265,13 +406,15 @@ MigratePixmapToUMP(PixmapPtr pPixmap)
     pPixmap->devKind = pitch;
     pPixmap->devPrivate.ptr = umpbuf->addr;
 
-    HASH_ADD_PTR(mali->HashPixmapToUMP, pPixmap, umpbuf);
+    dixSetPrivate(&pPixmap->devPrivates, &PixmapUMPKeyRec, umpbuf);
 
     DebugMsg("MigratePixmapToUMP %p, new buf = %p\n", pPixmap, umpbuf);
     return umpbuf;
 }
 
 static void UpdateOverlay(ScreenPtr pScreen);
+static unsigned OverlayPriority(DRI2WindowStatePtr window_state);
+static void FlushOverlay(ScreenPtr pScreen, DRI2WindowStatePtr window_state);
 
 static void unref_ump_buffer_info(UMPBufferInfoPtr umpbuf)
 {
@@ -279,8 +422,13 @@ static void unref_ump_buffer_info(UMPBufferInfoPtr umpbuf)
         DebugMsg("unref_ump_buffer_info(%p) [refcount=%d, handle=%p]\n",
                  umpbuf, umpbuf->refcount, umpbuf->handle);
         if (umpbuf->handle != UMP_INVALID_MEMORY_HANDLE) {
-            ump_mapped_pointer_release(umpbuf->handle);
-            ump_reference_release(umpbuf->handle);
+            if (umpbuf->pool) {
+                ump_pool_free(umpbuf);
+            }
+            else {
+                ump_mapped_pointer_release(umpbuf->handle);
+                ump_reference_release(umpbuf->handle);
+            }
         }
         free(umpbuf);
     }
@@ -330,6 +478,115 @@ static DRI2Buffer2Ptr validate_dri2buf(DRI2Buffer2Ptr dri2buf)
     return dri2buf;
 }
 
+/*
+ * Take the disp layer away from the window. Its buffers are copied to the
+ * window from now on, starting with the last one shown by the layer (if
+ * 'flush' is set).
+ */
+static void DemoteOverlayWindow(ScreenPtr          pScreen,
+                                DRI2WindowStatePtr window_state,
+                                Bool               flush)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    int slot = window_state->overlay_slot;
+
+    if (slot < 0)
+        return;
+
+    if (window_state->overlay_shown) {
+        DebugMsg("Disabling overlay for window %p\n", window_state->pDraw);
+        if (flush)
+            FlushOverlay(pScreen, window_state);
+        sunxi_layer_hide(disp, mali->overlay_layers[slot]);
+        window_state->overlay_shown = FALSE;
+    }
+    window_state->pOverlayDirtyUMP = NULL;
+    mali->overlay_owners[slot] = NULL;
+    window_state->overlay_slot = -1;
+}
+
+/*
+ * Get a place for the buffers of the window in the reserved offscreen area
+ * (shared with XV, which only takes memory while showing a video).
+ */
+static Bool AllocOverlayArea(SunxiMaliDRI2      *mali,
+                             sunxi_disp_t       *disp,
+                             DRI2WindowStatePtr  window_state,
+                             uint32_t            size)
+{
+    uint32_t offset;
+    int count = 1;
+
+    if (window_state->overlay_area_size >= size)
+        return TRUE;
+    if (window_state->overlay_area_size)
+        sunxi_overlay_area_free(disp, window_state->overlay_area_offset);
+    window_state->overlay_area_size = 0;
+
+    offset = sunxi_overlay_area_alloc(disp, size, &count);
+    if (!offset)
+        return FALSE;
+
+    window_state->overlay_area_offset = offset;
+    window_state->overlay_area_size = size;
+    /*
+     * Erase the new overlay area (nobody else can be scanning it out) and
+     * get the occlusion status of the window
+     */
+    memset(disp->framebuffer_addr + offset, 0, size);
+    mali->bOverlayOcclusionDirty = TRUE;
+    return TRUE;
+}
+
+static void FreeOverlayArea(sunxi_disp_t       *disp,
+                            DRI2WindowStatePtr  window_state)
+{
+    if (window_state->overlay_area_size)
+        sunxi_overlay_area_free(disp, window_state->overlay_area_offset);
+    window_state->overlay_area_size = 0;
+}
+
+/*
+ * XV has run out of layers, give up the layer of the least important
+ * window (it is copied from now on). The remaining layers are kept at
+ * the start of the array.
+ */
+static void ReclaimOverlayLayer(void *data)
+{
+    ScreenPtr pScreen = data;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    DRI2WindowStatePtr owner;
+    int i, slot = 0, last = mali->num_overlay_layers - 1;
+
+    if (last < 0)
+        return;
+
+    for (i = 1; i <= last && mali->overlay_owners[slot]; i++) {
+        if (!mali->overlay_owners[i] ||
+            OverlayPriority(mali->overlay_owners[i]) <
+            OverlayPriority(mali->overlay_owners[slot]))
+            slot = i;
+    }
+
+    if (mali->overlay_owners[slot]) {
+        DebugMsg("Window %p loses the overlay to XV\n",
+                 mali->overlay_owners[slot]->pDraw);
+        DemoteOverlayWindow(pScreen, mali->overlay_owners[slot], TRUE);
+    }
+    sunxi_layer_release(disp, mali->overlay_layers[slot]);
+
+    mali->overlay_layers[slot] = mali->overlay_layers[last];
+    owner = mali->overlay_owners[slot] = mali->overlay_owners[last];
+    if (owner)
+        owner->overlay_slot = slot;
+    mali->overlay_owners[last] = NULL;
+    mali->num_overlay_layers = last;
+}
+
 static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
                                            unsigned int attachment,
                                            unsigned int format)
@@ -418,10 +675,6 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
     if (!disp || mali->ump_fb_secure_id == UMP_INVALID_SECURE_ID)
         can_use_overlay = FALSE;
 
-    /* Overlay is already used by a different window */
-    if (mali->pOverlayWin && mali->pOverlayWin != (void *)pDraw)
-        can_use_overlay = FALSE;
-
     /* Don't waste overlay on some strange 1x1 window created by gnome-shell */
     if (pDraw->width == 1 && pDraw->height == 1)
         can_use_overlay = FALSE;
@@ -430,27 +683,33 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
     if (pDraw->bitsPerPixel != 32 && pDraw->bitsPerPixel != 16)
         can_use_overlay = FALSE;
 
-    if (disp && disp->framebuffer_size - disp->gfx_layer_size < privates->size * 2) {
-        DebugMsg("Not enough space in the offscreen framebuffer (wanted %d for DRI2)\n",
-                 privates->size);
-        can_use_overlay = FALSE;
-    }
-
     /* Allocate the DRI2-related window bookkeeping information */
-    HASH_FIND_PTR(mali->HashWindowState, &pDraw, window_state);
+    window_state = GetWindowState(pDraw);
     if (!window_state) {
         window_state = calloc(1, sizeof(*window_state));
         window_state->pDraw = pDraw;
+        window_state->overlay_slot = -1;
+        window_state->ump_pool_owner = ump_pool_new_owner(&mali->ump_pool);
+        REGION_NULL(pScreen, &window_state->pending_copy);
         HASH_ADD_PTR(mali->HashWindowState, pDraw, window_state);
+        dixSetPrivate(&((WindowPtr)pDraw)->devPrivates, &WindowStateKeyRec,
+                      window_state);
         DebugMsg("Allocate DRI2 bookkeeping for window %p\n", pDraw);
-        if (disp && can_use_overlay) {
-            /* erase the offscreen part of the framebuffer */
-            memset(disp->framebuffer_addr + disp->gfx_layer_size, 0,
-                   disp->framebuffer_size - disp->gfx_layer_size);
-        }
     }
     window_state->buf_request_cnt++;
 
+    /* The overlay windows share the offscreen part of the framebuffer */
+    if (can_use_overlay &&
+        !AllocOverlayArea(mali, disp, window_state, privates->size * 2)) {
+        DebugMsg("Not enough space in the offscreen framebuffer (wanted %d for DRI2)\n",
+                 privates->size * 2);
+        can_use_overlay = FALSE;
+    }
+    if (!can_use_overlay) {
+        DemoteOverlayWindow(pScreen, window_state, FALSE);
+        FreeOverlayArea(disp, window_state);
+    }
+
     /* For odd buffer requests save the window size */
     if (window_state->buf_request_cnt & 1) {
         /* remember window size for one buffer */
@@ -464,6 +723,8 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
                           (pDraw->width != window_state->width ||
                            pDraw->height != window_state->height) &&
                           mali->ump_null_secure_id <= 2;
+    if (need_window_resize_bug_workaround)
+        window_state->stats.resize_recoveries++;
 
     if (can_use_overlay) {
         /* Release unneeded buffers */
@@ -478,19 +739,17 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
         buffer->name = mali->ump_fb_secure_id;
 
         if (window_state->buf_request_cnt & 1) {
-            buffer->flags = disp->gfx_layer_size;
+            buffer->flags = window_state->overlay_area_offset;
             privates->extra_flags |= UMPBUF_MUST_BE_ODD_FRAME;
         }
         else {
-            buffer->flags = disp->gfx_layer_size + privates->size;
+            buffer->flags = window_state->overlay_area_offset + privates->size;
             privates->extra_flags |= UMPBUF_MUST_BE_EVEN_FRAME;
         }
 
         umpbuf_add_to_queue(window_state, privates);
         privates->refcount++;
 
-        mali->pOverlayWin = (WindowPtr)pDraw;
-
         if (need_window_resize_bug_workaround) {
             DebugMsg("DRI2 buffers size mismatch detected, trying to recover\n");
             buffer->name = mali->ump_alternative_fb_secure_id;
@@ -537,24 +796,14 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
             return validate_dri2buf(buffer);
         }
 
-        /* Allocate UMP memory buffer */
-#ifdef HAVE_LIBUMP_CACHE_CONTROL
-        privates->handle = ump_ref_drv_allocate(privates->size,
-                                    UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR |
-                                    UMP_REF_DRV_CONSTRAINT_USE_CACHE);
-        ump_cache_operations_control(UMP_CACHE_OP_START);
-        ump_switch_hw_usage_secure_id(ump_secure_id_get(privates->handle),
-                                      UMP_USED_BY_MALI);
-        ump_cache_operations_control(UMP_CACHE_OP_FINISH);
-#else
-        privates->handle = ump_ref_drv_allocate(privates->size,
-                                    UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR);
-#endif
-        if (privates->handle == UMP_INVALID_MEMORY_HANDLE) {
+        /* Allocate UMP memory buffer (cached if supported) */
+        if (!ump_pool_alloc(&mali->ump_pool, privates, TRUE,
+                            window_state->ump_pool_owner)) {
             ErrorF("Failed to allocate UMP buffer (size=%d)\n",
                    (int)privates->size);
+            privates->handle = UMP_INVALID_MEMORY_HANDLE;
+            privates->addr   = NULL;
         }
-        privates->addr = ump_mapped_pointer_get(privates->handle);
         buffer->name = ump_secure_id_get(privates->handle);
         buffer->flags = 0;
 
@@ -579,9 +828,12 @@ static void MaliDRI2DestroyBuffer(DrawablePtr pDraw, DRI2Buffer2Ptr buffer)
     ScreenPtr pScreen = pDraw->pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    DRI2WindowStatePtr window_state, tmp;
 
-    if (mali->pOverlayDirtyUMP == buffer->driverPrivate)
-        mali->pOverlayDirtyUMP = NULL;
+    HASH_ITER(hh, mali->HashWindowState, window_state, tmp) {
+        if (window_state->pOverlayDirtyUMP == buffer->driverPrivate)
+            window_state->pOverlayDirtyUMP = NULL;
+    }
 
     DebugMsg("DRI2DestroyBuffer %s=%p, buf=%p:%p, att=%d\n",
              pDraw->type == DRAWABLE_WINDOW ? "win" : "pix",
@@ -594,17 +846,147 @@ static void MaliDRI2DestroyBuffer(DrawablePtr pDraw, DRI2Buffer2Ptr buffer)
     }
 }
 
-/* Do ordinary copy */
-static void MaliDRI2CopyRegion_copy(DrawablePtr      pDraw,
-                                    RegionPtr        pRegion,
-                                    UMPBufferInfoPtr umpbuf)
+/*
+ * Copy the boxes of the region (in screen coordinates) from the UMP buffer
+ * straight to the framebuffer, bypassing the GC machinery. The buffers
+ * residing in the framebuffer (flushed overlays) are copied by G2D, the
+ * cached UMP buffers are read by the CPU and written to the framebuffer
+ * with the burst writes, the uncached ones need the two-pass copy of the
+ * CPU backend to avoid slow uncached reads.
+ */
+static Bool CopyRegionDirect(DrawablePtr      pDraw,
+                             RegionPtr        pRegion,
+                             UMPBufferInfoPtr umpbuf)
+{
+    ScreenPtr pScreen = pDraw->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    cpu_backend_t *cpu_backend = FBDEVPTR(pScrn)->cpu_backend_private;
+    PixmapPtr pPixmap;
+    uint8_t *src, *dst;
+    int bpp = umpbuf->cpp * 8;
+    int src_stride, dst_stride;
+    BoxPtr pbox = REGION_RECTS(pRegion);
+    int nbox = REGION_NUM_RECTS(pRegion);
+    Bool src_in_fb;
+
+    if (!disp || !cpu_backend || pDraw->type != DRAWABLE_WINDOW ||
+        pDraw->bitsPerPixel != bpp || (bpp != 16 && bpp != 32))
+        return FALSE;
+
+    /* The window must be in the framebuffer as is (no compositing) */
+    pPixmap = pScreen->GetWindowPixmap((WindowPtr)pDraw);
+    if (pPixmap != pScreen->GetScreenPixmap(pScreen) ||
+        pPixmap->devPrivate.ptr != disp->framebuffer_addr)
+        return FALSE;
+
+    src = umpbuf->addr + umpbuf->offs;
+    dst = disp->framebuffer_addr;
+    src_stride = umpbuf->pitch;
+    dst_stride = pPixmap->devKind;
+    src_in_fb = src >= disp->framebuffer_addr &&
+                src < disp->framebuffer_addr + disp->framebuffer_size;
+
+    /* The queued fbdev copyarea requests may still move the same pixels */
+    fb_copyarea_sync(FBDEVPTR(pScrn)->fb_copyarea_private);
+
+    while (nbox--) {
+        int src_x = pbox->x1 - pDraw->x, src_y = pbox->y1 - pDraw->y;
+        int w = pbox->x2 - pbox->x1, h = pbox->y2 - pbox->y1;
+        int i;
+
+        if (src_in_fb) {
+            if (!sunxi_g2d_blt(disp, (uint32_t *)src, (uint32_t *)dst,
+                               src_stride / 4, dst_stride / 4, bpp, bpp,
+                               src_x, src_y, pbox->x1, pbox->y1, w, h))
+                cpu_backend->blt2d.overlapped_blt(cpu_backend->blt2d.self,
+                               (uint32_t *)src, (uint32_t *)dst,
+                               src_stride / 4, dst_stride / 4, bpp, bpp,
+                               src_x, src_y, pbox->x1, pbox->y1, w, h);
+        }
+        else if (umpbuf->pool_cached) {
+            for (i = 0; i < h; i++)
+                cpu_backend->memcpy_to_wc(
+                    dst + (pbox->y1 + i) * dst_stride + pbox->x1 * umpbuf->cpp,
+                    src + (src_y + i) * src_stride + src_x * umpbuf->cpp,
+                    w * umpbuf->cpp);
+        }
+        else {
+            cpu_backend->blt2d.overlapped_blt(cpu_backend->blt2d.self,
+                               (uint32_t *)src, (uint32_t *)dst,
+                               src_stride / 4, dst_stride / 4, bpp, bpp,
+                               src_x, src_y, pbox->x1, pbox->y1, w, h);
+        }
+        pbox++;
+    }
+
+    /* The rendering code has been bypassed, let the others know about it */
+    DamageDamageRegion(pDraw, pRegion);
+    return TRUE;
+}
+
+/* Copy the buffer to the window, the CPU caches are taken care of by the caller */
+static void CopyUMPBuffer(DrawablePtr      pDraw,
+                          RegionPtr        pRegion,
+                          UMPBufferInfoPtr umpbuf)
 {
     GCPtr pGC;
     RegionPtr copyRegion;
     ScreenPtr pScreen = pDraw->pScreen;
-    UMPBufferInfoPtr privates;
     PixmapPtr pScratchPixmap;
+    RegionRec visible, requested;
+    BoxRec bufbox;
+
+    /*
+     * Only the requested part of the buffer, which is visible on the screen
+     * and has been really rendered by the client (the buffer may be smaller
+     * than the window after a resize), needs to be copied.
+     */
+    bufbox.x1 = pDraw->x;
+    bufbox.y1 = pDraw->y;
+    bufbox.x2 = pDraw->x + min(pDraw->width, umpbuf->width);
+    bufbox.y2 = pDraw->y + min(pDraw->height, umpbuf->height);
+    REGION_INIT(pScreen, &visible, &bufbox, 1);
+    if (pDraw->type == DRAWABLE_WINDOW)
+        REGION_INTERSECT(pScreen, &visible, &visible, &((WindowPtr)pDraw)->clipList);
+    REGION_NULL(pScreen, &requested);
+    REGION_COPY(pScreen, &requested, pRegion);
+    REGION_TRANSLATE(pScreen, &requested, pDraw->x, pDraw->y);
+    REGION_INTERSECT(pScreen, &visible, &visible, &requested);
+    REGION_UNINIT(pScreen, &requested);
+
+    if (REGION_NOTEMPTY(pScreen, &visible) &&
+        !CopyRegionDirect(pDraw, &visible, umpbuf)) {
+        BoxPtr pExtents;
+        pGC = GetScratchGC(pDraw->depth, pScreen);
+        pScratchPixmap = GetScratchPixmapHeader(pScreen,
+                                                umpbuf->width, umpbuf->height,
+                                                umpbuf->depth, umpbuf->cpp * 8,
+                                                umpbuf->pitch,
+                                                umpbuf->addr + umpbuf->offs);
+        REGION_TRANSLATE(pScreen, &visible, -pDraw->x, -pDraw->y);
+        pExtents = REGION_EXTENTS(pScreen, &visible);
+        copyRegion = REGION_CREATE(pScreen, NULL, 0);
+        REGION_COPY(pScreen, copyRegion, &visible);
+        (*pGC->funcs->ChangeClip)(pGC, CT_REGION, copyRegion, 0);
+        ValidateGC(pDraw, pGC);
+        /* Only the bounding box of the damage, not the whole window */
+        (*pGC->ops->CopyArea)((DrawablePtr)pScratchPixmap, pDraw, pGC,
+                              pExtents->x1, pExtents->y1,
+                              pExtents->x2 - pExtents->x1,
+                              pExtents->y2 - pExtents->y1,
+                              pExtents->x1, pExtents->y1);
+        FreeScratchPixmapHeader(pScratchPixmap);
+        FreeScratchGC(pGC);
+    }
+    REGION_UNINIT(pScreen, &visible);
+}
 
+/* Do ordinary copy */
+static void MaliDRI2CopyRegion_copy(DrawablePtr      pDraw,
+                                    RegionPtr        pRegion,
+                                    UMPBufferInfoPtr umpbuf)
+{
 #ifdef HAVE_LIBUMP_CACHE_CONTROL
     if (umpbuf->handle != UMP_INVALID_MEMORY_HANDLE) {
         /* That's a normal UMP allocation, not a wrapped framebuffer */
@@ -614,20 +996,7 @@ static void MaliDRI2CopyRegion_copy(DrawablePtr      pDraw,
     }
 #endif
 
-    pGC = GetScratchGC(pDraw->depth, pScreen);
-    pScratchPixmap = GetScratchPixmapHeader(pScreen,
-                                            umpbuf->width, umpbuf->height,
-                                            umpbuf->depth, umpbuf->cpp * 8,
-                                            umpbuf->pitch,
-                                            umpbuf->addr + umpbuf->offs);
-    copyRegion = REGION_CREATE(pScreen, NULL, 0);
-    REGION_COPY(pScreen, copyRegion, pRegion);
-    (*pGC->funcs->ChangeClip)(pGC, CT_REGION, copyRegion, 0);
-    ValidateGC(pDraw, pGC);
-    (*pGC->ops->CopyArea)((DrawablePtr)pScratchPixmap, pDraw, pGC, 0, 0,
-                          pDraw->width, pDraw->height, 0, 0);
-    FreeScratchPixmapHeader(pScratchPixmap);
-    FreeScratchGC(pGC);
+    CopyUMPBuffer(pDraw, pRegion, umpbuf);
 
 #ifdef HAVE_LIBUMP_CACHE_CONTROL
     if (umpbuf->handle != UMP_INVALID_MEMORY_HANDLE) {
@@ -639,20 +1008,170 @@ static void MaliDRI2CopyRegion_copy(DrawablePtr      pDraw,
 #endif
 }
 
-static void FlushOverlay(ScreenPtr pScreen)
+static void FlushOverlay(ScreenPtr pScreen, DRI2WindowStatePtr window_state)
+{
+    if (window_state->pOverlayDirtyUMP) {
+        DebugMsg("Flushing overlay content from DRI2 buffer to window\n");
+        MaliDRI2CopyRegion_copy(window_state->pDraw,
+                                &pScreen->root->winSize,
+                                window_state->pOverlayDirtyUMP);
+        window_state->pOverlayDirtyUMP = NULL;
+    }
+}
+
+/*
+ * Switching a cached UMP buffer to the CPU and back cleans and invalidates
+ * the whole buffer, even if only a few rows have been damaged. But the CPU
+ * is only reading the buffer, so it is enough to invalidate the rows which
+ * are going to be copied. The copies are postponed until the BlockHandler,
+ * so that the cache maintenance for all the windows updated in the current
+ * server iteration is done in one batch. The swaps shown this way are not
+ * completed before the copy is done (see CompleteVBlankEvent).
+ */
+
+static void DiscardPendingCopy(DRI2WindowStatePtr window_state)
+{
+    if (window_state->pPendingCopyUMP) {
+        unref_ump_buffer_info(window_state->pPendingCopyUMP);
+        window_state->pPendingCopyUMP = NULL;
+        REGION_EMPTY(window_state->pDraw->pScreen, &window_state->pending_copy);
+    }
+}
+
+static void FlushPendingCopies(ScreenPtr pScreen)
 {
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    DRI2WindowStatePtr window_state, tmp;
 
-    if (mali->pOverlayWin && mali->pOverlayDirtyUMP) {
-        DebugMsg("Flushing overlay content from DRI2 buffer to window\n");
-        MaliDRI2CopyRegion_copy((DrawablePtr)mali->pOverlayWin,
-                                &pScreen->root->winSize,
-                                mali->pOverlayDirtyUMP);
-        mali->pOverlayDirtyUMP = NULL;
+    if (!mali->bCopiesPending)
+        return;
+    mali->bCopiesPending = FALSE;
+
+#ifdef HAVE_LIBUMP_CPU_MSYNC
+#ifdef HAVE_LIBUMP_CACHE_CONTROL
+    ump_cache_operations_control(UMP_CACHE_OP_START);
+#endif
+    HASH_ITER(hh, mali->HashWindowState, window_state, tmp) {
+        UMPBufferInfoPtr umpbuf = window_state->pPendingCopyUMP;
+        BoxPtr pExtents;
+        int y1, y2;
+
+        if (!umpbuf)
+            continue;
+        pExtents = REGION_EXTENTS(pScreen, &window_state->pending_copy);
+        y1 = max(pExtents->y1, 0);
+        y2 = min(pExtents->y2, (int)umpbuf->height);
+        if (y1 < y2)
+            ump_cpu_msync_now(umpbuf->handle, UMP_MSYNC_CLEAN_AND_INVALIDATE,
+                              umpbuf->addr + umpbuf->offs + y1 * umpbuf->pitch,
+                              (y2 - y1) * umpbuf->pitch);
+    }
+#ifdef HAVE_LIBUMP_CACHE_CONTROL
+    ump_cache_operations_control(UMP_CACHE_OP_FINISH);
+#endif
+#endif
+
+    HASH_ITER(hh, mali->HashWindowState, window_state, tmp) {
+        if (!window_state->pPendingCopyUMP)
+            continue;
+        CopyUMPBuffer(window_state->pDraw, &window_state->pending_copy,
+                      window_state->pPendingCopyUMP);
+        DiscardPendingCopy(window_state);
     }
 }
 
+/* Returns FALSE if the buffer needs to be copied right away */
+static Bool QueueCopy(DRI2WindowStatePtr window_state,
+                      RegionPtr          pRegion,
+                      UMPBufferInfoPtr   umpbuf)
+{
+#ifdef HAVE_LIBUMP_CPU_MSYNC
+    ScreenPtr pScreen = window_state->pDraw->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+
+    if (umpbuf->handle == UMP_INVALID_MEMORY_HANDLE || !umpbuf->pool_cached)
+        return FALSE;
+
+    /* The previous frame must reach the window first */
+    if (window_state->pPendingCopyUMP && window_state->pPendingCopyUMP != umpbuf)
+        FlushPendingCopies(pScreen);
+
+    if (!window_state->pPendingCopyUMP) {
+        window_state->pPendingCopyUMP = umpbuf;
+        umpbuf->refcount++;
+    }
+    REGION_UNION(pScreen, &window_state->pending_copy,
+                 &window_state->pending_copy, pRegion);
+    mali->bCopiesPending = TRUE;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ * The swap statistics. The frame times are the intervals between the frames
+ * shown in the window, the histogram buckets have these upper limits (in
+ * milliseconds) and the last bucket is for everything longer.
+ */
+static const CARD32 frame_time_limits[DRI2_FRAME_TIME_BUCKETS - 1] = {
+    10, 17, 20, 25, 34, 50, 100
+};
+
+#define SWAP_STATS_PROPERTY           "_FBTURBO_DRI2_SWAP_STATS"
+#define SWAP_STATS_PUBLISH_INTERVAL   1000
+
+static void PublishSwapStats(DRI2WindowStatePtr window_state)
+{
+    Atom atom = MakeAtom(SWAP_STATS_PROPERTY, strlen(SWAP_STATS_PROPERTY), TRUE);
+
+    if (atom != BAD_RESOURCE) {
+        dixChangeWindowProperty(serverClient, (WindowPtr)window_state->pDraw,
+                                atom, XA_CARDINAL, 32, PropModeReplace,
+                                sizeof(DRI2SwapStatsRec) / sizeof(CARD32),
+                                &window_state->stats, FALSE);
+    }
+    window_state->stats_publish_time = GetTimeInMillis();
+}
+
+static void LogSwapStats(ScreenPtr pScreen, DRI2WindowStatePtr window_state)
+{
+    DRI2SwapStatsRec *stats = &window_state->stats;
+
+    xf86DrvMsgVerb(pScreen->myNum, X_INFO, 3,
+                   "DRI2 window 0x%lx: %u frames (%u overlay, %u copied), "
+                   "%u resize recoveries, %u buffer order fixups, "
+                   "%u paced swaps\n",
+                   (unsigned long)window_state->pDraw->id,
+                   (unsigned)stats->frames, (unsigned)stats->overlay_frames,
+                   (unsigned)stats->copied_frames,
+                   (unsigned)stats->resize_recoveries,
+                   (unsigned)stats->order_fixups, (unsigned)stats->paced_swaps);
+}
+
+/* Called for every frame shown in the window */
+static void AccountFrame(ScreenPtr pScreen, DRI2WindowStatePtr window_state)
+{
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(xf86Screens[pScreen->myNum]);
+    CARD32 now = GetTimeInMillis();
+
+    window_state->stats.frames++;
+    if (window_state->last_frame_time) {
+        CARD32 frame_time = now - window_state->last_frame_time;
+        int i = 0;
+        while (i < DRI2_FRAME_TIME_BUCKETS - 1 && frame_time >= frame_time_limits[i])
+            i++;
+        window_state->stats.frame_time_hist[i]++;
+    }
+    window_state->last_frame_time = now ? now : 1;
+
+    if (mali->bSwapStats &&
+        now - window_state->stats_publish_time >= SWAP_STATS_PUBLISH_INTERVAL)
+        PublishSwapStats(window_state);
+}
+
 #ifdef DEBUG_WITH_RGB_PATTERN
 static void check_rgb_pattern(DRI2WindowStatePtr window_state,
                               UMPBufferInfoPtr umpbuf)
@@ -694,29 +1213,35 @@ static void check_rgb_pattern(DRI2WindowStatePtr window_state,
 }
 #endif
 
-static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
-                               RegionPtr     pRegion,
-                               DRI2BufferPtr pDstBuffer,
-                               DRI2BufferPtr pSrcBuffer)
+/*
+ * Show the new contents of the window, either by copying the UMP buffer
+ * to the framebuffer or by pointing the overlay to it. Returns TRUE if
+ * the overlay was used, in which case the change only becomes visible
+ * after the next vblank.
+ */
+static Bool MaliDRI2ShowRegion(DrawablePtr pDraw, RegionPtr pRegion)
 {
+    int layer;
     ScreenPtr pScreen = pDraw->pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
     UMPBufferInfoPtr umpbuf;
     sunxi_disp_t *disp = SUNXI_DISP(xf86Screens[pScreen->myNum]);
-    DRI2WindowStatePtr window_state = NULL;
-    HASH_FIND_PTR(mali->HashWindowState, &pDraw, window_state);
+    DRI2WindowStatePtr window_state = GetWindowState(pDraw);
 
     if (pDraw->type == DRAWABLE_PIXMAP) {
         DebugMsg("MaliDRI2CopyRegion has been called for pixmap %p\n", pDraw);
-        return;
+        return FALSE;
     }
 
     if (!window_state) {
         DebugMsg("MaliDRI2CopyRegion: can't find window %p in the hash\n", pDraw);
-        return;
+        return FALSE;
     }
 
+    /* OpenGL ES windows redraw every frame, backing store is useless */
+    BackingStoreTuner_HintFrequentUpdates(pDraw);
+
     /* Try to fetch a new UMP buffer from the queue */
     umpbuf = umpbuf_fetch_from_queue(window_state);
 
@@ -746,12 +1271,14 @@ static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
             /* That's normal, we have successfully passed this check */
             ump_back->extra_flags |= UMPBUF_PASSED_ORDER_CHECK;
             ump_front->extra_flags |= UMPBUF_PASSED_ORDER_CHECK;
+            window_state->stats.order_checks_passed++;
         }
         else if (front_modified) {
             /* That's bad, the order of buffers is messed up, but we can exchange them */
             UMPBufferInfoPtr tmp               = window_state->ump_back_buffer_ptr;
             window_state->ump_back_buffer_ptr  = window_state->ump_front_buffer_ptr;
             window_state->ump_front_buffer_ptr = tmp;
+            window_state->stats.order_fixups++;
             DebugMsg("Unexpected modification of the front buffer detected.\n");
         }
         else {
@@ -776,6 +1303,9 @@ static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
         window_state->ump_front_buffer_ptr = tmp;
         window_state->buf_swap_cnt++;
     }
+    else {
+        window_state->stats.skipped_swaps++;
+    }
 
     /* Try to replace the front buffer with a new UMP buffer from the queue */
     if (umpbuf) {
@@ -791,14 +1321,16 @@ static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
         umpbuf = window_state->ump_mem_buffer_ptr;
 
     if (!umpbuf || !umpbuf->addr)
-        return;
+        return FALSE;
+
+    AccountFrame(pScreen, window_state);
 
 #ifdef DEBUG_WITH_RGB_PATTERN
     check_rgb_pattern(window_state, umpbuf);
 #endif
 
     /*
-     * Here we can calculate checksums over randomly sampled bytes from UMP
+     * Here we can calculate checksums over randomly sampled chunks of UMP
      * buffers in order to check later whether they had been modified. This
      * is skipped if the buffers have UMPBUF_PASSED_ORDER_CHECK flag set.
      */
@@ -817,98 +1349,554 @@ static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
 
     UpdateOverlay(pScreen);
 
-    if (!mali->bOverlayWinEnabled || umpbuf->handle != UMP_INVALID_MEMORY_HANDLE) {
-        MaliDRI2CopyRegion_copy(pDraw, pRegion, umpbuf);
-        mali->pOverlayDirtyUMP = NULL;
-        return;
+    if (window_state->overlay_slot < 0 ||
+        umpbuf->handle != UMP_INVALID_MEMORY_HANDLE) {
+        if (!QueueCopy(window_state, pRegion, umpbuf))
+            MaliDRI2CopyRegion_copy(pDraw, pRegion, umpbuf);
+        window_state->pOverlayDirtyUMP = NULL;
+        window_state->stats.copied_frames++;
+        return FALSE;
     }
 
+    /* The layer is on top, an older frame does not need to be copied */
+    DiscardPendingCopy(window_state);
+
     /* Mark the overlay as "dirty" and remember the last up to date UMP buffer */
-    mali->pOverlayDirtyUMP = umpbuf;
+    window_state->pOverlayDirtyUMP = umpbuf;
 
     /* Activate the overlay */
-    sunxi_layer_set_output_window(disp, pDraw->x, pDraw->y, pDraw->width, pDraw->height);
-    sunxi_layer_set_rgb_input_buffer(disp, umpbuf->cpp * 8, umpbuf->offs,
+    layer = mali->overlay_layers[window_state->overlay_slot];
+    sunxi_layer_set_output_window(disp, layer,
+                                  pDraw->x, pDraw->y, pDraw->width, pDraw->height);
+    sunxi_layer_set_rgb_input_buffer(disp, layer,
+                                     umpbuf->cpp * 8, umpbuf->offs,
                                      umpbuf->width, umpbuf->height, umpbuf->pitch / 4);
-    sunxi_layer_show(disp);
+    sunxi_layer_show(disp, layer);
+    window_state->overlay_shown = TRUE;
+    window_state->overlay_x = pDraw->x;
+    window_state->overlay_y = pDraw->y;
+    window_state->stats.overlay_frames++;
+    return TRUE;
+}
 
-    if (mali->bSwapbuffersWait) {
-        /* FIXME: blocking here for up to 1/60 second is not nice */
+static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
+                               RegionPtr     pRegion,
+                               DRI2BufferPtr pDstBuffer,
+                               DRI2BufferPtr pSrcBuffer)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pDraw->pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+
+    /*
+     * The swaps are normally scheduled and completed asynchronously, this
+     * is only reached by the explicit DRI2CopyRegion requests or when the
+     * vblank tracker is not available.
+     */
+    if (MaliDRI2ShowRegion(pDraw, pRegion) && mali->bSwapbuffersWait)
         sunxi_wait_for_vsync(disp);
-    }
+
+    /* DRI2 completes the swap right after this, so don't postpone the copy */
+    FlushPendingCopies(pDraw->pScreen);
 }
 
 /************************************************************************/
 
-static void UpdateOverlay(ScreenPtr pScreen)
+#if DRI2INFOREC_VERSION >= 4
+
+/*
+ * Asynchronous swaps and WaitMSC requests. The vblank tracker counts the
+ * vblanks in its own thread (or estimates them if the kernel can't wait
+ * for vsync), and a timer in the X server main loop handles the pending
+ * requests after the predicted vblank time. The clients are throttled by
+ * DRI2 until their swaps complete, but the X server itself never blocks.
+ */
+
+enum { DRI2_VBLANK_SWAP, DRI2_VBLANK_WAIT_MSC };
+
+struct DRI2VBlankEvent {
+    DRI2VBlankEventPtr      next;
+    int                     type;
+    /*
+     * The client may disconnect (then 'client' is reset to NULL by
+     * ClientStateChanged) and the drawable may be destroyed
+     */
+    ClientPtr               client;
+    XID                     drawable_id;
+    /* a swap is shown one vblank before its target */
+    Bool                    shown;
+    int                     swap_type;
+    CARD64                  show_msc;
+    CARD64                  target_msc;
+    DRI2SwapEventPtr        func;
+    void                   *data;
+};
+
+static uint64_t gettime_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ShowSwap(DrawablePtr pDraw, DRI2VBlankEventPtr ev, uint64_t msc)
+{
+    RegionRec region;
+    BoxRec box;
+
+    box.x1 = 0;
+    box.y1 = 0;
+    box.x2 = pDraw->width;
+    box.y2 = pDraw->height;
+    REGION_INIT(pDraw->pScreen, &region, &box, 0);
+
+    if (MaliDRI2ShowRegion(pDraw, &region)) {
+        /* The overlay switches to the new buffer on the next vblank */
+        ev->swap_type = DRI2_FLIP_COMPLETE;
+        if (ev->target_msc <= msc)
+            ev->target_msc = msc + 1;
+    }
+    else {
+        ev->swap_type = DRI2_BLIT_COMPLETE;
+    }
+    ev->shown = TRUE;
+
+    REGION_UNINIT(pDraw->pScreen, &region);
+}
+
+static void CompleteVBlankEvent(DRI2VBlankEventPtr ev, DrawablePtr pDraw,
+                                uint64_t msc, uint64_t ust)
+{
+    Bool client_alive = ev->client != NULL;
+
+    if (ev->type == DRI2_VBLANK_SWAP) {
+        /*
+         * The client may render to the same buffer again as soon as the
+         * swap completes, so the postponed copies have to be done first
+         */
+        FlushPendingCopies(pDraw->pScreen);
+        DRI2SwapComplete(client_alive ? ev->client : serverClient, pDraw,
+                         msc, ust / 1000000, ust % 1000000, ev->swap_type,
+                         client_alive ? ev->func : NULL, ev->data);
+    }
+    else if (client_alive) {
+        DRI2WaitMSCComplete(ev->client, pDraw, msc,
+                            ust / 1000000, ust % 1000000);
+    }
+}
+
+/* Returns the vblank counter value, which is needed by the event */
+static CARD64 VBlankEventDeadline(DRI2VBlankEventPtr ev)
+{
+    if (ev->type == DRI2_VBLANK_SWAP && !ev->shown)
+        return ev->show_msc;
+    return ev->target_msc;
+}
+
+/* Returns the delay in milliseconds until the next check, 0 if idle */
+static CARD32 NextVBlankEventDelay(ScreenPtr pScreen)
 {
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    DRI2VBlankEventPtr ev;
+    uint64_t msc, ust, deadline = UINT64_MAX, predicted, now;
 
-    if (!mali->pOverlayWin || !disp)
-        return;
+    if (!mali->PendingVBlankEvents)
+        return 0;
 
-    /* Disable overlays if the hardware cursor is not in use */
-    if (!mali->bHardwareCursorIsInUse) {
-        if (mali->bOverlayWinEnabled) {
-            DebugMsg("Disabling overlay (no hardware cursor)\n");
-            sunxi_layer_hide(disp);
-            mali->bOverlayWinEnabled = FALSE;
-        }
-        return;
+    for (ev = mali->PendingVBlankEvents; ev; ev = ev->next) {
+        if (VBlankEventDeadline(ev) < deadline)
+            deadline = VBlankEventDeadline(ev);
     }
 
-    /* If the window is not mapped, make sure that the overlay is disabled */
-    if (!mali->pOverlayWin->mapped)
-    {
-        if (mali->bOverlayWinEnabled) {
-            DebugMsg("Disabling overlay (window is not mapped)\n");
-            sunxi_layer_hide(disp);
-            mali->bOverlayWinEnabled = FALSE;
+    /* Check a bit after the vblank is expected to happen */
+    msc = vblank_tracker_get_msc(disp->vblank, &ust);
+    if (deadline <= msc)
+        return 1;
+    predicted = ust + (deadline - msc) * disp->vblank->period_usec;
+    now = gettime_usec();
+    if (predicted <= now)
+        return 1;
+    return (predicted - now) / 1000 + 1;
+}
+
+static CARD32 ProcessVBlankEvents(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    DRI2VBlankEventPtr ev, *pprev = &mali->PendingVBlankEvents;
+    uint64_t msc, ust;
+
+    msc = vblank_tracker_get_msc(disp->vblank, &ust);
+
+    while ((ev = *pprev)) {
+        DrawablePtr pDraw;
+
+        if (VBlankEventDeadline(ev) > msc) {
+            pprev = &ev->next;
+            continue;
         }
-        return;
+
+        if (dixLookupDrawable(&pDraw, ev->drawable_id, serverClient,
+                              M_ANY, DixWriteAccess) != Success) {
+            DebugMsg("ProcessVBlankEvents: the drawable is gone\n");
+            *pprev = ev->next;
+            free(ev);
+            continue;
+        }
+
+        if (ev->type == DRI2_VBLANK_SWAP && !ev->shown) {
+            ShowSwap(pDraw, ev, msc);
+            if (ev->target_msc > msc) {
+                pprev = &ev->next;
+                continue;
+            }
+        }
+
+        CompleteVBlankEvent(ev, pDraw, msc, ust);
+        *pprev = ev->next;
+        free(ev);
+    }
+
+    if (!mali->PendingVBlankEvents && mali->bVBlankAcquired) {
+        vblank_tracker_release(disp->vblank);
+        mali->bVBlankAcquired = FALSE;
+    }
+
+    return NextVBlankEventDelay(pScreen);
+}
+
+static CARD32 VBlankTimerCallback(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    return ProcessVBlankEvents((ScreenPtr)arg);
+}
+
+/* Add the event to the pending list, returns FALSE on failure */
+static Bool QueueVBlankEvent(ScreenPtr pScreen, DRI2VBlankEventPtr ev)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    CARD32 delay;
+
+    if (!mali->bVBlankAcquired)
+        mali->bVBlankAcquired = vblank_tracker_acquire(disp->vblank);
+    if (!mali->bVBlankAcquired)
+        return FALSE;
+
+    ev->next = mali->PendingVBlankEvents;
+    mali->PendingVBlankEvents = ev;
+
+    delay = NextVBlankEventDelay(pScreen);
+    if (delay)
+        mali->VBlankTimer = TimerSet(mali->VBlankTimer, 0, delay,
+                                     VBlankTimerCallback, pScreen);
+    return TRUE;
+}
+
+static int MaliDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
+{
+    sunxi_disp_t *disp = SUNXI_DISP(xf86Screens[pDraw->pScreen->myNum]);
+    uint64_t tmp_ust;
+
+    *msc = vblank_tracker_get_msc(disp->vblank, &tmp_ust);
+    *ust = tmp_ust;
+    return TRUE;
+}
+
+static int MaliDRI2ScheduleSwap(ClientPtr         client,
+                                DrawablePtr       pDraw,
+                                DRI2BufferPtr     pFrontBuffer,
+                                DRI2BufferPtr     pBackBuffer,
+                                CARD64           *target_msc,
+                                CARD64            divisor,
+                                CARD64            remainder,
+                                DRI2SwapEventPtr  func,
+                                void             *data)
+{
+    ScreenPtr pScreen = pDraw->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    DRI2WindowStatePtr window_state = GetWindowState(pDraw);
+    DRI2VBlankEventRec swap;
+    DRI2VBlankEventPtr ev;
+    uint64_t msc, ust;
+    Bool paced = window_state && mali->FramePacingInterval > 0;
+
+    msc = vblank_tracker_get_msc(disp->vblank, &ust);
+
+    /* The usual OML_sync_control rules for the target vblank */
+    if (divisor == 0 || msc < *target_msc) {
+        if (*target_msc < msc)
+            *target_msc = msc;
+    }
+    else {
+        *target_msc = msc - (msc % divisor) + remainder;
+        if (*target_msc <= msc)
+            *target_msc += divisor;
+    }
+
+    /* Frame pacing, not earlier than the interval after the previous swap */
+    if (paced && window_state->last_swap_msc &&
+        *target_msc < window_state->last_swap_msc + mali->FramePacingInterval) {
+        *target_msc = window_state->last_swap_msc + mali->FramePacingInterval;
+        window_state->stats.paced_swaps++;
     }
 
+    memset(&swap, 0, sizeof(swap));
+    swap.type         = DRI2_VBLANK_SWAP;
+    swap.client       = client;
+    swap.drawable_id  = pDraw->id;
+    swap.target_msc   = mali->bSwapbuffersWait || paced ? *target_msc : msc;
+    swap.show_msc     = swap.target_msc > msc ? swap.target_msc - 1 : msc;
+    swap.func         = func;
+    swap.data         = data;
+
+    if (window_state)
+        window_state->last_swap_msc = swap.target_msc;
+
     /*
-     * Walk the windows tree to get the obscured/unobscured status of
-     * the window (because we can't rely on self->pOverlayWin->visibility
-     * for redirected windows).
+     * Show it right away if possible, maybe waiting for the completion.
+     * A swap shown by a postponed copy is completed from the timer, so
+     * that the copies of the windows swapped in this burst are batched.
      */
+    if (swap.show_msc <= msc) {
+        ShowSwap(pDraw, &swap, msc);
+        if (((!mali->bSwapbuffersWait && !paced) || swap.target_msc <= msc) &&
+            !(window_state && window_state->pPendingCopyUMP)) {
+            CompleteVBlankEvent(&swap, pDraw, msc, ust);
+            return TRUE;
+        }
+    }
 
-    mali->bWalkingAboveOverlayWin = FALSE;
-    mali->bOverlayWinOverlapped = FALSE;
-    FancyTraverseTree(pScreen->root, WindowWalker, mali);
+    if ((ev = malloc(sizeof(DRI2VBlankEventRec)))) {
+        *ev = swap;
+        if (QueueVBlankEvent(pScreen, ev))
+            return TRUE;
+        free(ev);
+    }
+
+    /* Can't track vblanks, complete the swap immediately */
+    if (!swap.shown)
+        ShowSwap(pDraw, &swap, msc);
+    CompleteVBlankEvent(&swap, pDraw, msc, ust);
+    return TRUE;
+}
 
-    /* If the window got overlapped -> disable overlay */
-    if (mali->bOverlayWinOverlapped && mali->bOverlayWinEnabled) {
-        DebugMsg("Disabling overlay (window is obscured)\n");
-        FlushOverlay(pScreen);
-        mali->bOverlayWinEnabled = FALSE;
-        sunxi_layer_hide(disp);
+static int MaliDRI2ScheduleWaitMSC(ClientPtr   client,
+                                   DrawablePtr pDraw,
+                                   CARD64      target_msc,
+                                   CARD64      divisor,
+                                   CARD64      remainder)
+{
+    ScreenPtr pScreen = pDraw->pScreen;
+    sunxi_disp_t *disp = SUNXI_DISP(xf86Screens[pScreen->myNum]);
+    DRI2VBlankEventPtr ev;
+    uint64_t msc, ust;
+
+    msc = vblank_tracker_get_msc(disp->vblank, &ust);
+
+    if (divisor == 0 || msc < target_msc) {
+        if (target_msc <= msc)
+            goto complete_now;
+    }
+    else {
+        target_msc = msc - (msc % divisor) + remainder;
+        if (target_msc <= msc)
+            target_msc += divisor;
+    }
+
+    if (!(ev = calloc(1, sizeof(DRI2VBlankEventRec))))
+        goto complete_now;
+
+    ev->type         = DRI2_VBLANK_WAIT_MSC;
+    ev->client       = client;
+    ev->drawable_id  = pDraw->id;
+    ev->target_msc   = target_msc;
+
+    if (!QueueVBlankEvent(pScreen, ev)) {
+        free(ev);
+        goto complete_now;
+    }
+
+    DRI2BlockClient(client, pDraw);
+    return TRUE;
+
+complete_now:
+    DRI2WaitMSCComplete(client, pDraw, msc, ust / 1000000, ust % 1000000);
+    return TRUE;
+}
+
+/*
+ * A disconnected client can't be notified anymore (its ClientRec is freed
+ * and the index may be reused by a new client), so its events are only
+ * left to show the swaps and to unblock the drawables.
+ */
+static void ClientStateChanged(CallbackListPtr *list, pointer closure,
+                               pointer data)
+{
+    ScreenPtr pScreen = closure;
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(xf86Screens[pScreen->myNum]);
+    ClientPtr client = ((NewClientInfoRec *)data)->client;
+    DRI2VBlankEventPtr ev;
+
+    if (client->clientState != ClientStateGone)
         return;
+
+    for (ev = mali->PendingVBlankEvents; ev; ev = ev->next) {
+        if (ev->client == client)
+            ev->client = NULL;
     }
+}
 
-    /* If the window got moved -> update overlay position */
-    if (!mali->bOverlayWinOverlapped &&
-        (mali->overlay_x != mali->pOverlayWin->drawable.x ||
-         mali->overlay_y != mali->pOverlayWin->drawable.y))
-    {
-        mali->overlay_x = mali->pOverlayWin->drawable.x;
-        mali->overlay_y = mali->pOverlayWin->drawable.y;
+static void FreeVBlankEvents(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
 
-        sunxi_layer_set_output_window(disp, mali->pOverlayWin->drawable.x,
-                                      mali->pOverlayWin->drawable.y,
-                                      mali->pOverlayWin->drawable.width,
-                                      mali->pOverlayWin->drawable.height);
-        DebugMsg("Move overlay to (%d, %d)\n", mali->overlay_x, mali->overlay_y);
+    if (mali->VBlankTimer) {
+        TimerFree(mali->VBlankTimer);
+        mali->VBlankTimer = NULL;
+    }
+    while (mali->PendingVBlankEvents) {
+        DRI2VBlankEventPtr ev = mali->PendingVBlankEvents;
+        mali->PendingVBlankEvents = ev->next;
+        free(ev);
+    }
+    if (mali->bVBlankAcquired) {
+        vblank_tracker_release(disp->vblank);
+        mali->bVBlankAcquired = FALSE;
     }
+}
+
+#endif
+
+/************************************************************************/
 
-    /* If the window got unobscured -> enable overlay */
-    if (!mali->bOverlayWinOverlapped && !mali->bOverlayWinEnabled) {
-        DebugMsg("Enabling overlay (window is fully unobscured)\n");
-        mali->bOverlayWinEnabled = TRUE;
-        sunxi_layer_show(disp);
+/*
+ * The windows compete for the disp layers by their area, so that the
+ * biggest windows (where copying costs the most) get the overlays. The
+ * windows, which already own a layer, get a bonus in order to prevent
+ * the layers from bouncing between windows of similar size.
+ */
+static unsigned OverlayPriority(DRI2WindowStatePtr window_state)
+{
+    unsigned priority = (unsigned)window_state->pDraw->width *
+                        window_state->pDraw->height;
+    if (window_state->overlay_slot >= 0)
+        priority *= 2;
+    return priority;
+}
+
+static void UpdateOverlay(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    DRI2WindowStatePtr window_state, tmp;
+    DRI2WindowStatePtr top[SUNXI_DISP_MAX_LAYERS];
+    int i, j, ntop = 0;
+
+    if (!disp)
+        return;
+
+    HASH_ITER(hh, mali->HashWindowState, window_state, tmp) {
+        WindowPtr pWin = (WindowPtr)window_state->pDraw;
+        unsigned priority;
+
+        if (!window_state->overlay_area_size)
+            continue;
+
+        /*
+         * Check the windows above to get the obscured/unobscured status of
+         * the window (because we can't rely on pWin->visibility for
+         * redirected windows). This only needs to be done again after
+         * the window tree has been validated.
+         */
+        if (mali->bOverlayOcclusionDirty)
+            window_state->overlay_overlapped = pWin->mapped &&
+                                               IsWindowObscured(pWin);
+
+        /* Overlays need the hardware cursor and a fully visible window */
+        if (!mali->bHardwareCursorIsInUse || !pWin->mapped ||
+                                             window_state->overlay_overlapped) {
+            DemoteOverlayWindow(pScreen, window_state, TRUE);
+            continue;
+        }
+
+        /* Keep the candidates sorted by priority, highest first */
+        priority = OverlayPriority(window_state);
+        for (i = ntop; i > 0 && OverlayPriority(top[i - 1]) < priority; i--) {
+            if (i < SUNXI_DISP_MAX_LAYERS)
+                top[i] = top[i - 1];
+        }
+        if (i < SUNXI_DISP_MAX_LAYERS) {
+            top[i] = window_state;
+            if (ntop < SUNXI_DISP_MAX_LAYERS)
+                ntop++;
+        }
+    }
+    mali->bOverlayOcclusionDirty = FALSE;
+
+    /*
+     * Grab layers from the pool if there are more candidates (XV returns
+     * its layers there when the video is stopped)
+     */
+    while (mali->num_overlay_layers < ntop) {
+        int layer = sunxi_layer_reserve(disp);
+        if (layer < 0)
+            break;
+        mali->overlay_layers[mali->num_overlay_layers++] = layer;
+    }
+    if (ntop > mali->num_overlay_layers)
+        ntop = mali->num_overlay_layers;
+
+    /* The windows, which lost the competition, fall back to copying */
+    for (i = 0; i < mali->num_overlay_layers; i++) {
+        DRI2WindowStatePtr owner = mali->overlay_owners[i];
+        if (!owner)
+            continue;
+        for (j = 0; j < ntop && top[j] != owner; j++);
+        if (j == ntop) {
+            DebugMsg("Window %p loses the overlay to a bigger one\n",
+                     owner->pDraw);
+            DemoteOverlayWindow(pScreen, owner, TRUE);
+        }
+    }
+
+    for (j = 0; j < ntop; j++) {
+        window_state = top[j];
+        if (window_state->overlay_slot < 0) {
+            /* Gets shown by the next swap, which puts the buffer there */
+            for (i = 0; mali->overlay_owners[i]; i++);
+            DebugMsg("Assign overlay %d to window %p\n", i, window_state->pDraw);
+            mali->overlay_owners[i] = window_state;
+            window_state->overlay_slot = i;
+            window_state->overlay_shown = FALSE;
+            continue;
+        }
+
+        /* If the window got moved -> update overlay position */
+        if (window_state->overlay_shown &&
+            (window_state->overlay_x != window_state->pDraw->x ||
+             window_state->overlay_y != window_state->pDraw->y))
+        {
+            window_state->overlay_x = window_state->pDraw->x;
+            window_state->overlay_y = window_state->pDraw->y;
+
+            sunxi_layer_set_output_window(disp,
+                                mali->overlay_layers[window_state->overlay_slot],
+                                window_state->pDraw->x,
+                                window_state->pDraw->y,
+                                window_state->pDraw->width,
+                                window_state->pDraw->height);
+            DebugMsg("Move overlay to (%d, %d)\n",
+                     window_state->overlay_x, window_state->overlay_y);
+        }
     }
 }
 
@@ -919,28 +1907,29 @@ DestroyWindow(WindowPtr pWin)
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
     Bool ret;
-    DrawablePtr pDraw = &pWin->drawable;
-    DRI2WindowStatePtr window_state = NULL;
-    HASH_FIND_PTR(mali->HashWindowState, &pDraw, window_state);
+    DRI2WindowStatePtr window_state = GetWindowState(&pWin->drawable);
     if (window_state) {
         DebugMsg("Free DRI2 bookkeeping for window %p\n", pWin);
+        if (mali->bSwapStats && window_state->stats.frames)
+            LogSwapStats(pScreen, window_state);
+        DemoteOverlayWindow(pScreen, window_state, FALSE);
+        if (SUNXI_DISP(pScrn))
+            FreeOverlayArea(SUNXI_DISP(pScrn), window_state);
+        DiscardPendingCopy(window_state);
+        REGION_UNINIT(pScreen, &window_state->pending_copy);
         HASH_DEL(mali->HashWindowState, window_state);
+        dixSetPrivate(&pWin->devPrivates, &WindowStateKeyRec, NULL);
         if (window_state->ump_mem_buffer_ptr)
             unref_ump_buffer_info(window_state->ump_mem_buffer_ptr);
         if (window_state->ump_back_buffer_ptr)
             unref_ump_buffer_info(window_state->ump_back_buffer_ptr);
         if (window_state->ump_front_buffer_ptr)
             unref_ump_buffer_info(window_state->ump_front_buffer_ptr);
+        /* Nobody else may get them (the ones released later just expire) */
+        ump_pool_drop_owner(&mali->ump_pool, window_state->ump_pool_owner);
         free(window_state);
     }
 
-    if (pWin == mali->pOverlayWin) {
-        sunxi_disp_t *disp = SUNXI_DISP(pScrn);
-        sunxi_layer_hide(disp);
-        mali->pOverlayWin = NULL;
-        DebugMsg("DestroyWindow %p\n", pWin);
-    }
-
     pScreen->DestroyWindow = mali->DestroyWindow;
     ret = (*pScreen->DestroyWindow) (pWin);
     mali->DestroyWindow = pScreen->DestroyWindow;
@@ -963,6 +1952,8 @@ PostValidateTree(WindowPtr pWin, WindowPtr pLayerWin, VTKind kind)
         pScreen->PostValidateTree = PostValidateTree;
     }
 
+    /* Something got mapped, unmapped, moved, resized or restacked */
+    mali->bOverlayOcclusionDirty = TRUE;
     UpdateOverlay(pScreen);
 }
 
@@ -977,10 +1968,13 @@ GetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
     ScreenPtr pScreen = pDrawable->pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    DRI2WindowStatePtr window_state, tmp;
+
+    FlushPendingCopies(pScreen);
 
     /* FIXME: more precise check */
-    if (mali->pOverlayDirtyUMP)
-        FlushOverlay(pScreen);
+    HASH_ITER(hh, mali->HashWindowState, window_state, tmp)
+        FlushOverlay(pScreen, window_state);
 
     if (mali->GetImage) {
         pScreen->GetImage = mali->GetImage;
@@ -990,6 +1984,21 @@ GetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
     }
 }
 
+static void
+BlockHandler(BLOCKHANDLER_ARGS_DECL)
+{
+    SCREEN_PTR(arg);
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+
+    FlushPendingCopies(pScreen);
+
+    pScreen->BlockHandler = mali->BlockHandler;
+    (*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
+    mali->BlockHandler = pScreen->BlockHandler;
+    pScreen->BlockHandler = BlockHandler;
+}
+
 static Bool
 DestroyPixmap(PixmapPtr pPixmap)
 {
@@ -997,8 +2006,7 @@ DestroyPixmap(PixmapPtr pPixmap)
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
     Bool result;
-    UMPBufferInfoPtr umpbuf;
-    HASH_FIND_PTR(mali->HashPixmapToUMP, &pPixmap, umpbuf);
+    UMPBufferInfoPtr umpbuf = GetPixmapUMP(pPixmap);
 
     if (umpbuf) {
         DebugMsg("DestroyPixmap %p for migrated UMP pixmap (UMP buffer=%p)\n", pPixmap, umpbuf);
@@ -1006,7 +2014,7 @@ DestroyPixmap(PixmapPtr pPixmap)
         pPixmap->devKind = umpbuf->BackupDevKind;
         pPixmap->devPrivate.ptr = umpbuf->BackupDevPrivatePtr;
 
-        HASH_DEL(mali->HashPixmapToUMP, umpbuf);
+        dixSetPrivate(&pPixmap->devPrivates, &PixmapUMPKeyRec, NULL);
         umpbuf->pPixmap = NULL;
         unref_ump_buffer_info(umpbuf);
     }
@@ -1103,12 +2111,21 @@ SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
         return NULL;
     }
 
+    if (!dixRegisterPrivateKey(&WindowStateKeyRec, PRIVATE_WINDOW, 0) ||
+        !dixRegisterPrivateKey(&PixmapUMPKeyRec, PRIVATE_PIXMAP, 0)) {
+        drmClose(drm_fd);
+        ErrorF("SunxiMaliDRI2_Init: dixRegisterPrivateKey failed\n");
+        return NULL;
+    }
+
     if (!(mali = calloc(1, sizeof(SunxiMaliDRI2)))) {
         ErrorF("SunxiMaliDRI2_Init: calloc failed\n");
         return NULL;
     }
 
     mali->ump_alternative_fb_secure_id = UMP_INVALID_SECURE_ID;
+    mali->ump_pool.max_idle_size = (size_t)pScrn->virtualX * pScrn->virtualY *
+                                   4 * UMP_POOL_MAX_IDLE_SCREENS;
 
     if (disp && bUseOverlay) {
         /* Try to get UMP framebuffer wrapper with secure id 1 */
@@ -1184,6 +2201,15 @@ SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
     info.DestroyBuffer = MaliDRI2DestroyBuffer;
     info.CopyRegion = MaliDRI2CopyRegion;
 
+#if DRI2INFOREC_VERSION >= 4
+    if (disp && disp->vblank) {
+        info.version = 4;
+        info.ScheduleSwap = MaliDRI2ScheduleSwap;
+        info.GetMSC = MaliDRI2GetMSC;
+        info.ScheduleWaitMSC = MaliDRI2ScheduleWaitMSC;
+    }
+#endif
+
     if (!DRI2ScreenInit(pScreen, &info)) {
         drmClose(drm_fd);
         free(mali);
@@ -1204,6 +2230,9 @@ SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
         /* Wrap the current DestroyPixmap function */
         mali->DestroyPixmap = pScreen->DestroyPixmap;
         pScreen->DestroyPixmap = DestroyPixmap;
+        /* Wrap the current BlockHandler function */
+        mali->BlockHandler = pScreen->BlockHandler;
+        pScreen->BlockHandler = BlockHandler;
 
         /* Wrap hardware cursor callback functions */
         if (hwc) {
@@ -1213,6 +2242,17 @@ SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
             hwc->DisableHWCursor = DisableHWCursor;
         }
 
+        /* XV may take the overlay layers when it needs them */
+        if (disp) {
+            disp->reclaim_layer = ReclaimOverlayLayer;
+            disp->reclaim_layer_data = pScreen;
+        }
+
+#if DRI2INFOREC_VERSION >= 4
+        /* The pending vblank events must forget the disconnected clients */
+        AddCallback(&ClientStateCallback, ClientStateChanged, pScreen);
+#endif
+
         mali->drm_fd = drm_fd;
         mali->bSwapbuffersWait = bSwapbuffersWait;
         return mali;
@@ -1224,18 +2264,53 @@ void SunxiMaliDRI2_Close(ScreenPtr pScreen)
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
     SunxiDispHardwareCursor *hwc = SUNXI_DISP_HWC(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    DRI2WindowStatePtr window_state, tmp;
+    int i;
 
     /* Unwrap functions */
     pScreen->DestroyWindow    = mali->DestroyWindow;
     pScreen->PostValidateTree = mali->PostValidateTree;
     pScreen->GetImage         = mali->GetImage;
     pScreen->DestroyPixmap    = mali->DestroyPixmap;
+    pScreen->BlockHandler     = mali->BlockHandler;
 
     if (hwc) {
         hwc->EnableHWCursor  = mali->EnableHWCursor;
         hwc->DisableHWCursor = mali->DisableHWCursor;
     }
 
+#if DRI2INFOREC_VERSION >= 4
+    DeleteCallback(&ClientStateCallback, ClientStateChanged, pScreen);
+    FreeVBlankEvents(pScreen);
+#endif
+
+    /* Nothing is going to be shown anymore */
+    HASH_ITER(hh, mali->HashWindowState, window_state, tmp)
+        DiscardPendingCopy(window_state);
+    mali->bCopiesPending = FALSE;
+
+    ump_pool_trim(&mali->ump_pool, 0);
+    if (mali->ump_pool.trim_timer) {
+        TimerFree(mali->ump_pool.trim_timer);
+        mali->ump_pool.trim_timer = NULL;
+    }
+    /* The buffers released from now on don't go to the pool anymore */
+    mali->ump_pool.max_idle_size = 0;
+
+    /* Return the overlay layers and memory */
+    for (i = 0; i < mali->num_overlay_layers; i++) {
+        sunxi_layer_hide(disp, mali->overlay_layers[i]);
+        sunxi_layer_release(disp, mali->overlay_layers[i]);
+    }
+    mali->num_overlay_layers = 0;
+    if (disp) {
+        HASH_ITER(hh, mali->HashWindowState, window_state, tmp)
+            FreeOverlayArea(disp, window_state);
+        disp->reclaim_layer = NULL;
+        disp->reclaim_layer_data = NULL;
+    }
+
     if (mali->ump_null_handle1 != UMP_INVALID_MEMORY_HANDLE)
         ump_reference_release(mali->ump_null_handle1);
     if (mali->ump_null_handle2 != UMP_INVALID_MEMORY_HANDLE)
@@ -1244,3 +2319,25 @@ void SunxiMaliDRI2_Close(ScreenPtr pScreen)
     drmClose(mali->drm_fd);
     DRI2CloseScreen(pScreen);
 }
+
+void SunxiMaliDRI2_EnableSwapStats(ScreenPtr pScreen)
+{
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(xf86Screens[pScreen->myNum]);
+    mali->bSwapStats = TRUE;
+}
+
+Bool SunxiMaliDRI2_SetFramePacing(ScreenPtr pScreen, int interval)
+{
+#if DRI2INFOREC_VERSION >= 4
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiMaliDRI2 *mali = SUNXI_MALI_UMP_DRI2(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+
+    /* The swaps are only scheduled on vblank if the vblanks are tracked */
+    if (disp && disp->vblank) {
+        mali->FramePacingInterval = interval > 0 ? interval : 0;
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
@@ -33,8 +33,54 @@
 #define UMPBUF_MUST_BE_EVEN_FRAME 2
 #define UMPBUF_PASSED_ORDER_CHECK 4
 
-/* The number of bytes randomly sampled from UMP buffer to detect its change */
-#define RANDOM_SAMPLES_COUNT      64
+/*
+ * The pool of idle UMP buffers, which are recycled instead of allocating
+ * physically contiguous memory again and again (see the .c file).
+ */
+#define UMP_POOL_MAX_ENTRIES      16
+/*
+ * Don't reuse a buffer, which the client may still be rendering to. The
+ * Mali blob requests the new buffers of a resized window (DRI2GetBuffers)
+ * at the start of a frame, after the jobs of the previous frame have been
+ * finished, so normally nothing renders to the released buffer anymore.
+ * The quarantine is just a margin for a frame still in flight (one frame
+ * at 20 fps). It is not a guarantee, and this is why the back buffers are
+ * only recycled for the same window: the worst case is a garbled frame in
+ * the window, which is redrawn by the next one anyway.
+ */
+#define UMP_POOL_QUARANTINE_MS    50
+/* Release the buffers, which have not been needed for a while */
+#define UMP_POOL_TRIM_DELAY_MS    3000
+/* The limit for the idle memory in the pool, in fullscreen 32bpp buffers */
+#define UMP_POOL_MAX_IDLE_SCREENS 2
+
+typedef struct
+{
+    ump_handle              handle;
+    uint8_t                *addr;
+    size_t                  size;
+    Bool                    cached;
+    /* the window, which has used the buffer, or UMP_POOL_OWNER_PIXMAP */
+    CARD32                  owner;
+    CARD32                  released_time;
+} UMPPoolEntry;
+
+/*
+ * The buffers of the migrated pixmaps are recycled for the pixmaps only
+ * (and cleared), they never become the back buffers of the windows.
+ */
+#define UMP_POOL_OWNER_PIXMAP     0
+
+typedef struct UMPPool
+{
+    UMPPoolEntry            entries[UMP_POOL_MAX_ENTRIES];
+    int                     count;
+    size_t                  idle_size;
+    size_t                  max_idle_size;
+    OsTimerPtr              trim_timer;
+    /* the last owner id given to a window, the ids are never reused */
+    CARD32                  last_owner;
+} UMPPool;
 
 /* Data structure with the information about an UMP buffer */
 typedef struct
@@ -44,11 +90,15 @@ typedef struct
     int                     BackupDevKind;
     void                   *BackupDevPrivatePtr;
     int                     refcount;
-    UT_hash_handle          hh;
 
     ump_handle              handle;
     size_t                  size;
     uint8_t                *addr;
+    /* where to return the handle when the buffer is not needed anymore */
+    UMPPool                *pool;
+    size_t                  pool_size;
+    Bool                    pool_cached;
+    CARD32                  pool_owner;
     int                     depth;
     size_t                  width;
     size_t                  height;
@@ -65,6 +115,31 @@ typedef struct
     uint32_t                checksum_seed;
 } UMPBufferInfoRec, *UMPBufferInfoPtr;
 
+/*
+ * The swap statistics of a window, published in the _FBTURBO_DRI2_SWAP_STATS
+ * property of the window as an array of CARDINALs in this order, followed
+ * by the frame time histogram (see the .c file for the buckets).
+ */
+#define DRI2_FRAME_TIME_BUCKETS   8
+
+typedef struct
+{
+    CARD32                  frames;
+    /* how the frames got to the screen */
+    CARD32                  overlay_frames;
+    CARD32                  copied_frames;
+    /* the recoveries from the window resize race (see below) */
+    CARD32                  resize_recoveries;
+    /* the checksum based checks of the back/front buffers order */
+    CARD32                  order_checks_passed;
+    CARD32                  order_fixups;
+    /* the back/front swaps skipped because of the odd/even frame flags */
+    CARD32                  skipped_swaps;
+    /* the swaps delayed by the frame pacing */
+    CARD32                  paced_swaps;
+    CARD32                  frame_time_hist[DRI2_FRAME_TIME_BUCKETS];
+} DRI2SwapStatsRec;
+
 /*
  * DRI2 related bookkeeping for windows. Because Mali r3p0 blob has
  * quirks and needs workarounds, we can't fully rely on the Xorg DRI2
@@ -100,6 +175,8 @@ typedef struct
 
     /* allocated UMP buffer (shared between back and front DRI2 buffers) */
     UMPBufferInfoPtr        ump_mem_buffer_ptr;
+    /* the buffers of this window are only recycled for it (see UMPPool) */
+    CARD32                  ump_pool_owner;
 
     /* UMP buffers for hardware overlay and double buffering */
     UMPBufferInfoPtr        ump_back_buffer_ptr;
@@ -113,6 +190,35 @@ typedef struct
     int                     ump_queue_head;
     int                     ump_queue_tail;
 
+    /*
+     * The hardware overlay. The window may have its buffers in an area of
+     * the offscreen framebuffer. It is shown by a disp layer when it gets
+     * one, otherwise the buffers are copied to the window as usual.
+     */
+    uint32_t                overlay_area_offset;
+    uint32_t                overlay_area_size;  /* 0 if there is no area */
+    int                     overlay_slot;       /* -1 if there is no layer */
+    Bool                    overlay_shown;
+    Bool                    overlay_overlapped;
+    int                     overlay_x;
+    int                     overlay_y;
+    /* the last up to date UMP buffer, which is only shown by the layer */
+    UMPBufferInfoPtr        pOverlayDirtyUMP;
+
+    /*
+     * The copy from a cached UMP buffer to the window, which is postponed
+     * until the BlockHandler in order to do the cache maintenance for all
+     * the windows updated in this server iteration at once.
+     */
+    UMPBufferInfoPtr        pPendingCopyUMP;
+    RegionRec               pending_copy;   /* drawable relative */
+
+    DRI2SwapStatsRec        stats;
+    CARD32                  last_frame_time;    /* 0 if no frame yet */
+    CARD32                  stats_publish_time;
+    /* the vblank of the last scheduled swap, for the frame pacing */
+    CARD64                  last_swap_msc;
+
     /*
      * In the case DEBUG_WITH_RGB_PATTERN is defined, we add extra debugging
      * code for verifying that for each new frame, the background color is
@@ -126,15 +232,20 @@ typedef struct
 #endif
 } DRI2WindowStateRec, *DRI2WindowStatePtr;
 
-typedef struct {
-    int                     overlay_x;
-    int                     overlay_y;
+/* A swap or a WaitMSC request waiting for a vblank (see the .c file) */
+typedef struct DRI2VBlankEvent DRI2VBlankEventRec, *DRI2VBlankEventPtr;
 
-    WindowPtr               pOverlayWin;
-    UMPBufferInfoPtr        pOverlayDirtyUMP;
-    Bool                    bOverlayWinEnabled;
-    Bool                    bOverlayWinOverlapped;
-    Bool                    bWalkingAboveOverlayWin;
+typedef struct {
+    /*
+     * The disp layers for the DRI2 windows, reserved from the pool when
+     * needed and given up when XV needs one. Each of them is used by at
+     * most one window (the owner).
+     */
+    int                     overlay_layers[SUNXI_DISP_MAX_LAYERS];
+    DRI2WindowStatePtr      overlay_owners[SUNXI_DISP_MAX_LAYERS];
+    int                     num_overlay_layers;
+    /* the windows need to recalculate their 'overlay_overlapped' */
+    Bool                    bOverlayOcclusionDirty;
 
     Bool                    bHardwareCursorIsInUse;
     EnableHWCursorProcPtr   EnableHWCursor;
@@ -144,6 +255,7 @@ typedef struct {
     PostValidateTreeProcPtr PostValidateTree;
     GetImageProcPtr         GetImage;
     DestroyPixmapProcPtr    DestroyPixmap;
+    ScreenBlockHandlerProcPtr BlockHandler;
 
     /* the primary UMP secure id for accessing framebuffer */
     ump_secure_id           ump_fb_secure_id;
@@ -154,13 +266,26 @@ typedef struct {
     ump_handle              ump_null_handle1;
     ump_handle              ump_null_handle2;
 
-    UMPBufferInfoPtr        HashPixmapToUMP;
+    UMPPool                 ump_pool;
+
     DRI2WindowStatePtr      HashWindowState;
 
     int                     drm_fd;
 
+    /* some windows have their pPendingCopyUMP set */
+    Bool                    bCopiesPending;
+
     /* Wait for vsync when swapping DRI2 buffers */
     Bool                    bSwapbuffersWait;
+    /* Publish the swap statistics of the windows */
+    Bool                    bSwapStats;
+    /* The minimal number of vblanks between the swaps of a window */
+    int                     FramePacingInterval;
+
+    /* Asynchronously completed swaps and WaitMSC requests */
+    DRI2VBlankEventPtr      PendingVBlankEvents;
+    OsTimerPtr              VBlankTimer;
+    Bool                    bVBlankAcquired;
 } SunxiMaliDRI2;
 
 SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
@@ -168,4 +293,14 @@ SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
                                   Bool      bSwapbuffersWait);
 void SunxiMaliDRI2_Close(ScreenPtr pScreen);
 
+/* Publish the swap statistics of the DRI2 windows (see above) */
+void SunxiMaliDRI2_EnableSwapStats(ScreenPtr pScreen);
+
+/*
+ * Show the frames of every DRI2 window at least 'interval' vblanks apart,
+ * so that the video-like content is shown at an even pace. Returns FALSE
+ * if the vblanks can't be tracked.
+ */
+Bool SunxiMaliDRI2_SetFramePacing(ScreenPtr pScreen, int interval);
+
 #endif
@@ -27,6 +27,7 @@
 
 #include <string.h>
 
+#include "xorgVersion.h"
 #include "xf86.h"
 #include "xf86xv.h"
 #include "fourcc.h"
@@ -35,6 +36,9 @@
 #include "fbdev_priv.h"
 #include "sunxi_video.h"
 #include "sunxi_disp.h"
+#include "cpu_backend.h"
+#include "fb_copyarea.h"
+#include "backing_store_tuner.h"
 
 /*****************************************************************************/
 
@@ -45,7 +49,31 @@
 #define SIMD_ALIGN(s) (((s) + 15) & ~15)
 #define MAKE_ATOM(a) MakeAtom(a, sizeof(a) - 1, TRUE)
 
-static Atom xvColorKey;
+/* Older X servers don't have NV12 in fourcc.h */
+#ifndef FOURCC_NV12
+#define FOURCC_NV12 0x3231564e
+#define XVIMAGE_NV12 \
+   { \
+        FOURCC_NV12, \
+        XvYUV, \
+        LSBFirst, \
+        {'N','V','1','2', \
+          0x00,0x00,0x00,0x10,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71}, \
+        12, \
+        XvPlanar, \
+        2, \
+        0, 0, 0, 0, \
+        8, 8, 8, \
+        1, 2, 2, \
+        1, 2, 2, \
+        {'Y','U','V', \
+          0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}, \
+        XvTopToBottom \
+   }
+#endif
+
+static Atom xvColorKey, xvDroppedFrames, xvLateFrames;
+static Atom xvOffscreenOffset, xvOffscreenSize;
 
 /* Convert color key from 32bpp to the native format */
 static uint32_t convert_color(ScrnInfoPtr pScrn, uint32_t color)
@@ -59,16 +87,293 @@ static uint32_t convert_color(ScrnInfoPtr pScrn, uint32_t color)
 
 /*****************************************************************************/
 
+/*
+ * The ports get their disp layers and offscreen memory only while showing
+ * a video. Both are shared with the DRI2 overlays, which give a layer up
+ * for XV when there is no free one left.
+ */
+static Bool
+GetPortLayer(SunxiVideoPort *self, sunxi_disp_t *disp)
+{
+    if (self->layer < 0) {
+        self->layer = sunxi_layer_reserve_or_reclaim(disp);
+        self->colorKeyEnabled = FALSE;
+    }
+    return self->layer >= 0;
+}
+
+/*
+ * The area for the zero-copy mode, which takes 'num_buffers' screen sized
+ * YV12 frames (fewer if the memory is short). The copying mode ring is
+ * placed there too, so an already allocated area is just reused.
+ */
+static Bool
+GetPortArea(SunxiVideoPort *self, sunxi_disp_t *disp)
+{
+    uint32_t frame_size = ((uint32_t)disp->xres * disp->yres * 3 / 2 + 63) & ~63;
+    int n = self->video->num_buffers;
+
+    if (self->area_size)
+        return TRUE;
+
+    self->area_offset = sunxi_overlay_area_alloc(disp, frame_size, &n);
+    if (!self->area_offset)
+        return FALSE;
+    self->area_size = frame_size * n;
+    self->ring_yuv_size = 0;
+    self->ring_size = 0;
+    return TRUE;
+}
+
+static void
+FreeStaleArea(SunxiVideoPort *self, sunxi_disp_t *disp, uint64_t msc)
+{
+    if (self->stale_area_offset && msc >= self->stale_area_msc) {
+        sunxi_overlay_area_free(disp, self->stale_area_offset);
+        self->stale_area_offset = 0;
+    }
+}
+
+/*
+ * Give the layer and the memory back when the video is stopped. The hidden
+ * layer may be still scanning out the buffers until the second vblank,
+ * nobody else may write there before that.
+ */
+static void
+ReleasePortResources(SunxiVideoPort *self, sunxi_disp_t *disp)
+{
+    Bool shown = self->shown_buffer >= 0 || self->offscreen_shown;
+
+    if (self->layer >= 0) {
+        sunxi_layer_hide(disp, self->layer);
+        sunxi_layer_disable_colorkey(disp, self->layer);
+        sunxi_layer_release(disp, self->layer);
+        self->layer = -1;
+    }
+    self->colorKeyEnabled = FALSE;
+    self->shown_buffer = -1;
+    self->offscreen_shown = FALSE;
+
+    if (shown && self->vblank_acquired)
+        vblank_tracker_wait_msc(disp->vblank,
+                                vblank_tracker_get_msc(disp->vblank, NULL) + 2,
+                                NULL);
+
+    if (self->stale_area_offset)
+        sunxi_overlay_area_free(disp, self->stale_area_offset);
+    self->stale_area_offset = 0;
+    if (self->area_size)
+        sunxi_overlay_area_free(disp, self->area_offset);
+    self->area_size = 0;
+    self->ring_size = 0;
+    self->ring_yuv_size = 0;
+}
+
+/*****************************************************************************/
+
+/*
+ * Filling with the color key. The framebuffer is uncached, so the color key
+ * is only painted where it may be missing: in the newly exposed parts of
+ * the clip and in the areas damaged by the clients. Large rectangles are
+ * filled by G2D when the window is rendered directly to the framebuffer,
+ * the small ones are left to the software fill (pixman is NEON optimized).
+ */
+
+#define G2D_FILL_SIZE_THRESHOLD 1000
+
+/*
+ * The damage is collected in window relative coordinates, so it stays valid
+ * when the window is moved. The first damage at a new window position comes
+ * from CopyWindow, which moves the window contents together with the color
+ * key, and is not collected.
+ */
+static void
+ColorKeyDamageReport(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+    SunxiVideoPort *self = (SunxiVideoPort *)closure;
+    DrawablePtr pDraw = self->pDamageDraw;
+
+    if (!pDraw)
+        return;
+    if (pDraw->x != self->damage_x || pDraw->y != self->damage_y) {
+        self->damage_x = pDraw->x;
+        self->damage_y = pDraw->y;
+        return;
+    }
+    REGION_UNION(pDraw->pScreen, &self->damage, &self->damage, pRegion);
+}
+
+static void
+ColorKeyDamageDestroy(DamagePtr pDamage, void *closure)
+{
+    SunxiVideoPort *self = (SunxiVideoPort *)closure;
+    self->pDamage = NULL;
+    self->pDamageDraw = NULL;
+}
+
+static void
+UntrackColorKeyDrawable(SunxiVideoPort *self)
+{
+    if (self->pDamage) {
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 14, 99, 2, 0)
+        DamageUnregister(self->pDamage);
+#else
+        DamageUnregister(self->pDamageDraw, self->pDamage);
+#endif
+        DamageDestroy(self->pDamage);
+    }
+    self->pDamage = NULL;
+    self->pDamageDraw = NULL;
+}
+
+static void
+TrackColorKeyDrawable(ScreenPtr pScreen, SunxiVideoPort *self, DrawablePtr pDraw)
+{
+    if (self->pDamageDraw == pDraw)
+        return;
+
+    UntrackColorKeyDrawable(self);
+    REGION_EMPTY(pScreen, &self->clip);
+    REGION_EMPTY(pScreen, &self->damage);
+    self->damage_x = pDraw->x;
+    self->damage_y = pDraw->y;
+
+    self->pDamage = DamageCreate(ColorKeyDamageReport, ColorKeyDamageDestroy,
+                                 DamageReportRawRegion, TRUE, pScreen, self);
+    if (self->pDamage) {
+        self->pDamageDraw = pDraw;
+        DamageRegister(pDraw, self->pDamage);
+    }
+}
+
+/* Check whether the drawable is located in the framebuffer as is */
+static Bool
+CanFillWithG2D(ScreenPtr pScreen, sunxi_disp_t *disp, DrawablePtr pDraw)
+{
+    PixmapPtr pPixmap;
+
+    if (!disp || disp->fd_g2d < 0 || pDraw->type != DRAWABLE_WINDOW ||
+        pDraw->bitsPerPixel != 32 || disp->bits_per_pixel != 32)
+        return FALSE;
+
+    pPixmap = pScreen->GetWindowPixmap((WindowPtr)pDraw);
+    return pPixmap == pScreen->GetScreenPixmap(pScreen) &&
+           pPixmap->devPrivate.ptr == disp->framebuffer_addr &&
+           pPixmap->devKind == disp->xres * 4;
+}
+
+static void
+FillColorKey(ScrnInfoPtr pScrn, DrawablePtr pDraw, RegionPtr region)
+{
+    ScreenPtr pScreen = pScrn->pScreen;
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    SunxiVideo *video = SUNXI_VIDEO(pScrn);
+    uint32_t color = convert_color(pScrn, video->colorKey);
+    BoxPtr pbox = REGION_RECTS(region);
+    int nbox = REGION_NUM_RECTS(region);
+    RegionRec software, box;
+
+    if (!CanFillWithG2D(pScreen, disp, pDraw)) {
+        xf86XVFillKeyHelperDrawable(pDraw, color, region);
+        return;
+    }
+
+    REGION_NULL(pScreen, &software);
+    while (nbox--) {
+        int w = pbox->x2 - pbox->x1;
+        int h = pbox->y2 - pbox->y1;
+        if (w * h < G2D_FILL_SIZE_THRESHOLD ||
+            sunxi_g2d_fill_a8r8g8b8(disp, pbox->x1, pbox->y1, w, h, color) != 0)
+        {
+            REGION_INIT(pScreen, &box, pbox, 1);
+            REGION_UNION(pScreen, &software, &software, &box);
+            REGION_UNINIT(pScreen, &box);
+        }
+        pbox++;
+    }
+
+    /* G2D bypasses the rendering code, let the others know about it */
+    REGION_NULL(pScreen, &box);
+    REGION_SUBTRACT(pScreen, &box, region, &software);
+    if (REGION_NOTEMPTY(pScreen, &box))
+        DamageDamageRegion(pDraw, &box);
+    REGION_UNINIT(pScreen, &box);
+
+    if (REGION_NOTEMPTY(pScreen, &software))
+        xf86XVFillKeyHelperDrawable(pDraw, color, &software);
+    REGION_UNINIT(pScreen, &software);
+}
+
+static void
+UpdateColorKey(ScrnInfoPtr pScrn, SunxiVideoPort *self,
+               DrawablePtr pDraw, RegionPtr clipBoxes)
+{
+    ScreenPtr pScreen = pScrn->pScreen;
+    RegionRec fill, damaged;
+    Bool moved;
+
+    TrackColorKeyDrawable(pScreen, self, pDraw);
+
+    /* The contents of the moved window are copied to the new place */
+    moved = self->clip_x != pDraw->x || self->clip_y != pDraw->y;
+    if (moved)
+        REGION_TRANSLATE(pScreen, &self->clip, pDraw->x - self->clip_x,
+                         pDraw->y - self->clip_y);
+
+    REGION_NULL(pScreen, &fill);
+    REGION_SUBTRACT(pScreen, &fill, clipBoxes, &self->clip);
+
+    /* The damage in the clip is repainted, also the one from before a move */
+    if (self->pDamage) {
+        if (REGION_NOTEMPTY(pScreen, &self->damage)) {
+            REGION_NULL(pScreen, &damaged);
+            REGION_COPY(pScreen, &damaged, &self->damage);
+            REGION_TRANSLATE(pScreen, &damaged, pDraw->x, pDraw->y);
+            REGION_INTERSECT(pScreen, &damaged, &damaged, clipBoxes);
+            REGION_UNION(pScreen, &fill, &fill, &damaged);
+            REGION_UNINIT(pScreen, &damaged);
+        }
+    } else if (!self->pDamage && !REGION_EQUAL(pScreen, &self->clip, clipBoxes)) {
+        /* No way to know what got overwritten, repaint everything */
+        REGION_COPY(pScreen, &fill, clipBoxes);
+    }
+
+    REGION_COPY(pScreen, &self->clip, clipBoxes);
+    self->clip_x = pDraw->x;
+    self->clip_y = pDraw->y;
+
+    if (REGION_NOTEMPTY(pScreen, &fill))
+        FillColorKey(pScrn, pDraw, &fill);
+    REGION_UNINIT(pScreen, &fill);
+
+    /* Forget our own drawing and everything else seen so far */
+    REGION_EMPTY(pScreen, &self->damage);
+    self->damage_x = pDraw->x;
+    self->damage_y = pDraw->y;
+    if (self->pDamage)
+        DamageEmpty(self->pDamage);
+}
+
+/*****************************************************************************/
+
 static void
 xStopVideo(ScrnInfoPtr pScrn, pointer data, Bool cleanup)
 {
-    SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *self = (SunxiVideoPort *)data;
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
 
     if (disp && cleanup) {
-        sunxi_layer_hide(disp);
-        sunxi_layer_disable_colorkey(disp);
-        self->colorKeyEnabled = FALSE;
+        ReleasePortResources(self, disp);
+        if (self->vblank_acquired) {
+            vblank_tracker_release(disp->vblank);
+            self->vblank_acquired = FALSE;
+        }
+        if (self->dropped_frames || self->late_frames)
+            xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, 3,
+                           "XV port %d: %u frames dropped, %u frames late\n",
+                           (int)(self - self->video->ports),
+                           self->dropped_frames, self->late_frames);
+        UntrackColorKeyDrawable(self);
     }
 
     REGION_EMPTY(pScrn->pScreen, &self->clip);
@@ -81,13 +386,29 @@ xSetPortAttributeOverlay(ScrnInfoPtr pScrn,
                          pointer     data)
 {
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
-    SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *self = (SunxiVideoPort *)data;
 
     if (attribute == xvColorKey && disp) {
-        self->colorKey = value;
-        sunxi_layer_set_colorkey(disp, self->colorKey);
-        self->colorKeyEnabled = TRUE;
-        REGION_EMPTY(pScrn->pScreen, &self->clip);
+        SunxiVideo *video = self->video;
+        int i;
+        video->colorKey = value;
+        /* Otherwise it is set when the port gets a layer */
+        if (self->layer >= 0) {
+            sunxi_layer_set_colorkey(disp, self->layer, video->colorKey);
+            self->colorKeyEnabled = TRUE;
+        }
+        /* All the ports need to repaint their color key areas */
+        for (i = 0; i < video->num_ports; i++)
+            REGION_EMPTY(pScrn->pScreen, &video->ports[i].clip);
+        return Success;
+    }
+    /* The statistics counters can be reset */
+    if (attribute == xvDroppedFrames) {
+        self->dropped_frames = value;
+        return Success;
+    }
+    if (attribute == xvLateFrames) {
+        self->late_frames = value;
         return Success;
     }
 
@@ -101,10 +422,31 @@ xGetPortAttributeOverlay(ScrnInfoPtr pScrn,
                          INT32      *value,
                          pointer     data)
 {
-    SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    SunxiVideoPort *self = (SunxiVideoPort *)data;
 
     if (attribute == xvColorKey) {
-        *value = self->colorKey;
+        *value = self->video->colorKey;
+        return Success;
+    }
+    if (attribute == xvDroppedFrames) {
+        *value = self->dropped_frames;
+        return Success;
+    }
+    if (attribute == xvLateFrames) {
+        *value = self->late_frames;
+        return Success;
+    }
+    if (attribute == xvOffscreenOffset && disp) {
+        if (!GetPortArea(self, disp))
+            return BadAlloc;
+        *value = self->area_offset;
+        return Success;
+    }
+    if (attribute == xvOffscreenSize && disp) {
+        if (!GetPortArea(self, disp))
+            return BadAlloc;
+        *value = self->area_size;
         return Success;
     }
 
@@ -120,6 +462,413 @@ xQueryBestSize(ScrnInfoPtr pScrn, Bool motion, short vid_w, short vid_h,
     *p_h = drw_h;
 }
 
+/*
+ * The overlay buffers are organized as a ring in the offscreen part of
+ * framebuffer. A new frame is only ever written to a buffer, which is
+ * neither shown nor possibly still being scanned out by the display
+ * controller. The new buffer address set for the layer gets latched on
+ * the next vblank, but we may be racing with this vblank, so the old
+ * buffer is only considered free after two vblanks. If there is no free
+ * buffer, then the frame is dropped instead of tearing.
+ */
+
+/*
+ * The part of the area, which the layer may be still scanning out, and
+ * the vblank when it gets free: the shown buffer and the recently replaced
+ * ones, or the whole area after a zero-copy frame.
+ */
+static void
+GetBusyRange(SunxiVideoPort *self, uint64_t msc,
+             uint32_t *start, uint32_t *end, uint64_t *retire_msc)
+{
+    int i;
+
+    *start = *end = 0;
+    *retire_msc = 0;
+    if (!self->vblank_acquired)
+        return;
+
+    if (self->offscreen_shown) {
+        *start = self->area_offset;
+        *end = self->area_offset + self->area_size;
+        *retire_msc = msc + 2;
+        return;
+    }
+
+    for (i = 0; i < self->ring_size; i++) {
+        uint32_t offset = self->buffers[i].offset;
+        uint64_t retire = i == self->shown_buffer ? msc + 2 :
+                                                    self->buffers[i].retire_msc;
+        if (retire <= msc)
+            continue;
+        if (*end == 0 || offset < *start)
+            *start = offset;
+        if (offset + self->ring_yuv_size > *end)
+            *end = offset + self->ring_yuv_size;
+        if (retire > *retire_msc)
+            *retire_msc = retire;
+    }
+}
+
+/*
+ * (Re)build the ring for the frames of 'yuv_size' bytes. A bigger area is
+ * allocated if the current one is too small. The old area, or the buffers
+ * of the new ring overlapping what the layer still shows, are only reused
+ * after the display controller is done with them.
+ */
+static Bool
+SetupBufferRing(SunxiVideoPort *self, sunxi_disp_t *disp, int yuv_size,
+                uint64_t msc)
+{
+    int num_buffers = self->video->num_buffers;
+    uint32_t busy_start, busy_end, offset;
+    uint64_t busy_msc;
+    int i, n;
+
+    if (yuv_size == self->ring_yuv_size)
+        return self->ring_size > 0;
+
+    GetBusyRange(self, msc, &busy_start, &busy_end, &busy_msc);
+
+    if (self->area_size / yuv_size < num_buffers && !self->stale_area_offset) {
+        n = num_buffers;
+        offset = sunxi_overlay_area_alloc(disp, yuv_size, &n);
+        if (offset && n > self->area_size / yuv_size) {
+            if (busy_end) {
+                self->stale_area_offset = self->area_offset;
+                self->stale_area_msc = busy_msc;
+            } else if (self->area_size) {
+                sunxi_overlay_area_free(disp, self->area_offset);
+            }
+            self->area_offset = offset;
+            self->area_size = n * yuv_size;
+            busy_start = busy_end = 0;
+        } else if (offset) {
+            sunxi_overlay_area_free(disp, offset);
+        }
+    }
+
+    /* The memory around the old area may be free too */
+    if (self->area_size && self->area_size < yuv_size) {
+        sunxi_overlay_area_free(disp, self->area_offset);
+        n = num_buffers;
+        self->area_offset = sunxi_overlay_area_alloc(disp, yuv_size, &n);
+        self->area_size = self->area_offset ? n * yuv_size : 0;
+    }
+
+    n = self->area_size / yuv_size;
+    if (n > num_buffers)
+        n = num_buffers;
+
+    self->ring_yuv_size = yuv_size;
+    self->ring_size = n;
+    self->next_buffer = 0;
+    self->shown_buffer = -1;
+    self->offscreen_shown = FALSE;
+    for (i = 0; i < n; i++) {
+        offset = self->area_offset + i * yuv_size;
+        self->buffers[i].offset = offset;
+        self->buffers[i].retire_msc = offset < busy_end &&
+                                      busy_start < offset + yuv_size ?
+                                      busy_msc : 0;
+    }
+
+    return n > 0;
+}
+
+/* Returns the index of a free buffer or -1 */
+static int
+GetFreeBuffer(SunxiVideoPort *self, uint64_t msc)
+{
+    int i, n;
+
+    /* With a single buffer it is not possible to avoid tearing */
+    if (self->ring_size == 1)
+        return 0;
+
+    for (n = 0; n < self->ring_size; n++) {
+        i = (self->next_buffer + n) % self->ring_size;
+        if (i != self->shown_buffer && self->buffers[i].retire_msc <= msc)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Only the visible crop of each plane is copied to the overlay buffer.
+ * The buffer keeps the same layout as the client image, so the layer
+ * still gets the uncropped strides and the src_x/src_y offsets.
+ */
+
+static void
+memcpy_to_wc_default(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+static void
+CopyPlane(SunxiVideo *self, SunxiVideoPlaneCopy *plane)
+{
+    int i;
+    for (i = 0; i < plane->height; i++)
+        self->memcpy_to_wc(plane->dst + i * plane->stride,
+                           plane->src + i * plane->stride, plane->width);
+}
+
+static void
+SetupPlaneCopy(SunxiVideoPlaneCopy *plane, uint8_t *dst, const uint8_t *src,
+               int stride, int x1, int y1, int x2, int y2)
+{
+    plane->dst = dst + y1 * stride + x1;
+    plane->src = src + y1 * stride + x1;
+    plane->stride = stride;
+    plane->width = x2 - x1;
+    plane->height = y2 - y1;
+}
+
+static void *UploadWorker(void *arg)
+{
+    SunxiVideo *self = (SunxiVideo *)arg;
+    SunxiVideoPlaneCopy planes[2];
+
+    pthread_mutex_lock(&self->upload_lock);
+    while (1) {
+        while (self->upload_completed == self->upload_submitted &&
+               !self->upload_quit) {
+            pthread_cond_wait(&self->upload_queued_cond, &self->upload_lock);
+        }
+        if (self->upload_completed == self->upload_submitted)
+            break;
+        memcpy(planes, self->upload_planes, sizeof(planes));
+        pthread_mutex_unlock(&self->upload_lock);
+
+        CopyPlane(self, &planes[0]);
+        CopyPlane(self, &planes[1]);
+
+        pthread_mutex_lock(&self->upload_lock);
+        self->upload_completed++;
+        pthread_cond_signal(&self->upload_completed_cond);
+    }
+    pthread_mutex_unlock(&self->upload_lock);
+
+    return NULL;
+}
+
+/*
+ * The layout of the supported images in the client buffer. The planes
+ * are listed in the memory order (YV12 has V before U).
+ */
+typedef struct {
+    int                 num_planes;
+    int                 offsets[3];
+    int                 pitches[3];
+    int                 cpp[3];           /* bytes per (subsampled) pixel */
+    int                 subsampling[3];   /* log2 of the chroma subsampling */
+    int                 size;
+} SunxiVideoImageLayout;
+
+static Bool
+GetImageLayout(int image, int width, int height, SunxiVideoImageLayout *l)
+{
+    int y_stride, uv_stride;
+
+    memset(l, 0, sizeof(*l));
+    uv_stride = SIMD_ALIGN(width >> 1);
+    y_stride  = uv_stride * 2;
+
+    switch (image) {
+    case FOURCC_I420:
+    case FOURCC_YV12:
+        l->num_planes = 3;
+        l->pitches[0] = y_stride;
+        l->pitches[1] = l->pitches[2] = uv_stride;
+        l->offsets[1] = y_stride * height;
+        l->offsets[2] = (uv_stride * (height >> 1)) + l->offsets[1];
+        l->cpp[0] = l->cpp[1] = l->cpp[2] = 1;
+        l->subsampling[1] = l->subsampling[2] = 1;
+        l->size = y_stride * height + uv_stride * height;
+        return TRUE;
+    case FOURCC_NV12:
+        /* The U and V samples are interleaved in the second plane */
+        l->num_planes = 2;
+        l->pitches[0] = l->pitches[1] = y_stride;
+        l->offsets[1] = y_stride * height;
+        l->cpp[0] = 1;
+        l->cpp[1] = 2;
+        l->subsampling[1] = 1;
+        l->size = y_stride * height + y_stride * (height >> 1);
+        return TRUE;
+    case FOURCC_YUY2:
+    case FOURCC_UYVY:
+        l->num_planes = 1;
+        l->pitches[0] = SIMD_ALIGN(width * 2);
+        l->cpp[0] = 2;
+        l->size = l->pitches[0] * height;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+UploadFrame(SunxiVideo *self, uint8_t *dst, const uint8_t *src,
+            SunxiVideoImageLayout *l, int width, int height,
+            int src_x, int src_y, int src_w, int src_h)
+{
+    SunxiVideoPlaneCopy planes[4];
+    int x1 = src_x, y1 = src_y, x2 = src_x + src_w, y2 = src_y + src_h;
+    int i, n;
+
+    if (x1 < 0)
+        x1 = 0;
+    if (y1 < 0)
+        y1 = 0;
+    if (x2 > width)
+        x2 = width;
+    if (y2 > height)
+        y2 = height;
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    /* The chroma is subsampled, the crop is extended to even */
+    x1 &= ~1;
+    y1 &= ~1;
+    x2 = (x2 + 1) & ~1;
+    y2 = (y2 + 1) & ~1;
+
+    for (i = 0; i < l->num_planes; i++) {
+        int shift = l->subsampling[i];
+        SetupPlaneCopy(&planes[i], dst + l->offsets[i], src + l->offsets[i],
+                       l->pitches[i], (x1 >> shift) * l->cpp[i], y1 >> shift,
+                       (x2 >> shift) * l->cpp[i], y2 >> shift);
+    }
+    n = l->num_planes;
+
+    if (!self->upload_thread_enabled) {
+        for (i = 0; i < n; i++)
+            CopyPlane(self, &planes[i]);
+        return;
+    }
+
+    /*
+     * The helper thread copies the chroma planes (which take about half
+     * of the time needed for the luma plane). A packed image is split
+     * into the top and the bottom halves instead.
+     */
+    if (n == 1) {
+        planes[1] = planes[0];
+        planes[0].height >>= 1;
+        planes[1].height -= planes[0].height;
+        planes[1].dst += planes[0].height * planes[0].stride;
+        planes[1].src += planes[0].height * planes[0].stride;
+        n = 2;
+    }
+    planes[n] = planes[n - 1];
+    planes[n].height = 0;
+
+    pthread_mutex_lock(&self->upload_lock);
+    memcpy(self->upload_planes, &planes[1], sizeof(self->upload_planes));
+    self->upload_submitted++;
+    pthread_cond_signal(&self->upload_queued_cond);
+    pthread_mutex_unlock(&self->upload_lock);
+
+    CopyPlane(self, &planes[0]);
+
+    pthread_mutex_lock(&self->upload_lock);
+    while (self->upload_completed != self->upload_submitted)
+        pthread_cond_wait(&self->upload_completed_cond, &self->upload_lock);
+    pthread_mutex_unlock(&self->upload_lock);
+}
+
+/* Set the overlay buffer at 'offset' as the layer input */
+static void
+SetLayerInput(sunxi_disp_t *disp, int layer, int image, uint32_t offset,
+              SunxiVideoImageLayout *l,
+              short src_x, short src_y, short src_w, short src_h)
+{
+    switch (image) {
+    case FOURCC_I420:
+        sunxi_layer_set_yuv420_input_buffer(disp, layer, offset,
+                                            offset + l->offsets[1],
+                                            offset + l->offsets[2],
+                                            src_w, src_h, l->pitches[0],
+                                            src_x, src_y);
+        break;
+    case FOURCC_YV12:
+        sunxi_layer_set_yuv420_input_buffer(disp, layer, offset,
+                                            offset + l->offsets[2],
+                                            offset + l->offsets[1],
+                                            src_w, src_h, l->pitches[0],
+                                            src_x, src_y);
+        break;
+    case FOURCC_NV12:
+        sunxi_layer_set_nv12_input_buffer(disp, layer, offset,
+                                          offset + l->offsets[1],
+                                          src_w, src_h, l->pitches[0],
+                                          src_x, src_y);
+        break;
+    case FOURCC_YUY2:
+    case FOURCC_UYVY:
+        sunxi_layer_set_yuv422_input_buffer(disp, layer, offset,
+                                            image == FOURCC_UYVY,
+                                            src_w, src_h, l->pitches[0] / 2,
+                                            src_x, src_y);
+        break;
+    }
+}
+
+/*
+ * Show a frame, which the client has written directly to the offscreen
+ * part of framebuffer (the zero-copy mode). Returns FALSE if the frame
+ * descriptor is invalid.
+ */
+static Bool
+ShowOffscreenFrame(SunxiVideoPort *self, sunxi_disp_t *disp, unsigned char *buf,
+                   short src_x, short src_y, short src_w, short src_h,
+                   short width, short height)
+{
+    SunxiVideoOffscreenFrame frame;
+    uint32_t area_offset = self->area_offset, size = self->area_size;
+    uint32_t y_size, uv_size;
+    uint64_t msc = 0;
+
+    memcpy(&frame, buf, sizeof(frame));
+
+    if (frame.fourcc != FOURCC_I420 && frame.fourcc != FOURCC_YV12)
+        return FALSE;
+    if (frame.y_stride < width || (frame.y_stride & 1))
+        return FALSE;
+
+    y_size = frame.y_stride * height;
+    uv_size = (frame.y_stride >> 1) * ((height + 1) >> 1);
+    if (frame.y_offset > size || size - frame.y_offset < y_size ||
+        frame.u_offset > size || size - frame.u_offset < uv_size ||
+        frame.v_offset > size || size - frame.v_offset < uv_size)
+        return FALSE;
+
+    /* The copying mode ring may be overwritten by the client */
+    self->ring_yuv_size = 0;
+    self->shown_buffer = -1;
+    self->offscreen_shown = TRUE;
+
+    if (!self->vblank_acquired && disp->vblank)
+        self->vblank_acquired = vblank_tracker_acquire(disp->vblank);
+    if (self->vblank_acquired) {
+        msc = vblank_tracker_get_msc(disp->vblank, NULL);
+        if (self->shown_msc == msc)
+            self->late_frames++;
+    }
+    self->shown_msc = msc;
+
+    sunxi_layer_set_yuv420_input_buffer(disp, self->layer,
+                                        area_offset + frame.y_offset,
+                                        area_offset + frame.u_offset,
+                                        area_offset + frame.v_offset,
+                                        src_w, src_h, frame.y_stride,
+                                        src_x, src_y);
+    return TRUE;
+}
+
 static int
 xPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_y,
           short src_w, short src_h, short drw_w, short drw_h, int image,
@@ -127,12 +876,15 @@ xPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_y,
           RegionPtr clipBoxes, pointer data, DrawablePtr pDraw)
 {
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
-    SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *self = (SunxiVideoPort *)data;
+    SunxiVideo *video = self->video;
     INT32 x1, x2, y1, y2;
-    int y_offset, u_offset, v_offset;
-    int y_stride, uv_stride, yuv_size;
+    SunxiVideoImageLayout layout;
     BoxRec dstBox;
 
+    /* The video window gets redrawn every frame, backing store is useless */
+    BackingStoreTuner_HintFrequentUpdates(pDraw);
+
     /* Clip */
     x1 = src_x;
     x2 = src_x + src_w;
@@ -152,58 +904,81 @@ xPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_y,
     dstBox.y1 -= pScrn->frameY0;
     dstBox.y2 -= pScrn->frameY0;
 
-    uv_stride = SIMD_ALIGN(width >> 1);
-    y_stride  = uv_stride * 2;
-    yuv_size  = y_stride * height + uv_stride * height;
+    if (disp && !GetPortLayer(self, disp))
+        return BadAlloc;
 
-    y_offset = 0;
-    if (image == FOURCC_I420) {
-        u_offset = y_stride * height;
-        v_offset = (uv_stride * (height >> 1)) + u_offset;
-    }
-    else if (image == FOURCC_YV12) {
-        v_offset = y_stride * height;
-        u_offset = (uv_stride * (height >> 1)) + v_offset;
+    if (image == FOURCC_FBTO) {
+        if (!disp || !ShowOffscreenFrame(self, disp, buf, src_x, src_y,
+                                         src_w, src_h, width, height))
+            return BadValue;
+        if (!self->colorKeyEnabled) {
+            sunxi_layer_set_colorkey(disp, self->layer, video->colorKey);
+            self->colorKeyEnabled = TRUE;
+        }
+        sunxi_layer_set_output_window(disp, self->layer,
+                                      drw_x, drw_y, drw_w, drw_h);
+        sunxi_layer_show(disp, self->layer);
+        goto update_colorkey;
     }
-    else {
+
+    if (!GetImageLayout(image, width, height, &layout))
         return BadImplementation;
-    }
 
     if (disp) {
-        /* Try to fixup overlay offset */
-        if (self->overlay_data_offs < disp->gfx_layer_size ||
-            self->overlay_data_offs + yuv_size > disp->framebuffer_size) {
-            self->overlay_data_offs = disp->gfx_layer_size;
-        }
-        /* If it is still wrong (not enough offscreen memory), then fail */
-        if (self->overlay_data_offs + yuv_size > disp->framebuffer_size)
+        uint64_t msc = 0;
+        int i;
+
+        if (!self->vblank_acquired && disp->vblank)
+            self->vblank_acquired = vblank_tracker_acquire(disp->vblank);
+        if (self->vblank_acquired)
+            msc = vblank_tracker_get_msc(disp->vblank, NULL);
+
+        FreeStaleArea(self, disp, msc);
+
+        /* Fail if there is not enough offscreen memory */
+        if (!SetupBufferRing(self, disp, layout.size, msc))
             return BadImplementation;
 
-        y_offset += self->overlay_data_offs;
-        u_offset += self->overlay_data_offs;
-        v_offset += self->overlay_data_offs;
+        i = GetFreeBuffer(self, msc);
+        if (i < 0) {
+            DebugMsg("XV: no free overlay buffer, dropping the frame\n");
+            self->dropped_frames++;
+            goto update_colorkey;
+        }
 
-        memcpy(disp->framebuffer_addr + self->overlay_data_offs, buf, yuv_size);
+        /* The queued fbdev copyarea requests may use the offscreen memory */
+        fb_copyarea_sync(FBDEVPTR(pScrn)->fb_copyarea_private);
+        UploadFrame(video, disp->framebuffer_addr + self->buffers[i].offset,
+                    buf, &layout, width & ~1, height & ~1,
+                    src_x, src_y, src_w, src_h);
 
         /* Enable colorkey if it has not been already enabled */
         if (!self->colorKeyEnabled) {
-            sunxi_layer_set_colorkey(disp, self->colorKey);
+            sunxi_layer_set_colorkey(disp, self->layer, video->colorKey);
             self->colorKeyEnabled = TRUE;
         }
-        sunxi_layer_set_yuv420_input_buffer(disp, y_offset, u_offset, v_offset,
-                                            src_w, src_h, y_stride, src_x, src_y);
-        sunxi_layer_set_output_window(disp, drw_x, drw_y, drw_w, drw_h);
-        sunxi_layer_show(disp);
+        SetLayerInput(disp, self->layer, image, self->buffers[i].offset,
+                      &layout, src_x, src_y, src_w, src_h);
+        sunxi_layer_set_output_window(disp, self->layer,
+                                      drw_x, drw_y, drw_w, drw_h);
+        sunxi_layer_show(disp, self->layer);
 
-        /* Cycle through different overlay offsets (to prevent tearing) */
-        self->overlay_data_offs += yuv_size;
+        /* The previous buffer is scanned out until the next vblank */
+        if (self->shown_buffer >= 0 && self->shown_buffer != i) {
+            /* The previous frame has not reached the screen at all */
+            if (self->vblank_acquired && self->shown_msc == msc)
+                self->late_frames++;
+            self->buffers[self->shown_buffer].retire_msc =
+                                        self->vblank_acquired ? msc + 2 : 0;
+        }
+        self->shown_buffer = i;
+        self->shown_msc = msc;
+        self->next_buffer = (i + 1) % self->ring_size;
     }
 
+update_colorkey:
     /* Update the areas filled with the color key */
-    if (!REGION_EQUAL(pScrn->pScreen, &self->clip, clipBoxes)) {
-        REGION_COPY(pScrn->pScreen, &self->clip, clipBoxes);
-        xf86XVFillKeyHelperDrawable(pDraw, convert_color(pScrn, self->colorKey), clipBoxes);
-    }
+    UpdateColorKey(pScrn, self, pDraw, clipBoxes);
 
     return Success;
 }
@@ -214,7 +989,10 @@ xReputImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_
           RegionPtr clipBoxes, pointer data, DrawablePtr pDraw)
 {
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
-    sunxi_layer_set_output_window(disp, drw_x, drw_y, drw_w, drw_h);
+    SunxiVideoPort *self = (SunxiVideoPort *)data;
+    if (self->layer >= 0)
+        sunxi_layer_set_output_window(disp, self->layer,
+                                      drw_x, drw_y, drw_w, drw_h);
     return Success;
 }
 
@@ -223,29 +1001,32 @@ xQueryImageAttributes(ScrnInfoPtr pScrn, int image,
                       unsigned short *w, unsigned short *h,
                       int *pitches, int *offsets)
 {
-    int height, width;
-    int y_stride, uv_stride, yuv_size;
+    SunxiVideoImageLayout layout;
+    int height, width, i;
 
     width = *w = (*w + 1) & ~1;
     height = *h = (*h + 1) & ~1;
 
-    uv_stride = SIMD_ALIGN(width >> 1);
-    y_stride  = uv_stride * 2;
-    yuv_size  = y_stride * height + uv_stride * height;
-
-    if (pitches) {
-        pitches[0] = y_stride;
-        pitches[1] = uv_stride;
-        pitches[2] = uv_stride;
+    /* Only the frame descriptor is passed in the zero-copy mode */
+    if (image == FOURCC_FBTO) {
+        if (pitches)
+            pitches[0] = sizeof(SunxiVideoOffscreenFrame);
+        if (offsets)
+            offsets[0] = 0;
+        return sizeof(SunxiVideoOffscreenFrame);
     }
 
-    if (offsets) {
-        offsets[0] = 0;
-        offsets[1] = y_stride * height;
-        offsets[2] = (uv_stride * (height >> 1)) + offsets[1];
+    if (!GetImageLayout(image, width, height, &layout))
+        return 0;
+
+    for (i = 0; i < layout.num_planes; i++) {
+        if (pitches)
+            pitches[i] = layout.pitches[i];
+        if (offsets)
+            offsets[i] = layout.offsets[i];
     }
 
-    return yuv_size;
+    return layout.size;
 }
 
 /*****************************************************************************/
@@ -259,15 +1040,43 @@ static XF86VideoFormatRec Formats[] = {
     {16, TrueColor}, {24, TrueColor}
 };
 
+/* Only the frame descriptor is passed, as one plane (see above) */
+#define XVIMAGE_FBTO \
+   { \
+        FOURCC_FBTO, \
+        XvYUV, \
+        LSBFirst, \
+        {'F','B','T','O', \
+          0x00,0x00,0x00,0x10,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71}, \
+        12, \
+        XvPlanar, \
+        1, \
+        0, 0, 0, 0, \
+        8, 8, 8, \
+        1, 2, 2, \
+        1, 2, 2, \
+        {'Y','U','V', \
+          0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}, \
+        XvTopToBottom \
+   }
+
 static XF86ImageRec Images[] =
 {
     XVIMAGE_YV12,
-    XVIMAGE_I420
+    XVIMAGE_I420,
+    XVIMAGE_NV12,
+    XVIMAGE_YUY2,
+    XVIMAGE_UYVY,
+    XVIMAGE_FBTO
 };
 
 static XF86AttributeRec Attributes[] =
 {
    {XvSettable | XvGettable, 0, (1 << 24) - 1, "XV_COLORKEY"},
+   {XvSettable | XvGettable, 0, 0x7FFFFFFF, "XV_DROPPED_FRAMES"},
+   {XvSettable | XvGettable, 0, 0x7FFFFFFF, "XV_LATE_FRAMES"},
+   {XvGettable, 0, 0x7FFFFFFF, "XV_OFFSCREEN_OFFSET"},
+   {XvGettable, 0, 0x7FFFFFFF, "XV_OFFSCREEN_SIZE"},
 };
 
 SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
@@ -276,8 +1085,9 @@ SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
     SunxiVideo *self;
     XF86VideoAdaptorPtr adapt;
+    int i, num_ports;
 
-    if (!disp || !disp->layer_has_scaler) {
+    if (!disp || (num_ports = sunxi_layer_count_scalers(disp)) == 0) {
         xf86DrvMsg(pScreen->myNum, X_INFO,
                    "SunxiVideo_Init: no scalable layer available for XV\n");
         return NULL;
@@ -293,6 +1103,19 @@ SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
         return NULL;
     }
 
+    /* One port per layer, which can get a scaler */
+    self->num_ports = num_ports < XV_MAX_PORTS ? num_ports : XV_MAX_PORTS;
+
+    for (i = 0; i < self->num_ports; i++) {
+        SunxiVideoPort *port = &self->ports[i];
+        port->video = self;
+        port->layer = -1;
+        port->shown_buffer = -1;
+        REGION_NULL(pScreen, &port->clip);
+        REGION_NULL(pScreen, &port->damage);
+        self->port_privates[i] = port;
+    }
+
     adapt = self->adapt[0];
 
     adapt->type = XvWindowMask | XvInputMask | XvImageMask;
@@ -302,7 +1125,7 @@ SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
     adapt->pEncodings = &DummyEncoding[0];
     adapt->nFormats = ARRAY_SIZE(Formats);
     adapt->pFormats = Formats;
-    adapt->nPorts = 1;
+    adapt->nPorts = self->num_ports;
     adapt->pPortPrivates = (DevUnion *) &self->port_privates[0];
     adapt->pAttributes = Attributes;
     adapt->nImages = ARRAY_SIZE(Images);
@@ -324,12 +1147,82 @@ SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
     xf86XVScreenInit(pScreen, &self->adapt[0], 1);
 
     xvColorKey = MAKE_ATOM("XV_COLORKEY");
+    xvDroppedFrames = MAKE_ATOM("XV_DROPPED_FRAMES");
+    xvLateFrames = MAKE_ATOM("XV_LATE_FRAMES");
+    xvOffscreenOffset = MAKE_ATOM("XV_OFFSCREEN_OFFSET");
+    xvOffscreenSize = MAKE_ATOM("XV_OFFSCREEN_SIZE");
+    self->memcpy_to_wc = memcpy_to_wc_default;
+    if (FBDEVPTR(pScrn)->cpu_backend_private) {
+        cpu_backend_t *cpu_backend = FBDEVPTR(pScrn)->cpu_backend_private;
+        self->memcpy_to_wc = cpu_backend->memcpy_to_wc;
+    }
     self->colorKey = 0x081018;
-    REGION_NULL(pScreen, &self->clip);
+    self->num_buffers = 3;
 
     return self;
 }
 
 void SunxiVideo_Close(ScreenPtr pScreen)
 {
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    int i;
+
+    for (i = 0; i < self->num_ports; i++) {
+        SunxiVideoPort *port = &self->ports[i];
+        if (disp)
+            ReleasePortResources(port, disp);
+        if (port->vblank_acquired && disp) {
+            vblank_tracker_release(disp->vblank);
+            port->vblank_acquired = FALSE;
+        }
+        UntrackColorKeyDrawable(port);
+        REGION_UNINIT(pScreen, &port->clip);
+        REGION_UNINIT(pScreen, &port->damage);
+    }
+
+    if (self->upload_thread_enabled) {
+        pthread_mutex_lock(&self->upload_lock);
+        self->upload_quit = TRUE;
+        pthread_cond_signal(&self->upload_queued_cond);
+        pthread_mutex_unlock(&self->upload_lock);
+        pthread_join(self->upload_thread, NULL);
+
+        pthread_cond_destroy(&self->upload_completed_cond);
+        pthread_cond_destroy(&self->upload_queued_cond);
+        pthread_mutex_destroy(&self->upload_lock);
+        self->upload_thread_enabled = FALSE;
+    }
+}
+
+Bool SunxiVideo_EnableUploadThread(SunxiVideo *self)
+{
+    if (self->upload_thread_enabled)
+        return TRUE;
+
+    if (pthread_mutex_init(&self->upload_lock, NULL) != 0)
+        return FALSE;
+    if (pthread_cond_init(&self->upload_queued_cond, NULL) != 0) {
+        pthread_mutex_destroy(&self->upload_lock);
+        return FALSE;
+    }
+    if (pthread_cond_init(&self->upload_completed_cond, NULL) != 0) {
+        pthread_cond_destroy(&self->upload_queued_cond);
+        pthread_mutex_destroy(&self->upload_lock);
+        return FALSE;
+    }
+
+    self->upload_quit = FALSE;
+    self->upload_submitted = 0;
+    self->upload_completed = 0;
+    if (pthread_create(&self->upload_thread, NULL, UploadWorker, self) != 0) {
+        pthread_cond_destroy(&self->upload_completed_cond);
+        pthread_cond_destroy(&self->upload_queued_cond);
+        pthread_mutex_destroy(&self->upload_lock);
+        return FALSE;
+    }
+
+    self->upload_thread_enabled = TRUE;
+    return TRUE;
 }
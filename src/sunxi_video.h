@@ -24,21 +24,145 @@
 #ifndef SUNXI_VIDEO_H
 #define SUNXI_VIDEO_H
 
+#include <pthread.h>
+
 #include "xf86xv.h"
+#include "damage.h"
+
+#include "sunxi_disp.h"
 
 #define XV_IMAGE_MAX_WIDTH  2048
 #define XV_IMAGE_MAX_HEIGHT 2048
 
+/*
+ * Zero-copy mode. The clients, which can map the framebuffer (/dev/fb0),
+ * may write the video frames directly to the offscreen area reported by
+ * the XV_OFFSCREEN_OFFSET and XV_OFFSCREEN_SIZE port attributes. Then they
+ * call XvPutImage with the FOURCC_FBTO image format, passing a small
+ * SunxiVideoOffscreenFrame descriptor instead of the pixel data. The
+ * display controller scans out the client buffer directly. A buffer may
+ * be still scanned out until two vblanks after it gets replaced by the
+ * next frame, so the clients should use at least 3 buffers round-robin.
+ * The area is allocated when the attributes are read and stays valid
+ * until the video is stopped.
+ */
+#define FOURCC_FBTO         0x4f544246   /* 'F' 'B' 'T' 'O' */
+
+typedef struct {
+    uint32_t            fourcc;           /* FOURCC_I420 or FOURCC_YV12 */
+    uint32_t            y_offset;         /* relative to XV_OFFSCREEN_OFFSET */
+    uint32_t            u_offset;
+    uint32_t            v_offset;
+    uint32_t            y_stride;         /* the U/V stride is half of it */
+} SunxiVideoOffscreenFrame;
+
+/* The maximal number of overlay buffers in the offscreen memory */
+#define XV_MAX_BUFFERS      8
+
+/*
+ * An overlay buffer in the offscreen part of framebuffer. The buffer
+ * may be reused when the vblank counter reaches 'retire_msc' (the display
+ * controller has stopped scanning it out by then).
+ */
+typedef struct {
+    uint32_t            offset;
+    uint64_t            retire_msc;
+} SunxiVideoBuffer;
+
+/* A rectangular part of an image plane to be copied to the framebuffer */
 typedef struct {
+    uint8_t            *dst;
+    const uint8_t      *src;
+    int                 stride;
+    int                 width;            /* in bytes */
+    int                 height;
+} SunxiVideoPlaneCopy;
+
+/*
+ * One XV port per disp layer, which can get a scaler. The ports reserve
+ * their layers only while showing a video, the DRI2 overlays use the
+ * layers otherwise.
+ */
+#define XV_MAX_PORTS        SUNXI_DISP_MAX_LAYERS
+
+struct SunxiVideo;
+
+typedef struct {
+    struct SunxiVideo  *video;
+    int                 layer;            /* index in the pool, -1 if none */
+    Bool                colorKeyEnabled;
+
+    /*
+     * The area filled with the color key. The clip is remembered together
+     * with the drawable origin, so that a moved window does not need to be
+     * refilled (the window contents are moved by CopyWindow). Drawing done
+     * by the clients is tracked with Damage and collected in 'damage'
+     * (window relative, the origin of the last report is kept).
+     */
     RegionRec           clip;
+    int                 clip_x, clip_y;
+    DrawablePtr         pDamageDraw;
+    DamagePtr           pDamage;
+    RegionRec           damage;
+    int                 damage_x, damage_y;
+
+    /* The offscreen memory of the port, allocated when needed */
+    uint32_t            area_offset;
+    uint32_t            area_size;        /* 0 if there is no area */
+    /* The previous area, freed when it is not scanned out anymore */
+    uint32_t            stale_area_offset;/* 0 if there is none */
+    uint64_t            stale_area_msc;
+
+    /* The ring of overlay buffers in the area */
+    int                 ring_size;        /* actually allocated buffers */
+    int                 ring_yuv_size;    /* the size of each buffer */
+    SunxiVideoBuffer    buffers[XV_MAX_BUFFERS];
+    int                 shown_buffer;     /* set on the layer, -1 if none */
+    Bool                offscreen_shown;  /* a zero-copy frame is set */
+    uint64_t            shown_msc;        /* when it was set on the layer */
+    int                 next_buffer;
+    Bool                vblank_acquired;
+
+    /* Statistics */
+    uint32_t            dropped_frames;   /* no free buffer */
+    uint32_t            late_frames;      /* replaced before scanned out */
+} SunxiVideoPort;
+
+typedef struct SunxiVideo {
+    /* The color key is shared, there is only one per screen */
     uint32_t            colorKey;
-    Bool                colorKeyEnabled;
-    int                 overlay_data_offs;
+    int                 num_buffers;      /* requested number of buffers */
+
+    /*
+     * Each port allocates the memory for its ring of buffers from the
+     * reserved offscreen area, which is shared with the DRI2 overlays.
+     */
+    int                 num_ports;
+    SunxiVideoPort      ports[XV_MAX_PORTS];
+
+    /* The helper thread, which uploads the chroma planes */
+    void              (*memcpy_to_wc)(void *dst, const void *src, size_t size);
+    Bool                upload_thread_enabled;
+    Bool                upload_quit;
+    pthread_t           upload_thread;
+    pthread_mutex_t     upload_lock;
+    pthread_cond_t      upload_queued_cond;
+    pthread_cond_t      upload_completed_cond;
+    unsigned int        upload_submitted;
+    unsigned int        upload_completed;
+    SunxiVideoPlaneCopy upload_planes[2];
+
     XF86VideoAdaptorPtr adapt[1];
-    void               *port_privates[1];
+    void               *port_privates[XV_MAX_PORTS];
 } SunxiVideo;
 
 SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen);
 void SunxiVideo_Close(ScreenPtr pScreen);
 
+/*
+ * Copy the chroma planes of the video frames in a separate thread, which
+ * can run on the other CPU core. Returns TRUE on success.
+ */
+Bool SunxiVideo_EnableUploadThread(SunxiVideo *self);
+
 #endif
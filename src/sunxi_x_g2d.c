@@ -39,6 +39,17 @@
 #include "fbdev_priv.h"
 #include "sunxi_x_g2d.h"
 
+/*
+ * Wait for the completion of the queued blt2d operations (if the backend
+ * is asynchronous) before letting the CPU access the framebuffer.
+ */
+static inline void SyncBlt2D(ScreenPtr pScreen)
+{
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+    if (private->blt2d_sync)
+        private->blt2d_sync(private->blt2d_self);
+}
+
 /*
  * The code below is borrowed from "xserver/fb/fbwindow.c"
  */
@@ -206,6 +217,7 @@ xCopyArea(DrawablePtr pSrcDrawable,
         return miDoCopy(pSrcDrawable, pDstDrawable, pGC, xIn, yIn,
                     widthSrc, heightSrc, xOut, yOut, xCopyNtoN, 0, 0);
     }
+    SyncBlt2D(pDstDrawable->pScreen);
     return fbCopyArea(pSrcDrawable,
                       pDstDrawable,
                       pGC,
@@ -234,6 +246,8 @@ static void xPutImage(DrawablePtr pDrawable,
     BoxPtr pbox;
     int x1, y1, x2, y2;
 
+    SyncBlt2D(pDrawable->pScreen);
+
     if (format == XYBitmap || format == XYPixmap ||
     pDrawable->bitsPerPixel != BitsPerPixel(pDrawable->depth)) {
         fbPutImage(pDrawable, pGC, depth, x, y, w, h, leftPad, format, pImage);
@@ -301,6 +315,296 @@ static void xPutImage(DrawablePtr pDrawable,
     fbFinishAccess(pDrawable);
 }
 
+/*****************************************************************************/
+
+/*
+ * The GC operations, which just wait for the completion of the queued
+ * blt2d operations and then pass control to the original fb functions.
+ * They are only used with asynchronous blt2d backends.
+ */
+
+#define FB_GC_OPS(pDrawable) \
+    (SUNXI_G2D(xf86Screens[(pDrawable)->pScreen->myNum])->pFbGCOps)
+
+static void
+xSyncFillSpans(DrawablePtr pDrawable, GCPtr pGC, int nInit,
+               DDXPointPtr pptInit, int *pwidthInit, int fSorted)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->FillSpans(pDrawable, pGC, nInit, pptInit,
+                                    pwidthInit, fSorted);
+}
+
+static void
+xSyncSetSpans(DrawablePtr pDrawable, GCPtr pGC, char *psrc,
+              DDXPointPtr ppt, int *pwidth, int nspans, int fSorted)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->SetSpans(pDrawable, pGC, psrc, ppt, pwidth,
+                                   nspans, fSorted);
+}
+
+static RegionPtr
+xSyncCopyPlane(DrawablePtr pSrcDrawable, DrawablePtr pDstDrawable,
+               GCPtr pGC, int srcx, int srcy, int width, int height,
+               int dstx, int dsty, unsigned long bitPlane)
+{
+    SyncBlt2D(pDstDrawable->pScreen);
+    return FB_GC_OPS(pDstDrawable)->CopyPlane(pSrcDrawable, pDstDrawable,
+                                              pGC, srcx, srcy, width, height,
+                                              dstx, dsty, bitPlane);
+}
+
+static void
+xSyncPolyPoint(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+               DDXPointPtr pptInit)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolyPoint(pDrawable, pGC, mode, npt, pptInit);
+}
+
+static void
+xSyncPolylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+               DDXPointPtr pptInit)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->Polylines(pDrawable, pGC, mode, npt, pptInit);
+}
+
+static void
+xSyncPolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
+                 xSegment *pSegs)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolySegment(pDrawable, pGC, nseg, pSegs);
+}
+
+static void
+xSyncPolyRectangle(DrawablePtr pDrawable, GCPtr pGC, int nrects,
+                   xRectangle *pRects)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolyRectangle(pDrawable, pGC, nrects, pRects);
+}
+
+static void
+xSyncPolyArc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolyArc(pDrawable, pGC, narcs, parcs);
+}
+
+static void
+xSyncFillPolygon(DrawablePtr pDrawable, GCPtr pGC, int shape, int mode,
+                 int count, DDXPointPtr pPts)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->FillPolygon(pDrawable, pGC, shape, mode,
+                                      count, pPts);
+}
+
+static void
+xSyncPolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrectFill,
+                  xRectangle *prectInit)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolyFillRect(pDrawable, pGC, nrectFill, prectInit);
+}
+
+static void
+xSyncPolyFillArc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolyFillArc(pDrawable, pGC, narcs, parcs);
+}
+
+static int
+xSyncPolyText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+               int count, char *chars)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    return FB_GC_OPS(pDrawable)->PolyText8(pDrawable, pGC, x, y,
+                                           count, chars);
+}
+
+static int
+xSyncPolyText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                int count, unsigned short *chars)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    return FB_GC_OPS(pDrawable)->PolyText16(pDrawable, pGC, x, y,
+                                            count, chars);
+}
+
+static void
+xSyncImageText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                int count, char *chars)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->ImageText8(pDrawable, pGC, x, y, count, chars);
+}
+
+static void
+xSyncImageText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                 int count, unsigned short *chars)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->ImageText16(pDrawable, pGC, x, y, count, chars);
+}
+
+static void
+xSyncImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                   unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->ImageGlyphBlt(pDrawable, pGC, x, y, nglyph,
+                                        ppci, pglyphBase);
+}
+
+static void
+xSyncPolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                  unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PolyGlyphBlt(pDrawable, pGC, x, y, nglyph,
+                                       ppci, pglyphBase);
+}
+
+static void
+xSyncPushPixels(GCPtr pGC, PixmapPtr pBitmap, DrawablePtr pDrawable,
+                int w, int h, int x, int y)
+{
+    SyncBlt2D(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable)->PushPixels(pGC, pBitmap, pDrawable, w, h, x, y);
+}
+
+/*
+ * Screen and Render hooks, which may read or write the framebuffer
+ * bypassing the GC operations.
+ */
+
+static void
+xSyncGetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
+              unsigned int format, unsigned long planeMask, char *d)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    pScreen->GetImage = private->GetImage;
+    (*pScreen->GetImage) (pDrawable, x, y, w, h, format, planeMask, d);
+    private->GetImage = pScreen->GetImage;
+    pScreen->GetImage = xSyncGetImage;
+}
+
+static void
+xSyncGetSpans(DrawablePtr pDrawable, int wMax, DDXPointPtr ppt,
+              int *pwidth, int nspans, char *pdstStart)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    pScreen->GetSpans = private->GetSpans;
+    (*pScreen->GetSpans) (pDrawable, wMax, ppt, pwidth, nspans, pdstStart);
+    private->GetSpans = pScreen->GetSpans;
+    pScreen->GetSpans = xSyncGetSpans;
+}
+
+#ifdef RENDER
+
+static void
+xSyncComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+               INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+               INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    ps->Composite = private->Composite;
+    (*ps->Composite) (op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                      xDst, yDst, width, height);
+    private->Composite = ps->Composite;
+    ps->Composite = xSyncComposite;
+}
+
+static void
+xSyncGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+            PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+            int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    ps->Glyphs = private->Glyphs;
+    (*ps->Glyphs) (op, pSrc, pDst, maskFormat, xSrc, ySrc,
+                   nlist, list, glyphs);
+    private->Glyphs = ps->Glyphs;
+    ps->Glyphs = xSyncGlyphs;
+}
+
+static void
+xSyncTrapezoids(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+                PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+                int ntrap, xTrapezoid *traps)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    ps->Trapezoids = private->Trapezoids;
+    (*ps->Trapezoids) (op, pSrc, pDst, maskFormat, xSrc, ySrc, ntrap, traps);
+    private->Trapezoids = ps->Trapezoids;
+    ps->Trapezoids = xSyncTrapezoids;
+}
+
+static void
+xSyncTriangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+               PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+               int ntri, xTriangle *tris)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    ps->Triangles = private->Triangles;
+    (*ps->Triangles) (op, pSrc, pDst, maskFormat, xSrc, ySrc, ntri, tris);
+    private->Triangles = ps->Triangles;
+    ps->Triangles = xSyncTriangles;
+}
+
+static void
+xSyncAddTraps(PicturePtr pPicture, INT16 xOff, INT16 yOff,
+              int ntrap, xTrap *traps)
+{
+    ScreenPtr pScreen = pPicture->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    SunxiG2D *private = SUNXI_G2D(xf86Screens[pScreen->myNum]);
+
+    SyncBlt2D(pScreen);
+
+    ps->AddTraps = private->AddTraps;
+    (*ps->AddTraps) (pPicture, xOff, yOff, ntrap, traps);
+    private->AddTraps = ps->AddTraps;
+    ps->AddTraps = xSyncAddTraps;
+}
+
+#endif
+
+/*****************************************************************************/
+
 static Bool
 xCreateGC(GCPtr pGC)
 {
@@ -316,6 +620,34 @@ xCreateGC(GCPtr pGC)
         self->pGCOps = calloc(1, sizeof(GCOps));
         memcpy(self->pGCOps, pGC->ops, sizeof(GCOps));
 
+        /*
+         * With an asynchronous blt2d backend, every other drawing operation
+         * needs to wait for the completion of the queued copies first
+         */
+        if (self->blt2d_sync) {
+            self->pFbGCOps = calloc(1, sizeof(GCOps));
+            memcpy(self->pFbGCOps, pGC->ops, sizeof(GCOps));
+
+            self->pGCOps->FillSpans     = xSyncFillSpans;
+            self->pGCOps->SetSpans      = xSyncSetSpans;
+            self->pGCOps->CopyPlane     = xSyncCopyPlane;
+            self->pGCOps->PolyPoint     = xSyncPolyPoint;
+            self->pGCOps->Polylines     = xSyncPolylines;
+            self->pGCOps->PolySegment   = xSyncPolySegment;
+            self->pGCOps->PolyRectangle = xSyncPolyRectangle;
+            self->pGCOps->PolyArc       = xSyncPolyArc;
+            self->pGCOps->FillPolygon   = xSyncFillPolygon;
+            self->pGCOps->PolyFillRect  = xSyncPolyFillRect;
+            self->pGCOps->PolyFillArc   = xSyncPolyFillArc;
+            self->pGCOps->PolyText8     = xSyncPolyText8;
+            self->pGCOps->PolyText16    = xSyncPolyText16;
+            self->pGCOps->ImageText8    = xSyncImageText8;
+            self->pGCOps->ImageText16   = xSyncImageText16;
+            self->pGCOps->ImageGlyphBlt = xSyncImageGlyphBlt;
+            self->pGCOps->PolyGlyphBlt  = xSyncPolyGlyphBlt;
+            self->pGCOps->PushPixels    = xSyncPushPixels;
+        }
+
         /* Add our own hook for CopyArea function */
         self->pGCOps->CopyArea = xCopyArea;
         /* Add our own hook for PutImage */
@@ -340,6 +672,7 @@ SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d)
     /* Cache the pointers from blt2d_i here */
     private->blt2d_self = blt2d->self;
     private->blt2d_overlapped_blt = blt2d->overlapped_blt;
+    private->blt2d_sync = blt2d->sync;
 
     /* Wrap the current CopyWindow function */
     private->CopyWindow = pScreen->CopyWindow;
@@ -349,6 +682,37 @@ SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d)
     private->CreateGC = pScreen->CreateGC;
     pScreen->CreateGC = xCreateGC;
 
+    if (private->blt2d_sync) {
+#ifdef RENDER
+        PictureScreenPtr ps = GetPictureScreenIfSet(pScreen);
+#endif
+        /* Wrap the functions, which can access pixels outside of GC ops */
+        private->GetImage = pScreen->GetImage;
+        pScreen->GetImage = xSyncGetImage;
+
+        private->GetSpans = pScreen->GetSpans;
+        pScreen->GetSpans = xSyncGetSpans;
+
+#ifdef RENDER
+        if (ps) {
+            private->Composite = ps->Composite;
+            ps->Composite = xSyncComposite;
+
+            private->Glyphs = ps->Glyphs;
+            ps->Glyphs = xSyncGlyphs;
+
+            private->Trapezoids = ps->Trapezoids;
+            ps->Trapezoids = xSyncTrapezoids;
+
+            private->Triangles = ps->Triangles;
+            ps->Triangles = xSyncTriangles;
+
+            private->AddTraps = ps->AddTraps;
+            ps->AddTraps = xSyncAddTraps;
+        }
+#endif
+    }
+
     return private;
 }
 
@@ -357,10 +721,31 @@ void SunxiG2D_Close(ScreenPtr pScreen)
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     SunxiG2D *private = SUNXI_G2D(pScrn);
 
+    /* Make sure that nothing is left in flight */
+    SyncBlt2D(pScreen);
+
     pScreen->CopyWindow = private->CopyWindow;
     pScreen->CreateGC   = private->CreateGC;
 
+    if (private->blt2d_sync) {
+#ifdef RENDER
+        PictureScreenPtr ps = GetPictureScreenIfSet(pScreen);
+        if (ps) {
+            ps->Composite  = private->Composite;
+            ps->Glyphs     = private->Glyphs;
+            ps->Trapezoids = private->Trapezoids;
+            ps->Triangles  = private->Triangles;
+            ps->AddTraps   = private->AddTraps;
+        }
+#endif
+        pScreen->GetImage = private->GetImage;
+        pScreen->GetSpans = private->GetSpans;
+    }
+
     if (private->pGCOps) {
         free(private->pGCOps);
     }
+    if (private->pFbGCOps) {
+        free(private->pFbGCOps);
+    }
 }
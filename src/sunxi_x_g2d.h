@@ -26,11 +26,26 @@
 
 #include "interfaces.h"
 
+#ifdef RENDER
+#include "picturestr.h"
+#endif
+
 typedef struct {
     GCOps                  *pGCOps;
+    /* The original fb GC ops (only saved if blt2d_sync is set) */
+    GCOps                  *pFbGCOps;
 
     CopyWindowProcPtr       CopyWindow;
     CreateGCProcPtr         CreateGC;
+    GetImageProcPtr         GetImage;
+    GetSpansProcPtr         GetSpans;
+#ifdef RENDER
+    CompositeProcPtr        Composite;
+    GlyphsProcPtr           Glyphs;
+    TrapezoidsProcPtr       Trapezoids;
+    TrianglesProcPtr        Triangles;
+    AddTrapsProcPtr         AddTraps;
+#endif
 
     /* SunxiG2D_Init copies these pointers here from blt2d_i struct */
     void *blt2d_self;
@@ -47,6 +62,7 @@ typedef struct {
                                 int       dst_y,
                                 int       w,
                                 int       h);
+    void (*blt2d_sync)(void *self);
 } SunxiG2D;
 
 SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d);
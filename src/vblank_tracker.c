@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+
+#include "vblank_tracker.h"
+
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, uint32_t)
+#endif
+
+/* Used if the refresh rate can't be calculated from the video mode */
+#define DEFAULT_PERIOD_USEC 16667
+
+static uint64_t gettime_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+vblank_tracker_t *vblank_tracker_init(int fd_fb)
+{
+    vblank_tracker_t *ctx = calloc(sizeof(vblank_tracker_t), 1);
+    struct fb_var_screeninfo fb_var;
+
+    if (!ctx)
+        return NULL;
+
+    ctx->fd = fd_fb;
+    ctx->hw_vsync = 1;
+    ctx->period_usec = DEFAULT_PERIOD_USEC;
+
+    /* The refresh rate of the current video mode (for the estimation) */
+    if (ioctl(fd_fb, FBIOGET_VSCREENINFO, &fb_var) == 0 && fb_var.pixclock) {
+        uint64_t htotal = fb_var.xres + fb_var.left_margin +
+                          fb_var.right_margin + fb_var.hsync_len;
+        uint64_t vtotal = fb_var.yres + fb_var.upper_margin +
+                          fb_var.lower_margin + fb_var.vsync_len;
+        /* pixclock is in picoseconds */
+        uint64_t period = htotal * vtotal * fb_var.pixclock / 1000000;
+        if (period >= 5000 && period <= 100000)
+            ctx->period_usec = period;
+    }
+
+    if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
+        free(ctx);
+        return NULL;
+    }
+    if (pthread_cond_init(&ctx->vblank_cond, NULL) != 0) {
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->ust = gettime_usec();
+    return ctx;
+}
+
+static void *vblank_tracker_thread(void *arg)
+{
+    vblank_tracker_t *ctx = (vblank_tracker_t *)arg;
+    uint64_t next_vblank = gettime_usec() + ctx->period_usec;
+    uint32_t crtc = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->quit) {
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (ctx->hw_vsync && ioctl(ctx->fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+            /* No vsync support in the kernel, fall back to the estimation */
+            ctx->hw_vsync = 0;
+            next_vblank = gettime_usec() + ctx->period_usec;
+        }
+        if (!ctx->hw_vsync) {
+            struct timespec ts;
+            ts.tv_sec = next_vblank / 1000000;
+            ts.tv_nsec = (next_vblank % 1000000) * 1000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                   &ts, NULL) == EINTR) {}
+            next_vblank += ctx->period_usec;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->msc++;
+        ctx->ust = gettime_usec();
+        pthread_cond_broadcast(&ctx->vblank_cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static void vblank_tracker_stop(vblank_tracker_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->running) {
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    ctx->quit = 1;
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->thread, NULL);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->running = 0;
+    ctx->quit = 0;
+    /* Wake up the waiters, there will be no more vblanks */
+    pthread_cond_broadcast(&ctx->vblank_cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void vblank_tracker_close(vblank_tracker_t *ctx)
+{
+    if (!ctx)
+        return;
+    vblank_tracker_stop(ctx);
+    pthread_cond_destroy(&ctx->vblank_cond);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+int vblank_tracker_acquire(vblank_tracker_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->running) {
+        if (pthread_create(&ctx->thread, NULL, vblank_tracker_thread, ctx)) {
+            pthread_mutex_unlock(&ctx->lock);
+            return 0;
+        }
+        ctx->running = 1;
+    }
+    ctx->users++;
+    pthread_mutex_unlock(&ctx->lock);
+    return 1;
+}
+
+void vblank_tracker_release(vblank_tracker_t *ctx)
+{
+    int stop;
+    pthread_mutex_lock(&ctx->lock);
+    stop = --ctx->users == 0;
+    pthread_mutex_unlock(&ctx->lock);
+    if (stop)
+        vblank_tracker_stop(ctx);
+}
+
+uint64_t vblank_tracker_get_msc(vblank_tracker_t *ctx, uint64_t *ust)
+{
+    uint64_t msc;
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->running) {
+        /* Nobody counts the vblanks now, account for the elapsed time */
+        uint64_t periods = (gettime_usec() - ctx->ust) / ctx->period_usec;
+        ctx->msc += periods;
+        ctx->ust += periods * ctx->period_usec;
+    }
+    msc = ctx->msc;
+    if (ust)
+        *ust = ctx->ust;
+    pthread_mutex_unlock(&ctx->lock);
+    return msc;
+}
+
+uint64_t vblank_tracker_wait_msc(vblank_tracker_t *ctx, uint64_t target_msc,
+                                 uint64_t *ust)
+{
+    uint64_t msc;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->running && ctx->msc < target_msc)
+        pthread_cond_wait(&ctx->vblank_cond, &ctx->lock);
+    msc = ctx->msc;
+    if (ust)
+        *ust = ctx->ust;
+    pthread_mutex_unlock(&ctx->lock);
+    return msc;
+}
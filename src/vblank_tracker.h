@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef VBLANK_TRACKER_H
+#define VBLANK_TRACKER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/*
+ * Vertical blanking tracker. A helper thread waits for vsync using the
+ * FBIO_WAITFORVSYNC ioctl and maintains the vblank counter (MSC) and the
+ * timestamp of the last vblank (UST, in microseconds, CLOCK_MONOTONIC).
+ * If the ioctl is not supported by the kernel, the vblanks are estimated
+ * using the refresh rate of the current video mode.
+ *
+ * The thread only runs while the tracker has users, so that the CPU does
+ * not wake up on every vblank when nobody is interested.
+ */
+typedef struct {
+    int                 fd;               /* framebuffer descriptor */
+    int                 hw_vsync;         /* FBIO_WAITFORVSYNC works */
+    uint32_t            period_usec;      /* refresh period of the mode */
+
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      vblank_cond;      /* signalled on every vblank */
+    int                 users;
+    int                 running;
+    int                 quit;
+
+    uint64_t            msc;              /* number of vblanks so far */
+    uint64_t            ust;              /* timestamp of the last vblank */
+} vblank_tracker_t;
+
+/* The framebuffer descriptor is not owned by the tracker */
+vblank_tracker_t *vblank_tracker_init(int fd_fb);
+void vblank_tracker_close(vblank_tracker_t *ctx);
+
+/*
+ * Start tracking vblanks (the first user starts the thread). Returns 1
+ * on success. Every successful acquire needs a matching release.
+ */
+int vblank_tracker_acquire(vblank_tracker_t *ctx);
+void vblank_tracker_release(vblank_tracker_t *ctx);
+
+/*
+ * Get the current vblank counter and (optionally) its timestamp. While the
+ * thread is not running, both are extrapolated from the refresh period.
+ */
+uint64_t vblank_tracker_get_msc(vblank_tracker_t *ctx, uint64_t *ust);
+
+/* Block until the vblank counter reaches 'target_msc' */
+uint64_t vblank_tracker_wait_msc(vblank_tracker_t *ctx, uint64_t target_msc,
+                                 uint64_t *ust);
+
+#endif
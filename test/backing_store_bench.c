@@ -0,0 +1,170 @@
+/* gcc -O2 -o backing_store_bench backing_store_bench.c -lX11 */
+
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A benchmark for the backing store heuristics. It creates a lot of
+ * top level windows (without a window manager, so that they are really
+ * direct children of root) and measures how fast the X server can handle
+ * window moves and keyboard focus changes. Every such operation results
+ * in a PostValidateTree call, so the overhead of the backing store tuner
+ * is directly visible here.
+ *
+ * Usage: backing_store_bench [number_of_windows]
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#define NTESTS      1000
+#define WIN_WIDTH   200
+#define WIN_HEIGHT  150
+
+static double gettime(void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (double)((int64_t)tv.tv_sec * 1000000 + tv.tv_usec) / 1000000.;
+}
+
+static void print_backing_store_usage(Display *dpy, Window root)
+{
+    Atom atom = XInternAtom(dpy, "_FBTURBO_BACKING_STORE_USAGE", True);
+    Atom type;
+    int format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data = NULL;
+
+    if (atom == None ||
+        XGetWindowProperty(dpy, root, atom, 0, 5, False, XA_CARDINAL,
+                           &type, &format, &nitems, &bytes_after,
+                           &data) != Success || nitems != 5) {
+        printf("backing store usage: not available\n");
+    }
+    else {
+        long *usage = (long *)data;
+        printf("backing store usage: %ld KiB (budget %ld KiB), "
+               "%ld windows, %ld evictions, %ld transitions per second\n",
+               usage[0], usage[1], usage[2], usage[3], usage[4]);
+    }
+    if (data)
+        XFree(data);
+}
+
+int main(int argc, char *argv[])
+{
+    Display *dpy;
+    Window root, *windows;
+    XSetWindowAttributes attr;
+    int screen, n, i, nwindows = 300;
+    int xmax, ymax;
+    double t1, t2;
+
+    if (argc > 1)
+        nwindows = atoi(argv[1]);
+    if (nwindows < 2) {
+        printf("need at least 2 windows\n");
+        return 1;
+    }
+
+    dpy = XOpenDisplay(NULL);
+    if (!dpy) {
+        printf("failed to open display\n");
+        return 1;
+    }
+    screen = DefaultScreen(dpy);
+    root = RootWindow(dpy, screen);
+    xmax = DisplayWidth(dpy, screen) - WIN_WIDTH;
+    ymax = DisplayHeight(dpy, screen) - WIN_HEIGHT;
+    if (xmax < 1)
+        xmax = 1;
+    if (ymax < 1)
+        ymax = 1;
+
+    windows = calloc(nwindows, sizeof(Window));
+    if (!windows)
+        return 1;
+
+    /* Bypass the window manager, we want direct children of root */
+    attr.override_redirect = True;
+    attr.background_pixel = WhitePixel(dpy, screen);
+
+    srand(0);
+    t1 = gettime();
+    for (i = 0; i < nwindows; i++) {
+        windows[i] = XCreateWindow(dpy, root, rand() % xmax, rand() % ymax,
+                                   WIN_WIDTH, WIN_HEIGHT, 0, CopyFromParent,
+                                   InputOutput, CopyFromParent,
+                                   CWOverrideRedirect | CWBackPixel, &attr);
+        XMapWindow(dpy, windows[i]);
+    }
+    XSync(dpy, False);
+    t2 = gettime();
+    printf("created and mapped %d windows: %.2f ms\n", nwindows,
+           (t2 - t1) * 1000.);
+
+    t1 = gettime();
+    for (n = 0; n < NTESTS; n++) {
+        i = rand() % nwindows;
+        XMoveWindow(dpy, windows[i], rand() % xmax, rand() % ymax);
+        XSync(dpy, False);
+    }
+    t2 = gettime();
+    printf("window move: %.2f us per operation\n",
+           (t2 - t1) * 1000000. / NTESTS);
+
+    t1 = gettime();
+    for (n = 0; n < NTESTS; n++) {
+        i = rand() % nwindows;
+        XSetInputFocus(dpy, windows[i], RevertToPointerRoot, CurrentTime);
+        XSync(dpy, False);
+    }
+    t2 = gettime();
+    printf("focus change: %.2f us per operation\n",
+           (t2 - t1) * 1000000. / NTESTS);
+
+    t1 = gettime();
+    for (n = 0; n < NTESTS; n++) {
+        i = rand() % nwindows;
+        XSetInputFocus(dpy, windows[i], RevertToPointerRoot, CurrentTime);
+        XRaiseWindow(dpy, windows[i]);
+        XSync(dpy, False);
+    }
+    t2 = gettime();
+    printf("focus change with raise: %.2f us per operation\n",
+           (t2 - t1) * 1000000. / NTESTS);
+
+    print_backing_store_usage(dpy, root);
+
+    for (i = 0; i < nwindows; i++)
+        XDestroyWindow(dpy, windows[i]);
+    XCloseDisplay(dpy);
+    free(windows);
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Unit test for the buffer change detection (src/buffer_sampler.c), which
+ * is used by DRI2 to find out whether the Mali blob has rendered a new
+ * frame to a buffer. Synthetic buffers get small localized changes and
+ * the test checks that these changes are noticed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/buffer_sampler.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            printf("FAIL: " __VA_ARGS__);                       \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+typedef struct {
+    uint8_t *data;
+    size_t   width;   /* in bytes */
+    size_t   stride;
+    size_t   height;
+} buffer_t;
+
+static uint32_t rand_state = 1;
+
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static buffer_t *create_buffer(size_t width, size_t stride, size_t height)
+{
+    buffer_t *b = malloc(sizeof(buffer_t));
+    size_t i;
+    b->width = width;
+    b->stride = stride;
+    b->height = height;
+    b->data = malloc(stride * height);
+    for (i = 0; i < stride * height; i++)
+        b->data[i] = next_rand();
+    return b;
+}
+
+static void free_buffer(buffer_t *b)
+{
+    free(b->data);
+    free(b);
+}
+
+static size_t max_chunks = BUFFER_SAMPLER_MAX_CHUNKS;
+
+static uint32_t hash(buffer_t *b, uint32_t seed)
+{
+    return buffer_sampler_hash(b->data, b->width, b->stride, b->height, seed,
+                               max_chunks);
+}
+
+/* Modify a rectangle (in bytes) and report whether the hash has changed */
+static int change_is_detected(buffer_t *b, uint32_t seed,
+                              size_t x, size_t y, size_t w, size_t h)
+{
+    uint8_t *backup = malloc(w * h);
+    uint32_t before = hash(b, seed), after;
+    size_t i, j;
+
+    for (i = 0; i < h; i++) {
+        memcpy(backup + i * w, b->data + (y + i) * b->stride + x, w);
+        for (j = 0; j < w; j++)
+            b->data[(y + i) * b->stride + x + j] ^= 0x5A;
+    }
+    after = hash(b, seed);
+    for (i = 0; i < h; i++)
+        memcpy(b->data + (y + i) * b->stride + x, backup + i * w, w);
+
+    free(backup);
+    return before != after;
+}
+
+static void test_budget(void)
+{
+    CHECK(buffer_sampler_budget(0) == BUFFER_SAMPLER_MIN_CHUNKS,
+          "empty buffer budget");
+    CHECK(buffer_sampler_budget(1920 * 1080 * 4) == 1920 * 1080 * 4 /
+                                            BUFFER_SAMPLER_BYTES_PER_CHUNK,
+          "1920x1080 budget");
+    CHECK(buffer_sampler_budget(800 * 480 * 2) < buffer_sampler_budget(1920 * 1080 * 4),
+          "budget grows with the buffer size");
+    CHECK(buffer_sampler_budget((size_t)1 << 30) == BUFFER_SAMPLER_MAX_CHUNKS,
+          "huge buffer budget");
+}
+
+static void test_stable(void)
+{
+    buffer_t *b = create_buffer(1280 * 4, 1280 * 4, 720);
+    CHECK(hash(b, 1) == hash(b, 1), "same seed, same data, same hash");
+    CHECK(hash(b, 1) != hash(b, 2), "different seeds give different hashes");
+    free_buffer(b);
+}
+
+/* The small buffers are hashed completely, every byte matters */
+static void test_small_buffer(void)
+{
+    buffer_t *b = create_buffer(37 * 4, 40 * 4, 9);
+    size_t x, y;
+
+    for (y = 0; y < b->height; y++) {
+        for (x = 0; x < b->width; x++)
+            CHECK(change_is_detected(b, 7, x, y, 1, 1),
+                  "small buffer change at (%d, %d)", (int)x, (int)y);
+        /* the padding at the end of the rows is not a part of the image */
+        for (x = b->width; x < b->stride; x++)
+            CHECK(!change_is_detected(b, 7, x, y, 1, 1),
+                  "small buffer padding change at (%d, %d)", (int)x, (int)y);
+    }
+    free_buffer(b);
+}
+
+/* Every band of rows is sampled, so a changed full width band is noticed */
+static void test_full_width_band(void)
+{
+    buffer_t *b = create_buffer(1920 * 4, 1920 * 4, 1080);
+    size_t band = 2 * b->height / buffer_sampler_budget(b->stride * b->height);
+    uint32_t seed;
+
+    for (seed = 0; seed < 100; seed++) {
+        size_t y = next_rand() % (b->height - band);
+        CHECK(change_is_detected(b, seed, 0, y, b->width, band),
+              "band of %d rows at y=%d, seed=%d", (int)band, (int)y, (int)seed);
+    }
+    free_buffer(b);
+}
+
+/* With a capped budget, the bands are wider, but still all sampled */
+static void test_capped_budget(void)
+{
+    buffer_t *b = create_buffer(1920 * 4, 1920 * 4, 1080);
+    size_t band;
+    uint32_t seed;
+    int single_rows = 0;
+
+    max_chunks = 64;
+    band = 2 * b->height / max_chunks;
+    for (seed = 0; seed < 100; seed++) {
+        size_t y = next_rand() % (b->height - band);
+        CHECK(change_is_detected(b, seed, 0, y, b->width, band),
+              "capped: band of %d rows at y=%d, seed=%d",
+              (int)band, (int)y, (int)seed);
+        single_rows += change_is_detected(b, seed, 0, y, b->width, 1);
+    }
+    /* Only one row out of about 17 in each band is read */
+    CHECK(single_rows < 20, "capped: %d%% of single rows are read",
+          single_rows);
+    max_chunks = BUFFER_SAMPLER_MAX_CHUNKS;
+    free_buffer(b);
+}
+
+/*
+ * A small block may be missed by a single check, but not for long, because
+ * the seed (the swap counter) changes every frame.
+ */
+static void test_small_block(void)
+{
+    buffer_t *b = create_buffer(1920 * 4, 1920 * 4, 1080);
+    int seed, detected = 0, total = 200;
+
+    for (seed = 0; seed < total; seed++) {
+        size_t x = next_rand() % (b->width - 64 * 4);
+        size_t y = next_rand() % (b->height - 64);
+        detected += change_is_detected(b, seed, x, y, 64 * 4, 64);
+    }
+    printf("64x64 block change detected in %d%% of the cases\n",
+           detected * 100 / total);
+    CHECK(detected * 100 / total >= 40, "64x64 block detection rate too low");
+    free_buffer(b);
+}
+
+int main(void)
+{
+    test_budget();
+    test_stable();
+    test_small_buffer();
+    test_full_width_band();
+    test_capped_budget();
+    test_small_block();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
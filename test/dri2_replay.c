@@ -0,0 +1,762 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A replay harness for the DRI2 code (src/sunxi_mali_ump_dri2.c), which
+ * runs it on a desktop host without Mali, without the display controller
+ * and without the X server. The driver code is compiled together with
+ * the libUMP stand-in (test/mock_ump) and with a minimal emulation of the
+ * X server functions it needs. The client side mimics the Mali blob (see
+ * the comment for DRI2WindowStateRec) rendering alternating yellow and
+ * blue frames like test/gles-yellow-blue-flip.c, including the window
+ * resize race. Each frame is checked on the emulated screen, and the time
+ * spent in the swaps and the cache maintenance work are reported.
+ *
+ * Only the copying path is covered, because there is no sunxi disp (so no
+ * overlays) and the vblank scheduling is disabled (DRI2 version 3).
+ *
+ * Usage: dri2_replay [number_of_frames]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "xorgVersion.h"
+#include "xf86.h"
+#include "xf86drm.h"
+#include "dri2.h"
+
+/* Use the synchronous swaps, the vblank scheduling is not emulated */
+#undef DRI2INFOREC_VERSION
+#define DRI2INFOREC_VERSION 3
+
+#include "../src/sunxi_mali_ump_dri2.c"
+
+#include "mock_ump.h"
+
+#define SCREEN_WIDTH  1024
+#define SCREEN_HEIGHT 768
+
+#define YELLOW 0xFFFFFF00
+#define BLUE   0xFF0000FF
+#define BLACK  0xFF000000
+
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            printf("FAIL: " __VA_ARGS__);                       \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+/************************************************************************/
+/* The emulated X server                                                */
+/************************************************************************/
+
+ScreenInfo screenInfo;
+static ScrnInfoPtr screens[1];
+ScrnInfoPtr *xf86Screens = screens;
+
+static ScreenRec      screen;
+static ScrnInfoRec    scrn;
+static FBDevRec       fbdev;
+static PixmapRec      screen_pixmap;
+static uint32_t       screen_pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
+static DRI2InfoRec    dri2_info;
+
+BoxRec RegionEmptyBox = { 0, 0, 0, 0 };
+RegDataRec RegionEmptyData = { 0, 0 };
+RegDataRec RegionBrokenData = { 0, 0 };
+
+RegionPtr RegionCreate(BoxPtr rect, int size)
+{
+    RegionPtr pReg = malloc(sizeof(RegionRec));
+    if (pReg)
+        RegionInit(pReg, rect, size);
+    return pReg;
+}
+
+void RegionDestroy(RegionPtr pReg)
+{
+    RegionUninit(pReg);
+    free(pReg);
+}
+
+void ErrorF(const char *f, ...)
+{
+    va_list args;
+    va_start(args, f);
+    vfprintf(stderr, f, args);
+    va_end(args);
+}
+
+void xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...)
+{
+    va_list args;
+    if (getenv("DRI2_REPLAY_VERBOSE") == NULL)
+        return;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void xf86DrvMsgVerb(int scrnIndex, MessageType type, int verb,
+                    const char *format, ...)
+{
+    va_list args;
+    if (getenv("DRI2_REPLAY_VERBOSE") == NULL)
+        return;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+Bool xf86LoadKernelModule(const char *pathname)
+{
+    return TRUE;
+}
+
+pointer xf86LoadSubModule(ScrnInfoPtr pScrn, const char *name)
+{
+    return (pointer)name;
+}
+
+int drmOpen(const char *name, const char *busid)
+{
+    return open("/dev/null", O_RDWR);
+}
+
+int drmClose(int fd)
+{
+    return close(fd);
+}
+
+char *drmGetDeviceNameFromFd(int fd)
+{
+    return strdup("/dev/dri/card0");
+}
+
+Bool DRI2ScreenInit(ScreenPtr pScreen, DRI2InfoPtr info)
+{
+    dri2_info = *info;
+    return TRUE;
+}
+
+void DRI2CloseScreen(ScreenPtr pScreen)
+{
+}
+
+Bool dixRegisterPrivateKey(DevPrivateKey key, DevPrivateType type,
+                           unsigned size)
+{
+    /* Every object gets a single private pointer, see create_window() */
+    key->initialized = TRUE;
+    key->offset = 0;
+    key->size = 0;
+    return TRUE;
+}
+
+/* The swap statistics property is just counted (dri2_replay_property.c) */
+
+ClientPtr serverClient;
+extern int dri2_replay_properties_changed;
+
+Atom MakeAtom(const char *string, unsigned int len, Bool makeit)
+{
+    return 1;
+}
+
+void DamageDamageRegion(DrawablePtr pDrawable, RegionPtr pRegion)
+{
+}
+
+void BackingStoreTuner_HintFrequentUpdates(DrawablePtr pDraw)
+{
+}
+
+/* The fake clock, which advances by a frame period for every frame */
+
+struct _OsTimerRec {
+    CARD32          expires;
+    Bool            armed;
+    OsTimerCallback callback;
+    pointer         arg;
+};
+
+static CARD32 fake_time = 1000;
+
+CARD32 GetTimeInMillis(void)
+{
+    return fake_time;
+}
+
+OsTimerPtr TimerSet(OsTimerPtr timer, int flags, CARD32 millis,
+                    OsTimerCallback func, pointer arg)
+{
+    if (!timer && !(timer = calloc(1, sizeof(*timer))))
+        return NULL;
+    timer->expires  = (flags & TimerAbsolute) ? millis : fake_time + millis;
+    timer->armed    = millis != 0;
+    timer->callback = func;
+    timer->arg      = arg;
+    return timer;
+}
+
+void TimerFree(OsTimerPtr timer)
+{
+    free(timer);
+}
+
+static void advance_time(CARD32 ms)
+{
+    OsTimerPtr timer = SUNXI_MALI_UMP_DRI2(&scrn)->ump_pool.trim_timer;
+    fake_time += ms;
+    if (timer && timer->armed && (INT32)(fake_time - timer->expires) >= 0) {
+        CARD32 next = timer->callback(timer, fake_time, timer->arg);
+        timer->armed = next != 0;
+        timer->expires = fake_time + next;
+    }
+}
+
+/*
+ * The GC and pixmap functions, just enough for copying a scratch pixmap
+ * to a window on the 32bpp screen.
+ */
+
+static void FakeChangeClip(GCPtr pGC, int type, pointer pvalue, int nrects)
+{
+    if (pGC->clientClip)
+        RegionDestroy(pGC->clientClip);
+    pGC->clientClip = pvalue;
+}
+
+static RegionPtr FakeCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+                              int srcx, int srcy, int w, int h,
+                              int dstx, int dsty)
+{
+    PixmapPtr pSrcPixmap = (PixmapPtr)pSrc;
+    BoxRec box = { dstx, dsty, dstx + w, dsty + h };
+    RegionRec region;
+    BoxPtr pbox;
+    int nbox;
+
+    RegionInit(&region, &box, 1);
+    if (pGC->clientClip)
+        RegionIntersect(&region, &region, pGC->clientClip);
+    pbox = RegionRects(&region);
+    nbox = RegionNumRects(&region);
+    while (nbox--) {
+        int y;
+        for (y = pbox->y1; y < pbox->y2; y++) {
+            uint8_t *src = (uint8_t *)pSrcPixmap->devPrivate.ptr +
+                           (srcy + y - dsty) * pSrcPixmap->devKind +
+                           (srcx + pbox->x1 - dstx) * 4;
+            uint32_t *dst = screen_pixels +
+                            (pDst->y + y) * SCREEN_WIDTH + pDst->x + pbox->x1;
+            memcpy(dst, src, (pbox->x2 - pbox->x1) * 4);
+        }
+        pbox++;
+    }
+    RegionUninit(&region);
+    return NULL;
+}
+
+static GCFuncs fake_gc_funcs = { .ChangeClip = FakeChangeClip };
+static GCOps   fake_gc_ops   = { .CopyArea   = FakeCopyArea };
+
+GCPtr GetScratchGC(unsigned depth, ScreenPtr pScreen)
+{
+    GCPtr pGC = calloc(1, sizeof(GC));
+    pGC->pScreen = pScreen;
+    pGC->depth   = depth;
+    pGC->funcs   = &fake_gc_funcs;
+    pGC->ops     = &fake_gc_ops;
+    return pGC;
+}
+
+void FreeScratchGC(GCPtr pGC)
+{
+    if (pGC->clientClip)
+        RegionDestroy(pGC->clientClip);
+    free(pGC);
+}
+
+void ValidateGC(DrawablePtr pDraw, GCPtr pGC)
+{
+}
+
+PixmapPtr GetScratchPixmapHeader(ScreenPtr pScreen, int width, int height,
+                                 int depth, int bitsPerPixel, int devKind,
+                                 pointer pPixData)
+{
+    PixmapPtr pPixmap = calloc(1, sizeof(PixmapRec));
+    pPixmap->drawable.type         = DRAWABLE_PIXMAP;
+    pPixmap->drawable.pScreen      = pScreen;
+    pPixmap->drawable.width        = width;
+    pPixmap->drawable.height       = height;
+    pPixmap->drawable.depth        = depth;
+    pPixmap->drawable.bitsPerPixel = bitsPerPixel;
+    pPixmap->devKind               = devKind;
+    pPixmap->devPrivate.ptr        = pPixData;
+    return pPixmap;
+}
+
+void FreeScratchPixmapHeader(PixmapPtr pPixmap)
+{
+    free(pPixmap);
+}
+
+/* The screen functions wrapped by the DRI2 code */
+
+static PixmapPtr FakeGetWindowPixmap(WindowPtr pWin)
+{
+    return &screen_pixmap;
+}
+
+static PixmapPtr FakeGetScreenPixmap(ScreenPtr pScreen)
+{
+    return &screen_pixmap;
+}
+
+static Bool FakeDestroyWindow(WindowPtr pWin)
+{
+    return TRUE;
+}
+
+static Bool FakeDestroyPixmap(PixmapPtr pPixmap)
+{
+    return TRUE;
+}
+
+static void FakeBlockHandler(BLOCKHANDLER_ARGS_DECL)
+{
+}
+
+static void run_block_handler(ScreenPtr pScreen)
+{
+#ifdef XF86_SCRN_INTERFACE
+    ScreenPtr arg = pScreen;
+#else
+    int arg = pScreen->myNum;
+    pointer blockData = NULL;
+#endif
+    pointer pTimeout = NULL, pReadmask = NULL;
+    (*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
+}
+
+/* The windows have a single private pointer (see dixRegisterPrivateKey) */
+typedef struct {
+    WindowRec   win;
+    void       *privates[1];
+} FakeWindowRec;
+
+static void set_window_geometry(WindowPtr pWin, int x, int y, int w, int h)
+{
+    BoxRec box = { x, y, x + w, y + h };
+    pWin->drawable.x      = x;
+    pWin->drawable.y      = y;
+    pWin->drawable.width  = w;
+    pWin->drawable.height = h;
+    RegionUninit(&pWin->clipList);
+    RegionInit(&pWin->clipList, &box, 1);
+}
+
+static WindowPtr create_window(WindowPtr pParent, int x, int y, int w, int h)
+{
+    FakeWindowRec *fake = calloc(1, sizeof(FakeWindowRec));
+    WindowPtr pWin = &fake->win;
+
+    pWin->drawable.type         = DRAWABLE_WINDOW;
+    pWin->drawable.class        = InputOutput;
+    pWin->drawable.depth        = 24;
+    pWin->drawable.bitsPerPixel = 32;
+    pWin->drawable.pScreen      = &screen;
+    pWin->devPrivates           = (PrivateRec *)fake->privates;
+    pWin->parent                = pParent;
+    pWin->mapped                = TRUE;
+    pWin->realized              = TRUE;
+    RegionNull(&pWin->clipList);
+    set_window_geometry(pWin, x, y, w, h);
+    if (pParent)
+        pParent->firstChild = pParent->lastChild = pWin;
+    return pWin;
+}
+
+static void destroy_window(WindowPtr pWin)
+{
+    (*screen.DestroyWindow) (pWin);
+    if (pWin->parent)
+        pWin->parent->firstChild = pWin->parent->lastChild = NULL;
+    RegionUninit(&pWin->clipList);
+    free(pWin);
+}
+
+static void init_screen(void)
+{
+    fbdev.fbmem = (unsigned char *)screen_pixels;
+    scrn.driverPrivate = &fbdev;
+    scrn.virtualX = SCREEN_WIDTH;
+    scrn.virtualY = SCREEN_HEIGHT;
+    screens[0] = &scrn;
+
+    screen.myNum             = 0;
+    screen.width             = SCREEN_WIDTH;
+    screen.height            = SCREEN_HEIGHT;
+    screen.GetWindowPixmap   = FakeGetWindowPixmap;
+    screen.GetScreenPixmap   = FakeGetScreenPixmap;
+    screen.DestroyWindow     = FakeDestroyWindow;
+    screen.DestroyPixmap     = FakeDestroyPixmap;
+    screen.BlockHandler      = FakeBlockHandler;
+    screenInfo.screens[0]    = &screen;
+    screenInfo.numScreens    = 1;
+
+    screen_pixmap.drawable.type         = DRAWABLE_PIXMAP;
+    screen_pixmap.drawable.pScreen      = &screen;
+    screen_pixmap.drawable.width        = SCREEN_WIDTH;
+    screen_pixmap.drawable.height       = SCREEN_HEIGHT;
+    screen_pixmap.drawable.depth        = 24;
+    screen_pixmap.drawable.bitsPerPixel = 32;
+    screen_pixmap.devKind               = SCREEN_WIDTH * 4;
+    screen_pixmap.devPrivate.ptr        = screen_pixels;
+
+    screen.root = create_window(NULL, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+    RegionNull(&screen.root->winSize);
+}
+
+/************************************************************************/
+/* The emulated client (the Mali blob)                                  */
+/************************************************************************/
+
+typedef struct {
+    WindowPtr       pWin;
+    DRI2BufferPtr   back;
+    ump_handle      handle;
+    uint8_t        *addr;
+} Client;
+
+static uint64_t gettime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* DRI2GetBuffers: the new buffer is created before the old one is destroyed */
+static void request_back_buffer(Client *client)
+{
+    DrawablePtr pDraw = &client->pWin->drawable;
+    DRI2BufferPtr back = dri2_info.CreateBuffer(pDraw, DRI2BufferBackLeft, 0);
+
+    if (client->back)
+        dri2_info.DestroyBuffer(pDraw, client->back);
+    client->back = back;
+
+    if (client->handle != UMP_INVALID_MEMORY_HANDLE) {
+        ump_mapped_pointer_release(client->handle);
+        ump_reference_release(client->handle);
+    }
+    client->handle = ump_handle_create_from_secure_id(back->name);
+    client->addr = ump_mapped_pointer_get(client->handle);
+}
+
+static Bool got_null_buffer(Client *client)
+{
+    return client->back->name ==
+           SUNXI_MALI_UMP_DRI2(&scrn)->ump_null_secure_id;
+}
+
+static void render(Client *client, uint32_t color, int x1, int y1, int x2, int y2)
+{
+    int x, y;
+    for (y = y1; y < y2; y++) {
+        uint32_t *row = (uint32_t *)(client->addr + client->back->flags +
+                                     y * client->back->pitch);
+        for (x = x1; x < x2; x++)
+            row[x] = color;
+    }
+}
+
+/* DRI2SwapBuffers (or DRI2CopyRegion) and one X server main loop iteration */
+static uint64_t swap(Client *client, int x1, int y1, int x2, int y2)
+{
+    BoxRec box = { x1, y1, x2, y2 };
+    RegionRec region;
+    uint64_t t;
+
+    RegionInit(&region, &box, 1);
+    t = gettime_ns();
+    dri2_info.CopyRegion(&client->pWin->drawable, &region, NULL, client->back);
+    run_block_handler(&screen);
+    t = gettime_ns() - t;
+    RegionUninit(&region);
+    advance_time(16);
+    return t;
+}
+
+static uint32_t screen_pixel(int x, int y)
+{
+    return screen_pixels[y * SCREEN_WIDTH + x];
+}
+
+static Bool window_has_color(WindowPtr pWin, uint32_t color)
+{
+    DrawablePtr d = &pWin->drawable;
+    return screen_pixel(d->x, d->y) == color &&
+           screen_pixel(d->x + d->width - 1, d->y + d->height - 1) == color &&
+           screen_pixel(d->x + d->width / 2, d->y + d->height / 2) == color;
+}
+
+static void print_stats(const char *name, int frames, uint64_t ns,
+                        size_t bytes_per_frame)
+{
+    const mock_ump_stats_t *stats = mock_ump_get_stats();
+    printf("%s: %d frames, %.1f us per swap, %.1f MB/s\n", name, frames,
+           ns / 1000.0 / frames,
+           (double)bytes_per_frame * frames / (ns / 1000.0));
+    printf("    UMP allocations=%lu, cache batches=%lu, usage switches=%lu "
+           "(%llu KiB), msync calls=%lu (%llu KiB)\n",
+           stats->allocations, stats->cache_batches, stats->hw_usage_switches,
+           stats->switched_bytes / 1024, stats->msync_calls,
+           stats->msync_bytes / 1024);
+}
+
+/************************************************************************/
+/* The scenarios                                                        */
+/************************************************************************/
+
+/* Full window yellow/blue frames, as rendered by gles-yellow-blue-flip */
+static void replay_flip(int frames)
+{
+    Client client = { create_window(screen.root, 100, 50, 480, 480) };
+    uint64_t ns = 0;
+    int i;
+
+    mock_ump_reset_stats();
+
+    /* The blob requests the buffer again after the first swap */
+    request_back_buffer(&client);
+    render(&client, BLACK, 0, 0, 480, 480);
+    ns += swap(&client, 0, 0, 480, 480);
+    request_back_buffer(&client);
+
+    for (i = 0; i < frames; i++) {
+        uint32_t color = (i & 1) ? BLUE : YELLOW;
+        render(&client, color, 0, 0, 480, 480);
+        ns += swap(&client, 0, 0, 480, 480);
+        CHECK(window_has_color(client.pWin, color), "flip: frame %d", i);
+    }
+    CHECK(mock_ump_get_stats()->allocations == 1,
+          "flip: the UMP buffer is not reused");
+    CHECK(mock_ump_get_stats()->errors == 0, "flip: libUMP misuse");
+    CHECK(GetWindowState(&client.pWin->drawable)->stats.copied_frames ==
+          frames + 1, "flip: the copied frames are not counted");
+    CHECK(GetWindowState(&client.pWin->drawable)->stats.frame_time_hist[1] ==
+          frames, "flip: the frame times are not in the 10-17 ms bucket");
+    /* Once per second, i.e. every 63rd frame of the 16 ms fake clock */
+    CHECK(dri2_replay_properties_changed == frames / 63 + 1,
+          "flip: the swap statistics published %d times",
+          dri2_replay_properties_changed);
+    print_stats("flip", frames + 1, ns, 480 * 480 * 4);
+
+    dri2_info.DestroyBuffer(&client.pWin->drawable, client.back);
+    ump_mapped_pointer_release(client.handle);
+    ump_reference_release(client.handle);
+    destroy_window(client.pWin);
+}
+
+/*
+ * Only a part of the window is updated. The cache maintenance must not
+ * touch more than the rows which are copied to the screen.
+ */
+static void replay_partial(int frames)
+{
+    Client client = { create_window(screen.root, 200, 100, 640, 480) };
+    uint64_t ns = 0;
+    int i;
+
+    request_back_buffer(&client);
+    render(&client, BLACK, 0, 0, 640, 480);
+    swap(&client, 0, 0, 640, 480);
+    request_back_buffer(&client);
+
+    mock_ump_reset_stats();
+    for (i = 0; i < frames; i++) {
+        uint32_t color = (i & 1) ? BLUE : YELLOW;
+        render(&client, color, 100, 200, 164, 264);
+        ns += swap(&client, 100, 200, 164, 264);
+        CHECK(screen_pixel(200 + 100, 100 + 200) == color &&
+              screen_pixel(200 + 163, 100 + 263) == color,
+              "partial: frame %d is not shown", i);
+        CHECK(screen_pixel(200 + 99, 100 + 200) == BLACK &&
+              screen_pixel(200 + 164, 100 + 263) == BLACK,
+              "partial: frame %d is copied outside of the damage", i);
+    }
+#ifdef HAVE_LIBUMP_CPU_MSYNC
+    CHECK(mock_ump_get_stats()->msync_bytes ==
+          (unsigned long long)frames * 64 * client.back->pitch,
+          "partial: %llu bytes invalidated instead of %llu",
+          mock_ump_get_stats()->msync_bytes,
+          (unsigned long long)frames * 64 * client.back->pitch);
+#endif
+    CHECK(mock_ump_get_stats()->errors == 0, "partial: libUMP misuse");
+    print_stats("partial", frames, ns, 64 * 64 * 4);
+
+    dri2_info.DestroyBuffer(&client.pWin->drawable, client.back);
+    ump_mapped_pointer_release(client.handle);
+    ump_reference_release(client.handle);
+    destroy_window(client.pWin);
+}
+
+/*
+ * The window gets resized right after the first buffer request. The second
+ * request gets the dummy buffer, which makes the blob start over with the
+ * new window size.
+ */
+static void replay_resize(int frames)
+{
+    Client client = { create_window(screen.root, 0, 0, 300, 200) };
+    uint64_t ns = 0;
+    int i, w = 300, h = 200, resizes = 0;
+
+    mock_ump_reset_stats();
+    for (i = 0; i < frames; i++) {
+        uint32_t color = (i & 1) ? BLUE : YELLOW;
+        int new_w = 300 + (i % 7) * 16, new_h = 200 + (i % 5) * 16;
+
+        request_back_buffer(&client);
+        render(&client, color, 0, 0, w, h);
+        ns += swap(&client, 0, 0, w, h);
+        CHECK(window_has_color(client.pWin, color), "resize: frame %d", i);
+
+        set_window_geometry(client.pWin, 0, 0, new_w, new_h);
+        request_back_buffer(&client);
+        if (new_w != w || new_h != h) {
+            CHECK(got_null_buffer(&client),
+                  "resize: no dummy buffer after the resize (frame %d)", i);
+            w = new_w;
+            h = new_h;
+            resizes++;
+            continue;
+        }
+        CHECK(!got_null_buffer(&client), "resize: unexpected dummy buffer");
+        render(&client, color, 0, 0, w, h);
+        ns += swap(&client, 0, 0, w, h);
+    }
+    CHECK(mock_ump_get_stats()->errors == 0, "resize: libUMP misuse");
+    CHECK(GetWindowState(&client.pWin->drawable)->stats.resize_recoveries ==
+          resizes, "resize: the resize recoveries are not counted");
+    print_stats("resize", frames, ns, 300 * 200 * 4);
+
+    dri2_info.DestroyBuffer(&client.pWin->drawable, client.back);
+    if (client.handle != UMP_INVALID_MEMORY_HANDLE) {
+        ump_mapped_pointer_release(client.handle);
+        ump_reference_release(client.handle);
+    }
+    destroy_window(client.pWin);
+}
+
+/*
+ * The released back buffer of a window goes to the pool. It may be
+ * recycled for the same window, but never for a window of another client.
+ */
+static void replay_pool(void)
+{
+    Client a = { create_window(screen.root, 0, 0, 300, 200) };
+    Client b = { NULL };
+    ump_secure_id old_id;
+
+    request_back_buffer(&a);
+    render(&a, YELLOW, 0, 0, 300, 200);
+    swap(&a, 0, 0, 300, 200);
+    old_id = a.back->name;
+
+    /* The resize releases the buffer (and gets the dummy one) */
+    set_window_geometry(a.pWin, 0, 0, 400, 300);
+    request_back_buffer(&a);
+    CHECK(got_null_buffer(&a), "pool: no dummy buffer after the resize");
+    advance_time(UMP_POOL_QUARANTINE_MS * 2);
+
+    mock_ump_reset_stats();
+    b.pWin = create_window(screen.root, 400, 0, 300, 200);
+    request_back_buffer(&b);
+    CHECK(b.back->name != old_id,
+          "pool: the buffer of one window is recycled for another one");
+    CHECK(mock_ump_get_stats()->allocations == 1,
+          "pool: %lu allocations instead of 1",
+          mock_ump_get_stats()->allocations);
+
+    set_window_geometry(a.pWin, 0, 0, 300, 200);
+    request_back_buffer(&a);
+    request_back_buffer(&a);
+    CHECK(a.back->name == old_id,
+          "pool: the buffer is not recycled for the same window");
+    CHECK(mock_ump_get_stats()->errors == 0, "pool: libUMP misuse");
+
+    dri2_info.DestroyBuffer(&b.pWin->drawable, b.back);
+    ump_mapped_pointer_release(b.handle);
+    ump_reference_release(b.handle);
+    destroy_window(b.pWin);
+    dri2_info.DestroyBuffer(&a.pWin->drawable, a.back);
+    ump_mapped_pointer_release(a.handle);
+    ump_reference_release(a.handle);
+    destroy_window(a.pWin);
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 200;
+
+    init_screen();
+    if (!(fbdev.SunxiMaliDRI2_private = SunxiMaliDRI2_Init(&screen, FALSE, FALSE))) {
+        printf("SunxiMaliDRI2_Init failed\n");
+        return 1;
+    }
+    SunxiMaliDRI2_EnableSwapStats(&screen);
+
+    replay_flip(frames);
+    replay_partial(frames);
+    replay_resize(frames);
+    replay_pool();
+
+    SunxiMaliDRI2_Close(&screen);
+    free(fbdev.SunxiMaliDRI2_private);
+
+    CHECK(mock_ump_get_stats()->live_buffers == 0,
+          "%lu UMP buffers leaked", mock_ump_get_stats()->live_buffers);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
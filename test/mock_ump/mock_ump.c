@@ -0,0 +1,306 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A libUMP stand-in for desktop hosts. Every buffer is a memfd mapped
+ * into the process, the secure ids are small integers and the handles
+ * point to the buffer records. The cache maintenance is a no-op apart
+ * from validating the arguments and accounting the requested work.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "mock_ump.h"
+#include <ump/ump_ref_drv.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+typedef struct mock_ump_buffer {
+    struct mock_ump_buffer *next;
+    ump_secure_id           secure_id;
+    int                     refcount;
+    int                     fd;
+    unsigned long           size;
+    void                   *addr;
+    int                     cached;
+    ump_hw_usage            hw_usage;
+} mock_ump_buffer;
+
+static mock_ump_buffer *buffers;
+static ump_secure_id    next_secure_id = 1;
+static int              open_count;
+static int              cache_batch_active;
+static mock_ump_stats_t stats;
+
+static void mock_ump_error(const char *fmt, const char *func)
+{
+    fprintf(stderr, "mock_ump: %s: %s\n", func, fmt);
+    stats.errors++;
+}
+
+static mock_ump_buffer *lookup_handle(ump_handle mem, const char *func)
+{
+    mock_ump_buffer *buf;
+    for (buf = buffers; buf; buf = buf->next) {
+        if (buf == (mock_ump_buffer *)mem)
+            return buf;
+    }
+    mock_ump_error("invalid handle", func);
+    return NULL;
+}
+
+static mock_ump_buffer *lookup_secure_id(ump_secure_id secure_id)
+{
+    mock_ump_buffer *buf;
+    for (buf = buffers; buf; buf = buf->next) {
+        if (buf->secure_id == secure_id)
+            return buf;
+    }
+    return NULL;
+}
+
+static void destroy_buffer(mock_ump_buffer *buf)
+{
+    mock_ump_buffer **p = &buffers;
+    while (*p != buf)
+        p = &(*p)->next;
+    *p = buf->next;
+    munmap(buf->addr, buf->size);
+    close(buf->fd);
+    stats.live_buffers--;
+    stats.live_bytes -= buf->size;
+    free(buf);
+}
+
+ump_result ump_open(void)
+{
+    open_count++;
+    return UMP_OK;
+}
+
+void ump_close(void)
+{
+    if (open_count <= 0) {
+        mock_ump_error("not opened", __func__);
+        return;
+    }
+    open_count--;
+}
+
+ump_handle ump_ref_drv_allocate(unsigned long size,
+                                ump_alloc_constraints usage)
+{
+    mock_ump_buffer *buf;
+
+    if (open_count <= 0) {
+        mock_ump_error("not opened", __func__);
+        return UMP_INVALID_MEMORY_HANDLE;
+    }
+    if (size == 0)
+        return UMP_INVALID_MEMORY_HANDLE;
+
+    /* The real allocator works with whole pages */
+    size = (size + 4095) & ~4095UL;
+
+    buf = calloc(1, sizeof(*buf));
+    if (!buf)
+        return UMP_INVALID_MEMORY_HANDLE;
+    buf->fd = syscall(__NR_memfd_create, "mock-ump", MFD_CLOEXEC);
+    if (buf->fd < 0 || ftruncate(buf->fd, size) < 0) {
+        if (buf->fd >= 0)
+            close(buf->fd);
+        free(buf);
+        return UMP_INVALID_MEMORY_HANDLE;
+    }
+    buf->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     buf->fd, 0);
+    if (buf->addr == MAP_FAILED) {
+        close(buf->fd);
+        free(buf);
+        return UMP_INVALID_MEMORY_HANDLE;
+    }
+    buf->size      = size;
+    buf->refcount  = 1;
+    buf->secure_id = next_secure_id++;
+    buf->cached    = (usage & UMP_REF_DRV_CONSTRAINT_USE_CACHE) != 0;
+    buf->hw_usage  = UMP_USED_BY_CPU;
+    buf->next      = buffers;
+    buffers        = buf;
+
+    stats.allocations++;
+    stats.live_buffers++;
+    stats.live_bytes += size;
+    return (ump_handle)buf;
+}
+
+ump_secure_id ump_secure_id_get(ump_handle mem)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    return buf ? buf->secure_id : UMP_INVALID_SECURE_ID;
+}
+
+ump_handle ump_handle_create_from_secure_id(ump_secure_id secure_id)
+{
+    mock_ump_buffer *buf = lookup_secure_id(secure_id);
+    if (!buf)
+        return UMP_INVALID_MEMORY_HANDLE;
+    buf->refcount++;
+    return (ump_handle)buf;
+}
+
+unsigned long ump_size_get(ump_handle mem)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    return buf ? buf->size : 0;
+}
+
+void *ump_mapped_pointer_get(ump_handle mem)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    return buf ? buf->addr : NULL;
+}
+
+void ump_mapped_pointer_release(ump_handle mem)
+{
+    lookup_handle(mem, __func__);
+}
+
+void ump_reference_add(ump_handle mem)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    if (buf)
+        buf->refcount++;
+}
+
+void ump_reference_release(ump_handle mem)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    if (buf && --buf->refcount == 0)
+        destroy_buffer(buf);
+}
+
+void ump_cpu_msync_now(ump_handle mem, ump_cpu_msync_op op,
+                       void *address, int size)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    char *start, *end;
+
+    if (!buf)
+        return;
+    if (op == UMP_MSYNC_READOUT_CACHE_ENABLED)
+        return;
+    if (op != UMP_MSYNC_CLEAN && op != UMP_MSYNC_CLEAN_AND_INVALIDATE &&
+        op != UMP_MSYNC_INVALIDATE) {
+        mock_ump_error("invalid operation", __func__);
+        return;
+    }
+    start = (char *)buf->addr;
+    end   = start + buf->size;
+    if (size < 0 || (char *)address < start ||
+        (char *)address + size > end) {
+        mock_ump_error("range outside of the buffer", __func__);
+        return;
+    }
+    stats.msync_calls++;
+    if (buf->cached)
+        stats.msync_bytes += size;
+}
+
+void ump_cache_operations_control(ump_cache_op_control op)
+{
+    if (op == UMP_CACHE_OP_START) {
+        if (cache_batch_active)
+            mock_ump_error("nested UMP_CACHE_OP_START", __func__);
+        cache_batch_active = 1;
+    }
+    else if (op == UMP_CACHE_OP_FINISH) {
+        if (!cache_batch_active)
+            mock_ump_error("UMP_CACHE_OP_FINISH without START", __func__);
+        else
+            stats.cache_batches++;
+        cache_batch_active = 0;
+    }
+    else {
+        mock_ump_error("invalid operation", __func__);
+    }
+}
+
+static void switch_hw_usage(mock_ump_buffer *buf, ump_hw_usage new_user)
+{
+    if (new_user != UMP_USED_BY_CPU && new_user != UMP_USED_BY_MALI &&
+        new_user != UMP_USED_BY_UNKNOWN_DEVICE) {
+        mock_ump_error("invalid hw usage", "ump_switch_hw_usage");
+        return;
+    }
+    stats.hw_usage_switches++;
+    /* Handing a cached buffer over to another user costs a cache flush */
+    if (buf->cached && buf->hw_usage != new_user)
+        stats.switched_bytes += buf->size;
+    buf->hw_usage = new_user;
+}
+
+void ump_switch_hw_usage(ump_handle mem, ump_hw_usage new_user)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    if (buf)
+        switch_hw_usage(buf, new_user);
+}
+
+void ump_switch_hw_usage_secure_id(ump_secure_id secure_id,
+                                   ump_hw_usage new_user)
+{
+    mock_ump_buffer *buf = lookup_secure_id(secure_id);
+    if (!buf) {
+        mock_ump_error("invalid secure id", __func__);
+        return;
+    }
+    switch_hw_usage(buf, new_user);
+}
+
+const mock_ump_stats_t *mock_ump_get_stats(void)
+{
+    return &stats;
+}
+
+void mock_ump_reset_stats(void)
+{
+    unsigned long live_buffers = stats.live_buffers;
+    unsigned long long live_bytes = stats.live_bytes;
+    memset(&stats, 0, sizeof(stats));
+    stats.live_buffers = live_buffers;
+    stats.live_bytes   = live_bytes;
+}
+
+int mock_ump_get_fd(ump_handle mem)
+{
+    mock_ump_buffer *buf = lookup_handle(mem, __func__);
+    return buf ? buf->fd : -1;
+}
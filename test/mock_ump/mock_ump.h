@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MOCK_UMP_H
+#define MOCK_UMP_H
+
+#include <ump/ump.h>
+
+/*
+ * The counters for the operations done through the libUMP stand-in. The
+ * cache maintenance isn't simulated, but its cost is accounted, so that
+ * the tests can check how much work the DRI2 code asks the kernel to do.
+ */
+typedef struct {
+    unsigned long       allocations;      /* ump_ref_drv_allocate calls */
+    unsigned long       live_buffers;
+    unsigned long long  live_bytes;
+    unsigned long       cache_batches;    /* UMP_CACHE_OP_START/FINISH pairs */
+    unsigned long       hw_usage_switches;
+    /* bytes of cached buffers cleaned/invalidated by the usage switches */
+    unsigned long long  switched_bytes;
+    unsigned long       msync_calls;
+    unsigned long long  msync_bytes;
+    unsigned long       errors;           /* API misuse, see stderr */
+} mock_ump_stats_t;
+
+const mock_ump_stats_t *mock_ump_get_stats(void);
+void mock_ump_reset_stats(void);
+
+/* The memfd backing the buffer (for sharing it with another process) */
+int mock_ump_get_fd(ump_handle mem);
+
+#endif
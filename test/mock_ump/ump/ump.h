@@ -0,0 +1,94 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A stand-in for the libUMP API (the subset used by fbturbo), which makes
+ * it possible to build and test the DRI2 code on hosts without Mali. The
+ * buffers are backed by memfd, see test/mock_ump/mock_ump.c
+ */
+
+#ifndef MOCK_UMP_UMP_H
+#define MOCK_UMP_UMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned int ump_secure_id;
+typedef void *ump_handle;
+
+#define UMP_INVALID_SECURE_ID     ((ump_secure_id)-1)
+#define UMP_INVALID_MEMORY_HANDLE ((ump_handle)0)
+
+typedef enum
+{
+    UMP_OK = 0,
+    UMP_ERROR
+} ump_result;
+
+typedef enum
+{
+    UMP_MSYNC_CLEAN = 0,
+    UMP_MSYNC_CLEAN_AND_INVALIDATE = 1,
+    UMP_MSYNC_INVALIDATE = 2,
+    UMP_MSYNC_READOUT_CACHE_ENABLED = 128
+} ump_cpu_msync_op;
+
+typedef enum
+{
+    UMP_CACHE_OP_START = 0,
+    UMP_CACHE_OP_FINISH = 1
+} ump_cache_op_control;
+
+typedef enum
+{
+    UMP_USED_BY_CPU = 0,
+    UMP_USED_BY_MALI = 1,
+    UMP_USED_BY_UNKNOWN_DEVICE = 100
+} ump_hw_usage;
+
+ump_result ump_open(void);
+void ump_close(void);
+
+ump_secure_id ump_secure_id_get(ump_handle mem);
+ump_handle ump_handle_create_from_secure_id(ump_secure_id secure_id);
+unsigned long ump_size_get(ump_handle mem);
+
+void *ump_mapped_pointer_get(ump_handle mem);
+void ump_mapped_pointer_release(ump_handle mem);
+
+void ump_reference_add(ump_handle mem);
+void ump_reference_release(ump_handle mem);
+
+void ump_cpu_msync_now(ump_handle mem, ump_cpu_msync_op op,
+                       void *address, int size);
+void ump_cache_operations_control(ump_cache_op_control op);
+void ump_switch_hw_usage(ump_handle mem, ump_hw_usage new_user);
+void ump_switch_hw_usage_secure_id(ump_secure_id secure_id,
+                                   ump_hw_usage new_user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
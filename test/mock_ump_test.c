@@ -0,0 +1,133 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Unit test for the libUMP stand-in (test/mock_ump), which checks that
+ * the buffers behave like the real UMP memory as far as the DRI2 code is
+ * concerned: secure ids resolve to the same memory, the references keep
+ * the buffers alive and the cache maintenance requests are validated.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mock_ump.h"
+#include <ump/ump_ref_drv.h>
+
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            printf("FAIL: " __VA_ARGS__);                       \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+static void test_alloc_and_share(void)
+{
+    ump_handle h1, h2;
+    ump_secure_id id;
+    unsigned char *p1, *p2;
+
+    h1 = ump_ref_drv_allocate(10000, UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR);
+    CHECK(h1 != UMP_INVALID_MEMORY_HANDLE, "allocation failed");
+    CHECK(ump_size_get(h1) == 12288, "size is not rounded up to pages");
+
+    id = ump_secure_id_get(h1);
+    CHECK(id != UMP_INVALID_SECURE_ID, "no secure id");
+
+    h2 = ump_handle_create_from_secure_id(id);
+    CHECK(h2 != UMP_INVALID_MEMORY_HANDLE, "secure id lookup failed");
+    p1 = ump_mapped_pointer_get(h1);
+    p2 = ump_mapped_pointer_get(h2);
+    memset(p1, 0xA5, 12288);
+    CHECK(p2[0] == 0xA5 && p2[12287] == 0xA5, "memory is not shared");
+
+    /* The buffer stays alive while it is referenced */
+    ump_reference_release(h1);
+    CHECK(mock_ump_get_stats()->live_buffers == 1, "released too early");
+    h1 = ump_handle_create_from_secure_id(id);
+    CHECK(h1 != UMP_INVALID_MEMORY_HANDLE, "secure id is gone");
+    ump_reference_release(h1);
+    ump_reference_release(h2);
+    CHECK(mock_ump_get_stats()->live_buffers == 0, "buffer leaked");
+    CHECK(ump_handle_create_from_secure_id(id) == UMP_INVALID_MEMORY_HANDLE,
+          "stale secure id still resolves");
+}
+
+static void test_cache_operations(void)
+{
+    ump_handle h;
+    char *p;
+    const mock_ump_stats_t *stats = mock_ump_get_stats();
+
+    h = ump_ref_drv_allocate(65536, UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR |
+                                    UMP_REF_DRV_CONSTRAINT_USE_CACHE);
+    p = ump_mapped_pointer_get(h);
+    mock_ump_reset_stats();
+
+    ump_cache_operations_control(UMP_CACHE_OP_START);
+    ump_cpu_msync_now(h, UMP_MSYNC_CLEAN_AND_INVALIDATE, p + 4096, 8192);
+    ump_cpu_msync_now(h, UMP_MSYNC_INVALIDATE, p, 4096);
+    ump_cache_operations_control(UMP_CACHE_OP_FINISH);
+    CHECK(stats->cache_batches == 1, "batch not counted");
+    CHECK(stats->msync_calls == 2 && stats->msync_bytes == 12288,
+          "msync accounting");
+    CHECK(stats->errors == 0, "unexpected errors");
+
+    ump_switch_hw_usage_secure_id(ump_secure_id_get(h), UMP_USED_BY_MALI);
+    ump_switch_hw_usage_secure_id(ump_secure_id_get(h), UMP_USED_BY_MALI);
+    CHECK(stats->hw_usage_switches == 2, "switches not counted");
+    CHECK(stats->switched_bytes == 65536,
+          "only the change of the user needs a cache flush");
+
+    /* Misuse is reported */
+    ump_cpu_msync_now(h, UMP_MSYNC_CLEAN, p + 65536 - 100, 200);
+    ump_cache_operations_control(UMP_CACHE_OP_FINISH);
+    ump_cache_operations_control(UMP_CACHE_OP_START);
+    ump_cache_operations_control(UMP_CACHE_OP_START);
+    ump_cache_operations_control(UMP_CACHE_OP_FINISH);
+    CHECK(stats->errors == 3, "%lu errors instead of 3", stats->errors);
+
+    ump_reference_release(h);
+}
+
+int main(void)
+{
+    CHECK(ump_open() == UMP_OK, "ump_open failed");
+
+    test_alloc_and_share();
+    test_cache_operations();
+
+    ump_close();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Unit test for the offscreen framebuffer memory allocators of sunxi_disp
+ * (the overlay area shared by XV and DRI2, and the backing store pool).
+ * No hardware is needed, only the framebuffer geometry is set up.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../src/sunxi_disp.h"
+
+static int failures;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            printf("FAIL: " __VA_ARGS__);                       \
+            printf("\n");                                       \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+/* A 32bpp framebuffer with the given number of screen sized pages */
+static sunxi_disp_t *create_disp(int xres, int yres, int pages)
+{
+    sunxi_disp_t *disp = calloc(1, sizeof(sunxi_disp_t));
+    disp->xres = xres;
+    disp->yres = yres;
+    disp->bits_per_pixel = 32;
+    disp->gfx_layer_size = xres * yres * 4;
+    disp->framebuffer_size = disp->gfx_layer_size * pages;
+    disp->framebuffer_height = yres * pages;
+    disp->offscreen_limit = disp->framebuffer_size;
+    return disp;
+}
+
+static void destroy_disp(sunxi_disp_t *disp)
+{
+    /* sunxi_disp_close() needs the device, everything must be freed here */
+    CHECK(!disp->overlay_blocks && !disp->offscreen_blocks,
+          "all the blocks are freed");
+    free(disp);
+}
+
+/* The size of a YV12 frame, as laid out by the XV code */
+static uint32_t yv12_size(int width, int height)
+{
+    int uv_stride = ((width >> 1) + 15) & ~15;
+    return uv_stride * 2 * height + uv_stride * height;
+}
+
+/*
+ * 1920x1080 with two pages: the overlays want more than the single
+ * offscreen page (fbdev.c caps the reservation), XV gets as many buffers
+ * as fit and DRI2 gets the memory when XV is idle.
+ */
+static void test_two_pages_1080p(void)
+{
+    sunxi_disp_t *disp = create_disp(1920, 1080, 2);
+    uint32_t frame = yv12_size(1920, 1080);
+    uint32_t window = 1280 * 720 * 4 * 2;    /* double buffered 720p window */
+    uint32_t xv, dri2;
+    int n;
+
+    CHECK(sunxi_offscreen_set_reserved_size(disp, (uint32_t)-1) == 0,
+          "set the reserved size");
+    CHECK(disp->offscreen_limit == disp->framebuffer_size,
+          "the whole offscreen page is reserved");
+    CHECK(sunxi_offscreen_alloc(disp, 4096) == 0,
+          "nothing left for backing store");
+
+    n = 3;
+    xv = sunxi_overlay_area_alloc(disp, frame, &n);
+    CHECK(xv >= disp->gfx_layer_size, "XV ring of 1080p YV12 frames");
+    CHECK(n == 2, "2 of 3 1080p YV12 frames fit (got %d)", n);
+
+    n = 1;
+    CHECK(sunxi_overlay_area_alloc(disp, window, &n) == 0,
+          "no room for DRI2 while XV plays");
+
+    sunxi_overlay_area_free(disp, xv);
+    n = 1;
+    dri2 = sunxi_overlay_area_alloc(disp, window, &n);
+    CHECK(dri2 >= disp->gfx_layer_size && n == 1,
+          "DRI2 gets the memory when XV is idle");
+    CHECK(dri2 + window <= disp->offscreen_limit, "DRI2 area in the reserve");
+
+    /* and XV has to wait for DRI2 now */
+    n = 3;
+    CHECK(sunxi_overlay_area_alloc(disp, frame, &n) == 0,
+          "no room for XV while DRI2 has the memory");
+
+    CHECK(sunxi_offscreen_set_reserved_size(disp, 0) != 0,
+          "the reserve can't change while in use");
+    sunxi_overlay_area_free(disp, dri2);
+
+    destroy_disp(disp);
+}
+
+/* With more pages the backing store pool gets what the overlays don't need */
+static void test_backing_store_pool(void)
+{
+    sunxi_disp_t *disp = create_disp(1280, 720, 4);
+    uint32_t reserve = disp->gfx_layer_size;
+    uint32_t a, b, c, d, ovl;
+    int n;
+
+    CHECK(sunxi_offscreen_set_reserved_size(disp, reserve) == 0,
+          "set the reserved size");
+    CHECK(disp->offscreen_limit == 2 * disp->gfx_layer_size,
+          "the reserve follows the primary layer");
+
+    a = sunxi_offscreen_alloc(disp, disp->gfx_layer_size);
+    b = sunxi_offscreen_alloc(disp, disp->gfx_layer_size);
+    CHECK(a == disp->offscreen_limit && b == a + disp->gfx_layer_size,
+          "the pool starts above the reserve");
+    CHECK(sunxi_offscreen_alloc(disp, 64) == 0, "the pool is full");
+
+    /* the freed hole is reused first fit */
+    sunxi_offscreen_free(disp, a);
+    c = sunxi_offscreen_alloc(disp, 100);
+    CHECK(c == a, "first fit");
+    d = sunxi_offscreen_alloc(disp, 100);
+    CHECK(d == a + 128, "64 byte alignment");
+
+    /* the overlays can't get into the pool */
+    n = 2;
+    ovl = sunxi_overlay_area_alloc(disp, reserve, &n);
+    CHECK(ovl != 0 && n == 1,
+          "one screen sized overlay buffer fits in the reserve");
+    n = 1;
+    CHECK(sunxi_overlay_area_alloc(disp, 64, &n) == 0, "the reserve is full");
+
+    sunxi_overlay_area_free(disp, ovl);
+    sunxi_offscreen_free(disp, b);
+    sunxi_offscreen_free(disp, c);
+    sunxi_offscreen_free(disp, d);
+
+    destroy_disp(disp);
+}
+
+int main(void)
+{
+    test_two_pages_1080p();
+    test_backing_store_pool();
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -79,7 +79,7 @@ void disp_destructor(int signum)
 
 int main(int argc, char *argv[])
 {
-    int pos = 0, framenum = 0, yoffs, color;
+    int pos = 0, framenum = 0, yoffs, color, layer;
 
     disp = sunxi_disp_init("/dev/fb0", NULL);
     /*
@@ -108,6 +108,12 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    layer = sunxi_layer_reserve(disp);
+    if (layer < 0) {
+        printf("sunxi_layer_reserve() failed\n");
+        exit(1);
+    }
+
     printf("\nYou should see some tear-free animation where the left half\n");
     printf("of the screen is filled with yellow color, the right half of the\n");
     printf("screen is black and the border between yellow and black areas is\n");
@@ -119,12 +125,14 @@ int main(int argc, char *argv[])
     printf("This demo can be stopped by pressing Ctrl-C.\n");
 
     /* setup layer window to cover the whole screen */
-    sunxi_layer_set_output_window(disp, 0, 0, disp->xres, disp->yres);
+    sunxi_layer_set_output_window(disp, layer,
+                                  0, 0, disp->xres, disp->yres);
     /* setup the layer scanout buffer to the first page in the framebuffer */
-    sunxi_layer_set_rgb_input_buffer(disp, disp->bits_per_pixel,
+    sunxi_layer_set_rgb_input_buffer(disp, layer,
+                                     disp->bits_per_pixel,
                                      0, disp->xres, disp->yres, disp->xres);
     /* make the layer visible */
-    sunxi_layer_show(disp);
+    sunxi_layer_show(disp, layer);
 
     while (1) {
         if (framenum % 2 == 1) {
@@ -149,7 +157,8 @@ int main(int argc, char *argv[])
                          color);
 
         /* schedule the change of layer scanout buffer on next vsync */
-        sunxi_layer_set_rgb_input_buffer(disp, disp->bits_per_pixel,
+        sunxi_layer_set_rgb_input_buffer(disp, layer,
+                                         disp->bits_per_pixel,
                                          yoffs * disp->xres * 4,
                                          disp->xres, disp->yres, disp->xres);
         /* wait for the vsync itself */